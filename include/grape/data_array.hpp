@@ -12,20 +12,31 @@ namespace ioremap { namespace grape {
 
 class data_array {
 	public:
-		void append(const char *data, size_t size, const entry_id &id);
+		// Entry flags
+		enum {
+			// entry data is serialized blob_ref (see envelope.hpp),
+			// its payload is stored as an object of its own
+			BLOB = 1,
+		};
+
+		void append(const char *data, size_t size, const entry_id &id, int flags = 0);
 		void extend(const data_array &d);
 
 		const std::vector<entry_id> &ids() const;
 		const std::vector<int> &sizes() const;
 		const std::string &data() const;
+		// arrays of older queues have no flags at all
+		const std::vector<int> &flags() const;
 
+		bool blob(size_t index) const;
 		bool empty() const;
 
-		MSGPACK_DEFINE(m_id, m_size, m_data);
+		MSGPACK_DEFINE(m_id, m_size, m_data, m_flags);
 	private:
 		std::vector<entry_id> m_id;
 		std::vector<int> m_size;
 		std::string m_data;
+		std::vector<int> m_flags;
 };
 
 template <class T>
@@ -14,6 +14,14 @@ struct entry_id {
         return *(entry_id *)(id->id + DNET_ID_SIZE - sizeof(entry_id));
     }
 
+    bool operator<(const entry_id &other) const {
+        return chunk < other.chunk || (chunk == other.chunk && pos < other.pos);
+    }
+
+    bool operator==(const entry_id &other) const {
+        return chunk == other.chunk && pos == other.pos;
+    }
+
     MSGPACK_DEFINE(chunk, pos);
 };
 
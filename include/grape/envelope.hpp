@@ -0,0 +1,151 @@
+#ifndef __GRAPE_ENVELOPE_HPP
+#define __GRAPE_ENVELOPE_HPP
+
+#include <string>
+#include <vector>
+#include <msgpack.hpp>
+
+#include <grape/entry_id.hpp>
+
+namespace ioremap { namespace grape {
+
+// Single operation of the queue@batch request
+struct queue_operation {
+	enum {
+		ACK = 1,
+		TOUCH = 2,
+		PEEK = 3,
+	};
+
+	int type;
+
+	// ACK and TOUCH: entries to act upon
+	std::vector<entry_id> ids;
+
+	// PEEK: up to @num entries of no more than @max_bytes total size
+	// (zero means no limit), held up to @max_wait seconds on empty queue
+	int num;
+	uint64_t max_bytes;
+	double max_wait;
+
+	queue_operation() : type(0), num(0), max_bytes(0), max_wait(0) {}
+
+	static queue_operation ack(const std::vector<entry_id> &ids) {
+		queue_operation op;
+		op.type = ACK;
+		op.ids = ids;
+		return op;
+	}
+
+	static queue_operation touch(const std::vector<entry_id> &ids) {
+		queue_operation op;
+		op.type = TOUCH;
+		op.ids = ids;
+		return op;
+	}
+
+	static queue_operation peek(int num, uint64_t max_bytes = 0, double max_wait = 0) {
+		queue_operation op;
+		op.type = PEEK;
+		op.num = num;
+		op.max_bytes = max_bytes;
+		op.max_wait = max_wait;
+		return op;
+	}
+
+	MSGPACK_DEFINE(type, ids, num, max_bytes, max_wait);
+};
+
+// Operations of the envelope are executed in order within one exec,
+// entries of all peeks are replied as one data_array.
+// Queue refuses envelopes of the version it doesn't know.
+struct envelope {
+	static const int VERSION = 1;
+
+	int version;
+	std::vector<queue_operation> operations;
+
+	// consumer group operations act for, empty name is the default group
+	std::string group;
+
+	envelope() : version(VERSION) {}
+
+	MSGPACK_DEFINE(version, operations, group);
+};
+
+// Version of the serialized envelope, decoded before the rest of it,
+// so that envelope of another version is refused whatever its layout is.
+// Throws msgpack::type_error if data is not an envelope of any version
+inline int envelope_version(const char *data, size_t size) {
+	msgpack::unpacked msg;
+	msgpack::unpack(&msg, data, size);
+
+	msgpack::object obj = msg.get();
+	if (obj.type != msgpack::type::ARRAY || obj.via.array.size == 0) {
+		throw msgpack::type_error();
+	}
+
+	int version;
+	obj.via.array.ptr[0].convert(&version);
+	return version;
+}
+
+// Reply of the queue@depth request: backlog of a consumer group over all priority classes
+struct queue_depth {
+	// entries not yet delivered and their bytes
+	uint64_t pending;
+	uint64_t pending_bytes;
+	// entries delivered but not yet acked
+	uint64_t in_flight;
+	// seconds since the oldest chunk the group has entries to deliver or ack in was created
+	double age;
+
+	queue_depth() : pending(0), pending_bytes(0), in_flight(0), age(0) {}
+
+	MSGPACK_DEFINE(pending, pending_bytes, in_flight, age);
+};
+
+// Data of the entry delivered with data_array::BLOB flag: entries larger than
+// the queue's blob threshold are stored as objects of their own, consumers read
+// the payload from @key, whole or in ranges of their choice
+struct blob_ref {
+	std::string key;
+	uint64_t size;
+
+	blob_ref() : size(0) {}
+
+	MSGPACK_DEFINE(key, size);
+};
+
+// Argument of the queue@push-entry request: entry data along with its
+// delivery options, options left unset keep their defaults
+struct push_request {
+	std::string data;
+
+	// entries of the same non-empty key are never in flight
+	// to two consumers at once and are given away in order
+	std::string key;
+
+	// priority class, entries of higher classes are given away first
+	int priority;
+
+	// unix time (in seconds) entry is not given away before,
+	// zero or a moment in the past means right away
+	double not_before;
+
+	// name of the producer, pushes are rate limited per producer
+	std::string producer;
+
+	// Sequence number of the entry among entries of its producer, pushes of
+	// a sequence number the queue has already taken are dropped (so that retries
+	// are safe). Zero means entry is not deduplicated
+	uint64_t sequence;
+
+	push_request() : priority(0), not_before(0), sequence(0) {}
+
+	MSGPACK_DEFINE(data, key, priority, not_before, producer, sequence);
+};
+
+}}
+
+#endif /* __GRAPE_ENVELOPE_HPP */
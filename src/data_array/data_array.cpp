@@ -3,16 +3,24 @@
 using namespace ioremap;
 using namespace ioremap::grape;
 
-void data_array::append(const char *data, size_t size, const entry_id &id)
+void data_array::append(const char *data, size_t size, const entry_id &id, int flags)
 {
 	size_t old_data_size = m_data.size();
+	size_t old_sizes_size = m_size.size();
+	size_t old_ids_size = m_id.size();
+	size_t old_flags_size = m_flags.size();
 
 	try {
 		m_data.insert(m_data.end(), data, data + size);
 		m_size.push_back(size);
 		m_id.push_back(id);
+		m_flags.resize(m_id.size() - 1);
+		m_flags.push_back(flags);
 	} catch (...) {
 		m_data.resize(old_data_size);
+		m_size.resize(old_sizes_size);
+		m_id.resize(old_ids_size);
+		m_flags.resize(old_flags_size);
 		throw;
 	}
 }
@@ -22,15 +30,20 @@ void data_array::extend(const data_array &d)
 	size_t old_data_size = m_data.size();
 	size_t old_sizes_size = m_size.size();
 	size_t old_ids_size = m_id.size();
+	size_t old_flags_size = m_flags.size();
 
 	try {
 		m_data.insert(m_data.end(), d.data().begin(), d.data().end());
 		m_size.insert(m_size.end(), d.sizes().begin(), d.sizes().end());
 		m_id.insert(m_id.end(), d.ids().begin(), d.ids().end());
+		m_flags.resize(old_ids_size);
+		m_flags.insert(m_flags.end(), d.flags().begin(), d.flags().end());
+		m_flags.resize(m_id.size());
 	} catch (...) {
 		m_data.resize(old_data_size);
 		m_size.resize(old_sizes_size);
 		m_id.resize(old_ids_size);
+		m_flags.resize(old_flags_size);
 		throw;
 	}
 }
@@ -50,6 +63,16 @@ const std::string &data_array::data(void) const
 	return m_data;
 }
 
+const std::vector<int> &data_array::flags(void) const
+{
+	return m_flags;
+}
+
+bool data_array::blob(size_t index) const
+{
+	return index < m_flags.size() && (m_flags[index] & BLOB);
+}
+
 bool data_array::empty(void) const
 {
 	return m_size.empty();
@@ -48,11 +48,16 @@ queue_driver::queue_driver(cocaine::context_t& context, cocaine::io::reactor_t &
 	, m_app(app)
 	, m_log(new cocaine::logging::log_t(context, cocaine::format("driver/%s", name)))
 	, m_idle_timer(reactor.native())
+	, m_touch_timer(reactor.native())
 	, m_queue_name(args.get("source-queue-app", "queue").asString())
 	, m_worker_event(args.get("worker-emit-event", "emit").asString())
 	, m_queue_pop_event(m_queue_name + "@" + args.get("source-queue-pop-event", "pop-multiple-string").asString())
+	, m_queue_touch_event(m_queue_name + "@" + args.get("source-queue-touch-event", "touch-multi").asString())
 	, m_timeout(args.get("timeout", 0.0f).asDouble())
 	, m_deadline(args.get("deadline", 0.0f).asDouble())
+	, m_touch_interval(args.get("touch-interval", 0.0f).asDouble())
+	, m_queue_wait(args.get("source-queue-wait", 0.0f).asDouble())
+	, m_queue_request_bytes(args.get("source-queue-request-bytes", 0).asUInt())
 	, m_queue_length(0)
 	, m_queue_length_max(0)
 	, m_factor(0)
@@ -104,14 +109,25 @@ queue_driver::queue_driver(cocaine::context_t& context, cocaine::io::reactor_t &
 	m_queue_length_max = queue_limit * 9 / 10;
 
 	m_idle_timer.set<queue_driver, &queue_driver::on_idle_timer_event>(this);
-	m_idle_timer.set(0.0f, 1.0f);
+	// Waiting requests stay in flight while the queue is empty,
+	// so there is no point in checking the queue more often than they expire
+	m_idle_timer.set(0.0f, std::max(1.0, m_queue_wait));
 	m_idle_timer.again();
 
+	// Touching makes sense only when entries are peeked (not popped)
+	// from the queue and acked by the worker itself.
+	if (m_touch_interval > 0) {
+		m_touch_timer.set<queue_driver, &queue_driver::on_touch_timer_event>(this);
+		m_touch_timer.set(0.0f, m_touch_interval);
+		m_touch_timer.again();
+	}
+
 	COCAINE_LOG_INFO(m_log, "init: %s driver started", m_queue_name.c_str());
 }
 
 queue_driver::~queue_driver()
 {
+	m_touch_timer.stop();
 	m_idle_timer.stop();
 }
 
@@ -135,6 +151,38 @@ void queue_driver::on_idle_timer_event(ev::timer &, int)
 	get_more_data();
 }
 
+void queue_driver::on_touch_timer_event(ev::timer &, int)
+{
+	std::lock_guard<std::mutex> guard(m_in_flight_mutex);
+
+	COCAINE_LOG_INFO(m_log, "%s: timer: touching %ld blocks in processing",
+			m_queue_name.c_str(), m_in_flight.size());
+
+	for (auto i = m_in_flight.begin(); i != m_in_flight.end(); ++i) {
+		downstream_t *downstream = *i;
+		if (downstream->m_ids.empty()) {
+			continue;
+		}
+
+		ioremap::elliptics::session sess = m_client.create_session();
+		sess.set_groups(m_queue_groups);
+		sess.set_exceptions_policy(ioremap::elliptics::session::no_exceptions);
+
+		size_t count = downstream->m_ids.size();
+		std::string queue_name = m_queue_name;
+		auto log = m_log;
+		sess.exec(downstream->m_context, m_queue_touch_event, ioremap::grape::serialize(downstream->m_ids)).connect(
+			ioremap::elliptics::async_result<ioremap::elliptics::exec_result_entry>::result_function(),
+			[log, queue_name, count] (const ioremap::elliptics::error_info &error) {
+				if (error) {
+					COCAINE_LOG_ERROR(log, "%s: %ld entries not touched: %s",
+						queue_name.c_str(), count, error.message().c_str());
+				}
+			}
+		);
+	}
+}
+
 void queue_driver::get_more_data()
 {
 	COCAINE_LOG_INFO(m_log, "%s: more-data: checking queue: queue-len: %d/%d",
@@ -163,7 +211,16 @@ void queue_driver::get_more_data()
 		queue_inc(1);
 
 		sess.set_exceptions_policy(ioremap::elliptics::session::no_exceptions);
-		sess.exec(&req->id, req->src_key, m_queue_pop_event, std::to_string(req->num)).connect(
+		// number of entries, then optional max wait time and max total size in bytes
+		std::string arg = std::to_string(req->num);
+		if (m_queue_wait > 0 || m_queue_request_bytes > 0) {
+			arg += " " + std::to_string(m_queue_wait);
+		}
+		if (m_queue_request_bytes > 0) {
+			arg += " " + std::to_string(m_queue_request_bytes);
+		}
+
+		sess.exec(&req->id, req->src_key, m_queue_pop_event, arg).connect(
 			std::bind(&queue_driver::on_queue_request_data, this, req, std::placeholders::_1),
 			std::bind(&queue_driver::on_queue_request_complete, this, req, std::placeholders::_1)
 		);
@@ -249,7 +306,7 @@ bool queue_driver::process_data(const ioremap::elliptics::exec_context &context)
 	// Pass data to the worker, return it back to the local queue if failed.
 
 	try {
-		auto downstream = std::make_shared<downstream_t>(this, context.data());
+		auto downstream = std::make_shared<downstream_t>(this, context);
 
 		// this map should be used to store iteration counter
 		//m_events.insert(std::make_pair(static_cast<const int>(sph->src_key), data.to_string()));
@@ -280,14 +337,28 @@ void queue_driver::queue_inc(int num)
 	m_queue_length += num;
 }
 
-queue_driver::downstream_t::downstream_t(queue_driver *queue, const ioremap::elliptics::data_pointer &d)
-	: m_queue(queue), m_data(d), m_attempts(0)
+queue_driver::downstream_t::downstream_t(queue_driver *queue, const ioremap::elliptics::exec_context &context)
+	: m_queue(queue), m_context(context), m_attempts(0)
 {
 	m_queue->queue_inc(1);
+
+	if (m_queue->m_touch_interval > 0) {
+		try {
+			m_ids = ioremap::grape::deserialize<ioremap::grape::data_array>(m_context.data()).ids();
+		} catch (const std::exception &e) {
+			COCAINE_LOG_ERROR(m_queue->m_log, "%s: downstream: can't extract entry ids to touch: %s",
+					m_queue->m_queue_name.c_str(), e.what());
+		}
+
+		std::lock_guard<std::mutex> guard(m_queue->m_in_flight_mutex);
+		m_queue->m_in_flight.insert(this);
+	}
 }
 
 queue_driver::downstream_t::~downstream_t()
 {
+	std::lock_guard<std::mutex> guard(m_queue->m_in_flight_mutex);
+	m_queue->m_in_flight.erase(this);
 }
 
 void queue_driver::downstream_t::write(const char *data, size_t size)
@@ -308,6 +379,11 @@ void queue_driver::downstream_t::error(int code, const std::string &msg)
 
 void queue_driver::downstream_t::close()
 {
+	{
+		std::lock_guard<std::mutex> guard(m_queue->m_in_flight_mutex);
+		m_queue->m_in_flight.erase(this);
+	}
+
 	m_queue->queue_dec(1);
 
 	COCAINE_LOG_INFO(m_queue->m_log, "%s: downstream: close: attempts (was-error): %d",
@@ -21,8 +21,10 @@
 #define __GRAPE_QUEUE_DRIVER_HPP
 
 #include "grape/elliptics_client_state.hpp"
+#include "grape/entry_id.hpp"
 
 #include <queue>
+#include <set>
 #include <mutex>
 #include <atomic>
 
@@ -41,7 +43,7 @@ class queue_driver: public api::driver_t {
 
 	public:
 		struct downstream_t: public cocaine::api::stream_t {
-			downstream_t(queue_driver *queue, const ioremap::elliptics::data_pointer &d);
+			downstream_t(queue_driver *queue, const ioremap::elliptics::exec_context &context);
 			~downstream_t();
 
 			virtual void write(const char *data, size_t size);
@@ -49,7 +51,8 @@ class queue_driver: public api::driver_t {
 			virtual void close();
 
 			queue_driver *m_queue;
-			const ioremap::elliptics::data_pointer &m_data;
+			ioremap::elliptics::exec_context m_context;
+			std::vector<ioremap::grape::entry_id> m_ids;
 
 			int m_attempts;
 		};
@@ -84,6 +87,7 @@ class queue_driver: public api::driver_t {
 		std::vector<int> m_queue_groups;
 
 		void on_idle_timer_event(ev::timer&, int);
+		void on_touch_timer_event(ev::timer&, int);
 
 		// requests to the queue callbacks
 		void on_queue_request_data(std::shared_ptr<queue_request> req, const ioremap::elliptics::exec_result_entry &result);
@@ -99,6 +103,12 @@ class queue_driver: public api::driver_t {
 		};
 
 		ev::timer m_idle_timer;
+		ev::timer m_touch_timer;
+
+		// blocks currently being processed by workers, their entries
+		// are periodically touched to prevent replay by the queue
+		std::set<downstream_t *> m_in_flight;
+		std::mutex m_in_flight_mutex;
 
 		// std::queue<ioremap::elliptics::data_pointer> m_local_queue;
 		// std::mutex m_local_queue_mutex;
@@ -107,9 +117,15 @@ class queue_driver: public api::driver_t {
 		const std::string m_queue_name;
 		std::string m_worker_event;
 		const std::string m_queue_pop_event;
+		const std::string m_queue_touch_event;
 
 		const double m_timeout;
 		const double m_deadline;
+		const double m_touch_interval;
+		const double m_queue_wait;
+		// blocks are limited in bytes too, which keeps worker queue-limit accounting
+		// (done in blocks) meaningful for entries of varying size
+		const uint64_t m_queue_request_bytes;
 
 		std::atomic_int m_queue_length;
 		std::atomic_int m_queue_length_max;
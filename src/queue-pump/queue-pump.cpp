@@ -1,6 +1,9 @@
 #include <atomic>
+#include <chrono>
+#include <deque>
 #include <iostream>
 #include <mutex>
+#include <thread>
 #include <condition_variable>
 
 #include <boost/program_options.hpp>
@@ -9,6 +12,7 @@
 #include <grape/elliptics_client_state.hpp>
 #include <grape/data_array.hpp>
 #include <grape/entry_id.hpp>
+#include <grape/envelope.hpp>
 
 struct request {
 	dnet_id id;
@@ -31,6 +35,15 @@ private:
 	ioremap::elliptics::session client;
 	const std::string queue_name;
 	const int request_size;
+	const double touch_interval;
+	const double peek_wait;
+	// blocks are limited in bytes too when non-zero, as memory needed
+	// to hold a block is what matters for entries of varying size
+	const uint64_t request_bytes;
+	// Payloads of large entries are read in ranges of this many bytes, zero means
+	// they are read at once. Ranges only bound single reads: they are put together
+	// and proc gets the whole payload, just as for entries stored in chunks
+	const uint64_t blob_range;
 	processing_function proc;
 
 	std::atomic_int next_request_id;
@@ -38,17 +51,53 @@ private:
 	std::mutex mutex;
 	std::condition_variable condition;
 
+	// Blocks are processed (and their blobs read) by the worker thread,
+	// reply callbacks of elliptics must not be blocked for that long
+	std::deque<std::function<void ()>> blocks;
+	std::condition_variable block_condition;
+	std::thread worker;
+
+	// Entries of the block being processed are touched by the toucher thread
+	// every touch_interval seconds till the block is acked (processed entries are
+	// acked along with the block), so that lease of the block doesn't run out
+	// even during a single long proc() call
+	struct block_lease {
+		std::shared_ptr<request> req;
+		ioremap::elliptics::exec_context context;
+		std::vector<ioremap::grape::entry_id> ids;
+		std::chrono::steady_clock::time_point touched;
+	};
+	std::mutex lease_mutex;
+	std::unique_ptr<block_lease> lease;
+	std::thread toucher;
+
 public:
-	queue_pump(ioremap::elliptics::session client, const std::string &queue_name, int request_size)
+	queue_pump(ioremap::elliptics::session client, const std::string &queue_name, int request_size,
+			double touch_interval = 2.0, double peek_wait = 0.0, uint64_t request_bytes = 0,
+			uint64_t blob_range = 0)
 		: client(client)
 		, queue_name(queue_name)
 		, request_size(request_size)
+		, touch_interval(touch_interval)
+		, peek_wait(peek_wait)
+		, request_bytes(request_bytes)
+		, blob_range(blob_range)
 		, next_request_id(0)
 		, running_requests(0)
 	{}
 
+	~queue_pump() {
+		if (worker.joinable()) {
+			worker.detach();
+		}
+		if (toucher.joinable()) {
+			toucher.detach();
+		}
+	}
+
 	void run(processing_function func) {
 		proc = func;
+		start_worker();
 
 		srand(time(NULL));
 
@@ -65,22 +114,142 @@ public:
 		}
 	}
 
-	void queue_peek(ioremap::elliptics::session client, int req_unique_id, int arg)
+	// Alternative to run(): queue streams entries by itself,
+	// every processed block gives it credit for as many entries (and bytes)
+	void subscribe(processing_function func) {
+		proc = func;
+		start_worker();
+
+		srand(time(NULL));
+
+		while(1) {
+			++running_requests;
+			queue_subscribe(client, next_request_id++, request_size);
+
+			// stream ends on error, subscribe anew
+			std::unique_lock<std::mutex> lock(mutex);
+			condition.wait(lock, [this]{return running_requests < 1;});
+		}
+	}
+
+	void queue_subscribe(ioremap::elliptics::session client, int req_unique_id, int credit)
+	{
+		client.set_exceptions_policy(ioremap::elliptics::session::no_exceptions);
+
+		std::string queue_key = std::to_string(req_unique_id) + std::to_string(rand());
+
+		auto req = std::make_shared<request>(req_unique_id);
+		client.transform(queue_key, req->id);
+
+		client.exec(&req->id, req->src_key, "queue@subscribe", credit_arg(credit, request_bytes))
+			.connect(
+				std::bind(&queue_pump::stream_received, this, req, std::placeholders::_1),
+				std::bind(&queue_pump::request_complete, this, req, std::placeholders::_1)
+			);
+	}
+
+	void queue_credit(ioremap::elliptics::session client,
+			std::shared_ptr<request> req,
+			ioremap::elliptics::exec_context context,
+			size_t count, uint64_t bytes)
 	{
 		client.set_exceptions_policy(ioremap::elliptics::session::no_exceptions);
 
+		client.exec(context, "queue@credit", credit_arg(count, bytes))
+			.connect(
+				ioremap::elliptics::async_result<ioremap::elliptics::exec_result_entry>::result_function(),
+				[req, count] (const ioremap::elliptics::error_info &error) {
+					if (error) {
+						fprintf(stderr, "%s %d, credit for %ld entries not granted: %s\n", dnet_dump_id(&req->id), req->src_key, count, error.message().c_str());
+					}
+				}
+			);
+	}
+
+	// bytes are granted only when requests are limited in bytes,
+	// queue doesn't count bytes of subscription which never granted them
+	static std::string credit_arg(size_t entries, uint64_t bytes)
+	{
+		std::string arg = std::to_string(entries);
+		if (bytes > 0) {
+			arg += " " + std::to_string(bytes);
+		}
+		return arg;
+	}
+
+	void stream_received(std::shared_ptr<request> req, const ioremap::elliptics::exec_result_entry &result)
+	{
+		if (result.error()) {
+			fprintf(stderr, "%s %d: error: %s\n", dnet_dump_id(&req->id), req->src_key, result.error().message().c_str());
+			return;
+		}
+
+		ioremap::elliptics::exec_context context = result.context();
+		// see data_received() on why src_key must be restored
+		context.set_src_key(req->src_key);
+
+		// first reply of the stream carries no data
+		if (context.data().empty()) {
+			return;
+		}
+
+		auto array = ioremap::grape::deserialize<ioremap::grape::data_array>(context.data());
+		enqueue_block([this, req, context, array] () {
+			std::vector<ioremap::grape::entry_id> processed = process_block(req, context, array);
+			if (!processed.empty()) {
+				queue_ack(client, req, context, processed);
+			}
+			// credit is given back for the whole block, entries left unprocessed are redelivered anyway
+			queue_credit(client, req, context, array.ids().size(), request_bytes ? array.data().size() : 0);
+		});
+	}
+
+	void queue_peek(ioremap::elliptics::session client, int req_unique_id, int arg)
+	{
 		std::string queue_key = std::to_string(req_unique_id) + std::to_string(rand());
 
 		auto req = std::make_shared<request>(req_unique_id);
 		client.transform(queue_key, req->id);
 
-		client.exec(&req->id, req->src_key, "queue@peek-multi", std::to_string(arg))
+		ioremap::grape::envelope env;
+		env.operations.push_back(peek_operation(arg));
+
+		client.set_exceptions_policy(ioremap::elliptics::session::no_exceptions);
+		client.exec(&req->id, req->src_key, "queue@batch", ioremap::grape::serialize(env))
+			.connect(
+				std::bind(&queue_pump::data_received, this, req, std::placeholders::_1),
+				std::bind(&queue_pump::request_complete, this, req, std::placeholders::_1)
+			);
+	}
+
+	// Acks processed block and asks the same queue instance for the next one
+	// in a single round trip. Reply is handled just like a reply to queue_peek(),
+	// so the chain goes on while the queue has entries to give.
+	void queue_ack_and_peek(ioremap::elliptics::session client,
+			std::shared_ptr<request> req,
+			ioremap::elliptics::exec_context context,
+			const std::vector<ioremap::grape::entry_id> &ids)
+	{
+		ioremap::grape::envelope env;
+		if (!ids.empty()) {
+			env.operations.push_back(ioremap::grape::queue_operation::ack(ids));
+		}
+		env.operations.push_back(peek_operation(request_size));
+
+		client.set_exceptions_policy(ioremap::elliptics::session::no_exceptions);
+		client.exec(context, "queue@batch", ioremap::grape::serialize(env))
 			.connect(
 				std::bind(&queue_pump::data_received, this, req, std::placeholders::_1),
 				std::bind(&queue_pump::request_complete, this, req, std::placeholders::_1)
 			);
 	}
 
+	ioremap::grape::queue_operation peek_operation(int num)
+	{
+		// empty queue holds request up to peek_wait seconds instead of replying at once
+		return ioremap::grape::queue_operation::peek(num, request_bytes, peek_wait);
+	}
+
 	void queue_ack(ioremap::elliptics::session client,
 			std::shared_ptr<request> req,
 			ioremap::elliptics::exec_context context,
@@ -102,6 +271,25 @@ public:
 			);
 	}
 
+	void queue_touch(ioremap::elliptics::session client,
+			std::shared_ptr<request> req,
+			ioremap::elliptics::exec_context context,
+			const std::vector<ioremap::grape::entry_id> &ids)
+	{
+		client.set_exceptions_policy(ioremap::elliptics::session::no_exceptions);
+
+		size_t count = ids.size();
+		client.exec(context, "queue@touch-multi", ioremap::grape::serialize(ids))
+			.connect(
+				ioremap::elliptics::async_result<ioremap::elliptics::exec_result_entry>::result_function(),
+				[req, count] (const ioremap::elliptics::error_info &error) {
+					if (error) {
+						fprintf(stderr, "%s %d, %ld entries not touched: %s\n", dnet_dump_id(&req->id), req->src_key, count, error.message().c_str());
+					}
+				}
+			);
+	}
+
 	void data_received(std::shared_ptr<request> req, const ioremap::elliptics::exec_result_entry &result)
 	{
 		if (result.error()) {
@@ -128,7 +316,81 @@ public:
 		// Which is unfortunate.)
 		context.set_src_key(req->src_key);
 
-		process_block(req, context);
+		auto array = ioremap::grape::deserialize<ioremap::grape::data_array>(context.data());
+
+		// Block waiting for the worker and the request which acks it are counted
+		// before the request which delivered the block completes,
+		// so that run() doesn't start another one in its place
+		++running_requests;
+
+		enqueue_block([this, req, context, array] () {
+			std::vector<ioremap::grape::entry_id> processed = process_block(req, context, array);
+
+			fprintf(stderr, "%s %d, acking %ld entries\n",
+					dnet_dump_id_str(context.src_id()->id), context.src_key(),
+					processed.size()
+					);
+
+			queue_ack_and_peek(client, req, context, processed);
+		});
+	}
+
+	void start_worker()
+	{
+		if (!worker.joinable()) {
+			worker = std::thread(&queue_pump::process_blocks, this);
+		}
+		if (!toucher.joinable() && touch_interval > 0) {
+			toucher = std::thread(&queue_pump::touch_leases, this);
+		}
+	}
+
+	void touch_leases()
+	{
+		while (1) {
+			std::this_thread::sleep_for(std::chrono::duration<double>(touch_interval) / 4);
+
+			std::shared_ptr<request> req;
+			std::unique_ptr<ioremap::elliptics::exec_context> context;
+			std::vector<ioremap::grape::entry_id> ids;
+			{
+				std::lock_guard<std::mutex> lock(lease_mutex);
+
+				auto now = std::chrono::steady_clock::now();
+				if (!lease || std::chrono::duration<double>(now - lease->touched).count() < touch_interval) {
+					continue;
+				}
+
+				req = lease->req;
+				context.reset(new ioremap::elliptics::exec_context(lease->context));
+				ids = lease->ids;
+				lease->touched = now;
+			}
+
+			queue_touch(client, req, *context, ids);
+		}
+	}
+
+	void enqueue_block(std::function<void ()> block)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		blocks.push_back(std::move(block));
+		block_condition.notify_one();
+	}
+
+	void process_blocks()
+	{
+		while (1) {
+			std::function<void ()> block;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				block_condition.wait(lock, [this]{return !blocks.empty();});
+				block = std::move(blocks.front());
+				blocks.pop_front();
+			}
+
+			block();
+		}
 	}
 
 	void request_complete(std::shared_ptr<request> req, const ioremap::elliptics::error_info &error)
@@ -143,14 +405,17 @@ public:
 		condition.notify_one();
 	}
 
-	void process_block(std::shared_ptr<request> req, const ioremap::elliptics::exec_context &context)
+	// Entries of the block are left for the caller to ack,
+	// ids of those which were processed are returned
+	std::vector<ioremap::grape::entry_id> process_block(std::shared_ptr<request> req,
+			const ioremap::elliptics::exec_context &context,
+			const ioremap::grape::data_array &array)
 	{
 		fprintf(stderr, "%s %d, received data, byte size %ld\n",
 				dnet_dump_id_str(context.src_id()->id), context.src_key(),
 				context.data().size()
 				);
 
-		auto array = ioremap::grape::deserialize<ioremap::grape::data_array>(context.data());
 		ioremap::elliptics::data_pointer d = array.data();
 		size_t count = array.sizes().size();
 
@@ -160,24 +425,65 @@ public:
 				count
 				);
 
+		{
+			std::lock_guard<std::mutex> lock(lease_mutex);
+			lease.reset(new block_lease{req, context, array.ids(), std::chrono::steady_clock::now()});
+		}
+
+		std::vector<ioremap::grape::entry_id> processed;
+		processed.reserve(count);
+
 		size_t offset = 0;
 		for (size_t i = 0; i < count; ++i) {
 			const ioremap::grape::entry_id &entry_id = array.ids()[i];
 			int bytesize = array.sizes()[i];
 
+			ioremap::elliptics::data_pointer data = d.slice(offset, bytesize);
+			offset += bytesize;
+
+			// Payloads of large entries are fetched when their turn comes,
+			// entries which payload can't be read are left to be delivered again
 			//TODO: check result of the proc()
-			proc(entry_id, d.slice(offset, bytesize));
+			if (!array.blob(i) || fetch_blob(entry_id, &data)) {
+				try {
+					proc(entry_id, data);
+					processed.push_back(entry_id);
+				} catch (const std::exception &e) {
+					fprintf(stderr, "entry %d-%d, processing failed: %s\n", entry_id.chunk, entry_id.pos, e.what());
+				}
+			}
+		}
 
-			offset += bytesize;
+		{
+			std::lock_guard<std::mutex> lock(lease_mutex);
+			lease.reset();
 		}
 
-		// acknowledge entries
-		fprintf(stderr, "%s %d, acking %ld entries\n",
-				dnet_dump_id_str(context.src_id()->id), context.src_key(),
-				count
-				);
+		return processed;
+	}
+
+	// Replaces blob reference in @data with the whole payload, read range by range
+	bool fetch_blob(const ioremap::grape::entry_id &entry_id, ioremap::elliptics::data_pointer *data)
+	{
+		try {
+			auto ref = ioremap::grape::deserialize<ioremap::grape::blob_ref>(*data);
 
-		queue_ack(client, req, context, array.ids());
+			uint64_t range = blob_range ? blob_range : ref.size;
+			std::string payload;
+			payload.reserve(ref.size);
+
+			for (uint64_t offset = 0; offset < ref.size; offset += range) {
+				ioremap::elliptics::data_pointer d = client.read_data(ref.key,
+						offset, std::min(range, ref.size - offset)).get_one().file();
+				payload.append(d.data<char>(), d.size());
+			}
+
+			*data = ioremap::elliptics::data_pointer::copy(payload.data(), payload.size());
+			return true;
+		} catch (const std::exception &e) {
+			fprintf(stderr, "entry %d-%d, can't read blob: %s\n", entry_id.chunk, entry_id.pos, e.what());
+			return false;
+		}
 	}
 
 };
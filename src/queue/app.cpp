@@ -1,9 +1,18 @@
 #include <fstream>
+#include <sstream>
+#include <map>
+#include <set>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <deque>
 
 #include <cocaine/format.hpp>
 #include <cocaine/framework/logging.hpp>
 #include <cocaine/framework/dispatch.hpp>
 
+#include <grape/envelope.hpp>
+
 #include "queue.hpp"
 
 namespace {
@@ -56,7 +65,10 @@ struct time_stat
 		start_time = microseconds_now();
 	}
 	void stop() {
-		avg = modified_moving_average<19>(avg, microseconds_now() - start_time);
+		add(microseconds_now() - start_time);
+	}
+	void add(uint64_t elapsed) {
+		avg = modified_moving_average<19>(avg, elapsed);
 	}
 
 	double get() {
@@ -64,6 +76,20 @@ struct time_stat
 	}
 };
 
+// Subscription id is embedded into sph of every reply of the subscription stream
+// (the same place where peek puts entry id), so that credit and unsubscribe requests
+// could be sent using context of any reply.
+void set_subscription_id(ioremap::elliptics::exec_context &context, int id) {
+	dnet_raw_id *src = context.src_id();
+	memcpy(&src->id[DNET_ID_SIZE - sizeof(id)], &id, sizeof(id));
+}
+
+int get_subscription_id(const ioremap::elliptics::exec_context &context) {
+	int id;
+	memcpy(&id, &context.src_id()->id[DNET_ID_SIZE - sizeof(id)], sizeof(id));
+	return id;
+}
+
 }
 
 class queue_app_context {
@@ -77,22 +103,63 @@ class queue_app_context {
 		typedef ioremap::grape::data_array peek_multi_type;
 		typedef std::vector<ioremap::grape::entry_id> ack_multi_type;
 
+		void handle(const ioremap::elliptics::exec_context &context);
+		void run_dispatcher();
+
+		// queue@batch request in progress, peeks of the envelope are asynchronous
+		// so the rest of operations is carried on from the peek handler
+		struct batch {
+			ioremap::elliptics::exec_context context;
+			std::string action_id;
+			ioremap::grape::envelope envelope;
+			size_t next;
+			ioremap::grape::data_array result;
+			uint64_t start;
+		};
+
+		void run_batch(std::shared_ptr<batch> b);
+		// Closes stream of the subscription with a final reply,
+		// returns false if it's closed already
+		bool finish_subscription(int id);
+		// Returns reply refusing the push, empty when push is let through
+		std::string admit(const std::string &producer);
+		void push(const ioremap::elliptics::data_pointer &d, const std::string &key, int priority,
+				double not_before = 0, const std::string &producer = std::string(), uint64_t sequence = 0);
+
 		std::string m_id;
 		std::shared_ptr<cocaine::framework::logger_t> m_log;
 		std::shared_ptr<ioremap::grape::queue> m_queue;
 
+		// peek and pop complete on elliptics threads, rate and time stats
+		// are shared with them
+		std::mutex m_stat_mutex;
+
 		rate_stat m_push_rate;
+		std::map<std::string, rate_stat> m_producer_rates;
 		rate_stat m_pop_rate;
 		rate_stat m_ack_rate;
 
 		time_stat m_push_time;
 		time_stat m_pop_time;
 		time_stat m_ack_time;
+
+		// contexts of subscription streams, final reply is sent on unsubscribe
+		std::mutex m_subscriptions_mutex;
+		std::map<int, std::shared_ptr<ioremap::elliptics::exec_context>> m_subscriptions;
+
+		// With dispatch-threads above 1 requests are handed over to a pool of threads
+		// serving them in parallel, dispatch itself is single-threaded
+		std::mutex m_requests_mutex;
+		std::condition_variable m_requests_cond;
+		std::deque<ioremap::elliptics::exec_context> m_requests;
+		std::vector<std::thread> m_dispatchers;
+		bool m_stopping;
 };
 
 queue_app_context::queue_app_context(cocaine::framework::dispatch_t& dispatch)
     : m_id(dispatch.id())
 	, m_log(dispatch.service_manager()->get_system_logger())
+	, m_stopping(false)
 {
 	//FIXME: pass logger explicitly everywhere
 	extern void grape_queue_module_set_logger(std::shared_ptr<cocaine::framework::logger_t>);
@@ -102,9 +169,16 @@ queue_app_context::queue_app_context(cocaine::framework::dispatch_t& dispatch)
 	m_queue->initialize("queue.conf");
 	COCAINE_LOG_INFO(m_log, "%s: queue has been successfully configured", m_id.c_str());
 
+	if (m_queue->dispatch_threads() > 1) {
+		for (int i = 0; i < m_queue->dispatch_threads(); ++i) {
+			m_dispatchers.emplace_back(&queue_app_context::run_dispatcher, this);
+		}
+	}
+
 	// register event handlers
 	dispatch.on("queue@ping", this, &queue_app_context::process);
 	dispatch.on("queue@push", this, &queue_app_context::process);
+	dispatch.on("queue@push-entry", this, &queue_app_context::process);
 	dispatch.on("queue@pop-multi", this, &queue_app_context::process);
 	dispatch.on("queue@pop-multiple-string", this, &queue_app_context::process);
 	dispatch.on("queue@pop", this, &queue_app_context::process);
@@ -112,6 +186,14 @@ queue_app_context::queue_app_context(cocaine::framework::dispatch_t& dispatch)
 	dispatch.on("queue@peek-multi", this, &queue_app_context::process);
 	dispatch.on("queue@ack", this, &queue_app_context::process);
 	dispatch.on("queue@ack-multi", this, &queue_app_context::process);
+	dispatch.on("queue@touch", this, &queue_app_context::process);
+	dispatch.on("queue@touch-multi", this, &queue_app_context::process);
+	dispatch.on("queue@batch", this, &queue_app_context::process);
+	dispatch.on("queue@subscribe", this, &queue_app_context::process);
+	dispatch.on("queue@credit", this, &queue_app_context::process);
+	dispatch.on("queue@unsubscribe", this, &queue_app_context::process);
+	dispatch.on("queue@seek", this, &queue_app_context::process);
+	dispatch.on("queue@depth", this, &queue_app_context::process);
 	dispatch.on("queue@clear", this, &queue_app_context::process);
 	dispatch.on("queue@stats-clear", this, &queue_app_context::process);
 	dispatch.on("queue@stats", this, &queue_app_context::process);
@@ -119,12 +201,59 @@ queue_app_context::queue_app_context(cocaine::framework::dispatch_t& dispatch)
 
 queue_app_context::~queue_app_context()
 {
+	{
+		std::lock_guard<std::mutex> guard(m_requests_mutex);
+		m_stopping = true;
+	}
+	m_requests_cond.notify_all();
+
+	for (auto it = m_dispatchers.begin(); it != m_dispatchers.end(); ++it) {
+		it->join();
+	}
 }
 
 void queue_app_context::process(const std::string &cocaine_event, const std::vector<std::string> &chunks, cocaine::framework::response_ptr response)
 {
 	ioremap::elliptics::exec_context context = ioremap::elliptics::exec_context::from_raw(chunks[0].c_str(), chunks[0].size());
 
+	if (m_dispatchers.empty()) {
+		handle(context);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(m_requests_mutex);
+		m_requests.push_back(context);
+	}
+	m_requests_cond.notify_one();
+}
+
+void queue_app_context::run_dispatcher()
+{
+	while (true) {
+		ioremap::elliptics::exec_context context;
+		{
+			std::unique_lock<std::mutex> guard(m_requests_mutex);
+			m_requests_cond.wait(guard, [this] { return m_stopping || !m_requests.empty(); });
+			if (m_requests.empty()) {
+				return;
+			}
+
+			context = m_requests.front();
+			m_requests.pop_front();
+		}
+
+		try {
+			handle(context);
+		} catch (const std::exception &e) {
+			COCAINE_LOG_ERROR(m_log, "%s: event %s failed: %s",
+					m_id.c_str(), context.event().c_str(), e.what());
+		}
+	}
+}
+
+void queue_app_context::handle(const ioremap::elliptics::exec_context &context)
+{
 	std::string app;
 	std::string event;
 	{
@@ -145,98 +274,163 @@ void queue_app_context::process(const std::string &cocaine_event, const std::vec
 
 	} else if (event == "push") {
 		ioremap::elliptics::data_pointer d = context.data();
-		// skip adding zero length data, because there is no value in that
-		// queue has no method to request size and we can use zero reply in pop
-		// to indicate queue emptiness
-		if (!d.empty()) {
-			m_push_time.start();
-			m_queue->push(d);
-			m_push_time.stop();
-			COCAINE_LOG_INFO(m_log, "push time %ld", microseconds_now() - m_push_time.start_time);
-			m_push_rate.update(1);
+		std::string refusal = admit(std::string());
+		if (!refusal.empty()) {
+			m_queue->final(context, refusal);
+		} else {
+			try {
+				// skip adding zero length data, because there is no value in that
+				// and zero reply in pop indicates queue emptiness
+				if (!d.empty()) {
+					push(d, std::string(), 0);
+				}
+				m_queue->final(context, ioremap::elliptics::data_pointer());
+			} catch (const std::exception &e) {
+				m_queue->final(context, cocaine::format("push: %s", e.what()));
+			}
 		}
-		m_queue->final(context, ioremap::elliptics::data_pointer());
 
-	} else if (event == "pop-multi" || event == "pop-multiple-string") {
-		int num = stoi(context.data().to_string());
-
-		m_pop_time.start();
-		m_ack_time.start();
-		peek_multi_type d = m_queue->pop(num);
-		m_ack_time.stop();
-		m_pop_time.stop();
-		if (!d.empty()) {
-			m_queue->final(context, ioremap::grape::serialize(d));
-			m_pop_rate.update(d.sizes().size());
-			m_ack_rate.update(d.sizes().size());
+	} else if (event == "push-entry") {
+		ioremap::grape::push_request req;
+		try {
+			req = ioremap::grape::deserialize<ioremap::grape::push_request>(context.data());
+		} catch (const std::exception &e) {
+			m_queue->final(context, cocaine::format("push-entry: malformed request: %s", e.what()));
+			return;
+		}
+
+		std::string refusal = admit(req.producer);
+		if (!refusal.empty()) {
+			m_queue->final(context, refusal);
 		} else {
-			m_queue->final(context, ioremap::elliptics::data_pointer());
+			try {
+				if (!req.data.empty()) {
+					push(ioremap::elliptics::data_pointer::copy(req.data.data(), req.data.size()),
+							req.key, req.priority, req.not_before, req.producer, req.sequence);
+				}
+				m_queue->final(context, ioremap::elliptics::data_pointer());
+			} catch (const std::exception &e) {
+				m_queue->final(context, cocaine::format("push-entry: %s", e.what()));
+			}
 		}
 
-		COCAINE_LOG_INFO(m_log, "%s, completed event: %s, size: %ld, popped: %d/%d (multiple: '%s')",
-				action_id.c_str(),
-				event.c_str(), context.data().size(),
-				d.sizes().size(), num, context.data().to_string().c_str()
-				);
+	} else if (event == "pop-multi" || event == "pop-multiple-string") {
+		// argument: number of entries, optional max wait time in seconds
+		// and optional max total size of entries in bytes
+		int num = 0;
+		double max_wait = 0;
+		uint64_t max_bytes = 0;
+		std::istringstream(context.data().to_string()) >> num >> max_wait >> max_bytes;
+		uint64_t start = microseconds_now();
+
+		m_queue->pop(num, max_bytes, max_wait, [this, context, action_id, event, num, start] (const peek_multi_type &d) {
+			uint64_t elapsed = microseconds_now() - start;
+			if (!d.empty()) {
+				m_queue->final(context, ioremap::grape::serialize(d));
+			} else {
+				m_queue->final(context, ioremap::elliptics::data_pointer());
+			}
+
+			{
+				std::lock_guard<std::mutex> guard(m_stat_mutex);
+				m_pop_time.add(elapsed);
+				m_ack_time.add(elapsed);
+				if (!d.empty()) {
+					m_pop_rate.update(d.sizes().size());
+					m_ack_rate.update(d.sizes().size());
+				}
+			}
+
+			COCAINE_LOG_INFO(m_log, "%s, completed event: %s, size: %ld, popped: %d/%d (multiple: '%s')",
+					action_id.c_str(),
+					event.c_str(), context.data().size(),
+					d.sizes().size(), num, context.data().to_string().c_str()
+					);
+		});
 
 	} else if (event == "pop") {
-		m_pop_time.start();
-		m_ack_time.start();
-		m_queue->final(context, m_queue->pop());
-		m_ack_time.stop();
-		m_pop_time.stop();
-		m_pop_rate.update(1);
-		m_ack_rate.update(1);
-
-	} else if (event == "peek") {
-		m_pop_time.start();
-		ioremap::grape::entry_id entry_id;
-		ioremap::elliptics::data_pointer d = m_queue->peek(&entry_id);
+		uint64_t start = microseconds_now();
 
-		COCAINE_LOG_INFO(m_log, "%s, peeked entry: %d-%d: (%ld)'%s'",
-				action_id.c_str(),
-				entry_id.chunk, entry_id.pos, d.size(), d.to_string()
-				);
+		m_queue->pop(1, 0, 0, [this, context, start] (const peek_multi_type &d) {
+			uint64_t elapsed = microseconds_now() - start;
+			m_queue->final(context, d.data());
 
-		// embed entry id directly into sph of the reply
-		dnet_raw_id *src = context.src_id();
-		memcpy(&src->id[DNET_ID_SIZE - sizeof(entry_id)], &entry_id, sizeof(entry_id));
+			std::lock_guard<std::mutex> guard(m_stat_mutex);
+			m_pop_time.add(elapsed);
+			m_ack_time.add(elapsed);
+			m_pop_rate.update(1);
+			m_ack_rate.update(1);
+		});
 
-		m_queue->final(context, d);
+	} else if (event == "peek") {
+		uint64_t start = microseconds_now();
 
-		m_pop_time.stop();
-		m_pop_rate.update(1);
+		m_queue->peek(1, 0, 0, [this, context, action_id, start] (const peek_multi_type &d) {
+			ioremap::elliptics::exec_context reply = context;
+			ioremap::grape::entry_id entry_id = {-1, -1};
+			if (!d.empty()) {
+				entry_id = d.ids().front();
+			}
 
-	} else if (event == "peek-multi") {
-		m_pop_time.start();
-		int num = stoi(context.data().to_string());
+			COCAINE_LOG_INFO(m_log, "%s, peeked entry: %d-%d, size: %ld",
+					action_id.c_str(),
+					entry_id.chunk, entry_id.pos, d.data().size()
+					);
 
-		peek_multi_type d = m_queue->peek(num);
+			// embed entry id directly into sph of the reply
+			dnet_raw_id *src = reply.src_id();
+			memcpy(&src->id[DNET_ID_SIZE - sizeof(entry_id)], &entry_id, sizeof(entry_id));
 
-		if (!d.empty()) {
-			m_queue->final(context, ioremap::grape::serialize(d));
-			m_pop_rate.update(d.sizes().size());
-		} else {
-			m_queue->final(context, ioremap::elliptics::data_pointer());
-		}
+			m_queue->final(reply, d.data());
 
-		m_pop_time.stop();
+			std::lock_guard<std::mutex> guard(m_stat_mutex);
+			m_pop_time.add(microseconds_now() - start);
+			m_pop_rate.update(1);
+		});
 
-		COCAINE_LOG_INFO(m_log, "%s, peeked %ld entries (asked %d)",
-				action_id.c_str(),
-				d.sizes().size(), num
-				);
+	} else if (event == "peek-multi") {
+		// argument: number of entries, optional max wait time in seconds
+		// and optional max total size of entries in bytes
+		int num = 0;
+		double max_wait = 0;
+		uint64_t max_bytes = 0;
+		std::istringstream(context.data().to_string()) >> num >> max_wait >> max_bytes;
+		uint64_t start = microseconds_now();
+
+		m_queue->peek(num, max_bytes, max_wait, [this, context, action_id, num, start] (const peek_multi_type &d) {
+			if (!d.empty()) {
+				m_queue->final(context, ioremap::grape::serialize(d));
+			} else {
+				m_queue->final(context, ioremap::elliptics::data_pointer());
+			}
+
+			{
+				std::lock_guard<std::mutex> guard(m_stat_mutex);
+				m_pop_time.add(microseconds_now() - start);
+				if (!d.empty()) {
+					m_pop_rate.update(d.sizes().size());
+				}
+			}
+
+			COCAINE_LOG_INFO(m_log, "%s, peeked %ld entries (asked %d)",
+					action_id.c_str(),
+					d.sizes().size(), num
+					);
+		});
 
 	} else if (event == "ack") {
-		m_ack_time.start();
+		uint64_t start = microseconds_now();
 		ioremap::elliptics::data_pointer d = context.data();
 		ioremap::grape::entry_id entry_id = ioremap::grape::entry_id::from_dnet_raw_id(context.src_id());
 
 		m_queue->ack(entry_id);
 		m_queue->final(context, ioremap::elliptics::data_pointer());
 
-		m_ack_time.stop();
-		m_ack_rate.update(1);
+		{
+			std::lock_guard<std::mutex> guard(m_stat_mutex);
+			m_ack_time.add(microseconds_now() - start);
+			m_ack_rate.update(1);
+		}
 
 		COCAINE_LOG_INFO(m_log, "%s, acked entry %d-%d",
 				action_id.c_str(),
@@ -244,20 +438,202 @@ void queue_app_context::process(const std::string &cocaine_event, const std::vec
 				);
 
 	} else if (event == "ack-multi") {
-		m_ack_time.start();
+		uint64_t start = microseconds_now();
 		auto d = ioremap::grape::deserialize<ack_multi_type>(context.data());
 
 		m_queue->ack(d);
 		m_queue->final(context, ioremap::elliptics::data_pointer());
 
-		m_ack_time.stop();
-		m_ack_rate.update(d.size());
+		{
+			std::lock_guard<std::mutex> guard(m_stat_mutex);
+			m_ack_time.add(microseconds_now() - start);
+			m_ack_rate.update(d.size());
+		}
 
 		COCAINE_LOG_INFO(m_log, "%s, acked %ld entries",
 				action_id.c_str(),
 				d.size()
 				);
 
+	} else if (event == "touch") {
+		ioremap::grape::entry_id entry_id = ioremap::grape::entry_id::from_dnet_raw_id(context.src_id());
+
+		m_queue->touch(entry_id);
+		m_queue->final(context, ioremap::elliptics::data_pointer());
+
+		COCAINE_LOG_INFO(m_log, "%s, touched entry %d-%d",
+				action_id.c_str(),
+				entry_id.chunk, entry_id.pos
+				);
+
+	} else if (event == "touch-multi") {
+		auto d = ioremap::grape::deserialize<ack_multi_type>(context.data());
+
+		m_queue->touch(d);
+		m_queue->final(context, ioremap::elliptics::data_pointer());
+
+		COCAINE_LOG_INFO(m_log, "%s, touched %ld entries",
+				action_id.c_str(),
+				d.size()
+				);
+
+	} else if (event == "batch") {
+		auto b = std::make_shared<batch>();
+		b->context = context;
+		b->action_id = action_id;
+		b->next = 0;
+		b->start = microseconds_now();
+
+		// version goes first, envelope of another version could be laid out differently
+		std::string refusal;
+		try {
+			int version = ioremap::grape::envelope_version(context.data().data<char>(), context.data().size());
+			if (version != ioremap::grape::envelope::VERSION) {
+				refusal = cocaine::format("batch: unsupported envelope version %d, supported %d",
+						version, ioremap::grape::envelope::VERSION);
+			} else {
+				b->envelope = ioremap::grape::deserialize<ioremap::grape::envelope>(context.data());
+			}
+		} catch (const std::exception &e) {
+			refusal = cocaine::format("batch: malformed request: %s", e.what());
+		}
+
+		if (refusal.empty() && !m_queue->has_group(b->envelope.group)) {
+			refusal = cocaine::format("batch: there is no consumer group '%s'", b->envelope.group.c_str());
+		}
+
+		if (!refusal.empty()) {
+			m_queue->final(context, refusal);
+		} else {
+			run_batch(b);
+		}
+
+	} else if (event == "subscribe") {
+		// argument: initial credit, number of entries and optional number of bytes,
+		// and optional consumer group name
+		int entries = 0;
+		uint64_t bytes = 0;
+		std::string group;
+		std::istringstream(context.data().to_string()) >> entries >> bytes >> group;
+
+		if (!m_queue->has_group(group)) {
+			m_queue->final(context, cocaine::format("subscribe: there is no consumer group '%s'", group.c_str()));
+		} else {
+			// Entries are sent as non-final replies, stream is left open till unsubscribe
+			// or till the queue expires the subscription
+			auto stream = std::make_shared<ioremap::elliptics::exec_context>(context);
+			int id = m_queue->subscribe([this, stream, action_id] (const peek_multi_type &d) {
+				{
+					// Stream could have been finished while entries were on their way here,
+					// nothing goes after the final reply: entries are replayed after ack-timeout
+					std::lock_guard<std::mutex> guard(m_subscriptions_mutex);
+					auto it = m_subscriptions.find(get_subscription_id(*stream));
+					if (it == m_subscriptions.end() || it->second != stream) {
+						COCAINE_LOG_INFO(m_log, "%s, subscription is finished, dropping %ld entries",
+								action_id.c_str(), d.sizes().size());
+						return;
+					}
+
+					m_queue->reply(*stream, ioremap::grape::serialize(d), ioremap::elliptics::exec_context::progressive);
+				}
+
+				std::lock_guard<std::mutex> guard(m_stat_mutex);
+				m_pop_rate.update(d.sizes().size());
+			}, [this, stream, action_id] () {
+				finish_subscription(get_subscription_id(*stream));
+
+				COCAINE_LOG_INFO(m_log, "%s, subscription %d expired",
+						action_id.c_str(), get_subscription_id(*stream));
+			}, group);
+
+			// subscription has no credit yet, so its handler could not be called before this
+			set_subscription_id(*stream, id);
+			{
+				std::lock_guard<std::mutex> guard(m_subscriptions_mutex);
+				m_subscriptions[id] = stream;
+			}
+
+			// empty reply gives subscriber the context before any entries come
+			m_queue->reply(*stream, ioremap::elliptics::data_pointer(), ioremap::elliptics::exec_context::progressive);
+			m_queue->grant(id, entries, bytes);
+
+			COCAINE_LOG_INFO(m_log, "%s, subscription %d started, credit: entries %d, bytes %lld",
+					action_id.c_str(),
+					id, entries, bytes
+					);
+		}
+
+	} else if (event == "credit") {
+		// argument: number of entries and optional number of bytes
+		int id = get_subscription_id(context);
+		int entries = 0;
+		uint64_t bytes = 0;
+		std::istringstream(context.data().to_string()) >> entries >> bytes;
+
+		bool found = m_queue->grant(id, entries, bytes);
+		m_queue->final(context, ioremap::elliptics::data_pointer(found ? "ok" : "no subscription"));
+
+		COCAINE_LOG_INFO(m_log, "%s, subscription %d, credit: entries %d, bytes %lld",
+				action_id.c_str(),
+				id, entries, bytes
+				);
+
+	} else if (event == "unsubscribe") {
+		int id = get_subscription_id(context);
+
+		m_queue->unsubscribe(id);
+		bool found = finish_subscription(id);
+
+		m_queue->final(context, ioremap::elliptics::data_pointer(found ? "ok" : "no subscription"));
+
+		COCAINE_LOG_INFO(m_log, "%s, subscription %d finished",
+				action_id.c_str(),
+				id
+				);
+
+	} else if (event == "seek") {
+		// argument: "entry <chunk> <pos>" or "time <unix time>",
+		// then optional consumer group name
+		std::istringstream args(context.data().to_string());
+		std::string target;
+		std::string group;
+		args >> target;
+
+		try {
+			if (target == "entry") {
+				ioremap::grape::entry_id id = {-1, -1};
+				args >> id.chunk >> id.pos >> group;
+				m_queue->seek(id, group);
+			} else if (target == "time") {
+				double time = 0;
+				args >> time >> group;
+				m_queue->seek(time, group);
+			} else {
+				ioremap::elliptics::throw_error(-EINVAL, "unknown seek target '%s'", target.c_str());
+			}
+
+			m_queue->final(context, ioremap::elliptics::data_pointer("ok"));
+
+		} catch (const ioremap::elliptics::error &e) {
+			m_queue->final(context, cocaine::format("seek: %s", e.what()));
+		}
+
+		COCAINE_LOG_INFO(m_log, "%s, seek to %s, group '%s'",
+				action_id.c_str(),
+				context.data().to_string().c_str(), group.c_str()
+				);
+
+	} else if (event == "depth") {
+		// argument: optional consumer group name
+		std::string group;
+		std::istringstream(context.data().to_string()) >> group;
+
+		if (!m_queue->has_group(group)) {
+			m_queue->final(context, cocaine::format("depth: there is no consumer group '%s'", group.c_str()));
+		} else {
+			m_queue->final(context, ioremap::grape::serialize(m_queue->depth(group)));
+		}
+
 	} else if (event == "clear") {
 		// clear queue content
 		m_queue->clear();
@@ -280,6 +656,18 @@ void queue_app_context::process(const std::string &cocaine_event, const std::vec
 
 		ioremap::grape::queue_state state = m_queue->state();
 		ioremap::grape::queue_statistics st = m_queue->statistics();
+		ioremap::grape::reclaim_stat reclaim = m_queue->reclaim_statistics();
+		std::vector<ioremap::grape::lane_statistics> lanes = m_queue->lanes();
+		std::vector<ioremap::grape::producer_statistics> producers = m_queue->producers();
+
+		// classes of named consumer groups
+		std::vector<std::string> group_names = m_queue->groups();
+		std::vector<std::vector<ioremap::grape::lane_statistics>> group_lanes;
+		for (size_t i = 1; i < group_names.size(); ++i) {
+			group_lanes.push_back(m_queue->lanes(group_names[i]));
+		}
+
+		std::unique_lock<std::mutex> stat_guard(m_stat_mutex);
 
 		root.AddMember("queue_id", name, root.GetAllocator());
 
@@ -289,15 +677,93 @@ void queue_app_context::process(const std::string &cocaine_event, const std::vec
 		root.AddMember("push.count", st.push_count, root.GetAllocator());
 		root.AddMember("push.rate", m_push_rate.get(), root.GetAllocator());
 		root.AddMember("push.time", m_push_time.get(), root.GetAllocator());
+		root.AddMember("push.throttled", st.throttle_count, root.GetAllocator());
+		root.AddMember("push.blobs", st.blob_count, root.GetAllocator());
+		root.AddMember("push.blob_bytes", st.blob_bytes, root.GetAllocator());
+		root.AddMember("pack.chunks", st.pack_count, root.GetAllocator());
+		root.AddMember("pack.raw_bytes", st.pack_raw_bytes, root.GetAllocator());
+		root.AddMember("pack.bytes", st.pack_bytes, root.GetAllocator());
 		root.AddMember("pop.count", st.pop_count, root.GetAllocator());
 		root.AddMember("pop.rate", m_pop_rate.get(), root.GetAllocator());
 		root.AddMember("pop.time", m_pop_time.get(), root.GetAllocator());
 		root.AddMember("ack.count", st.ack_count, root.GetAllocator());
 		root.AddMember("ack.rate", m_ack_rate.get(), root.GetAllocator());
 		root.AddMember("ack.time", m_ack_time.get(), root.GetAllocator());
+		root.AddMember("touch.count", st.touch_count, root.GetAllocator());
 		root.AddMember("timeout.count", st.timeout_count, root.GetAllocator());
+		root.AddMember("dead_letter.count", st.dead_letter_count, root.GetAllocator());
+		root.AddMember("dead_letter.bytes", st.dead_letter_bytes, root.GetAllocator());
+		root.AddMember("delay.count", st.delay_count, root.GetAllocator());
+		root.AddMember("delay.promoted", st.promote_count, root.GetAllocator());
+		root.AddMember("expire.chunks", st.expire_chunks, root.GetAllocator());
+		root.AddMember("expire.entries", st.expire_entries, root.GetAllocator());
+		root.AddMember("expire.bytes", st.expire_bytes, root.GetAllocator());
+		root.AddMember("compact.count", st.compact_count, root.GetAllocator());
+		root.AddMember("compact.relocated", st.relocate_count, root.GetAllocator());
 		root.AddMember("state.write_count", st.state_write_count, root.GetAllocator());
 
+		root.AddMember("reclaim.queued", reclaim.queued, root.GetAllocator());
+		root.AddMember("reclaim.removed", reclaim.removed, root.GetAllocator());
+		root.AddMember("reclaim.retried", reclaim.retried, root.GetAllocator());
+		root.AddMember("reclaim.failed", reclaim.failed, root.GetAllocator());
+		root.AddMember("reclaim.in_flight", reclaim.in_flight, root.GetAllocator());
+		root.AddMember("reclaim.pending", reclaim.pending, root.GetAllocator());
+
+		rapidjson::Value classes(rapidjson::kArrayType);
+		for (auto i = lanes.begin(); i != lanes.end(); ++i) {
+			rapidjson::Value lane(rapidjson::kObjectType);
+			lane.AddMember("priority", i->priority, root.GetAllocator());
+			lane.AddMember("weight", i->weight, root.GetAllocator());
+			lane.AddMember("high-id", i->state.chunk_id_push, root.GetAllocator());
+			lane.AddMember("low-id", i->state.chunk_id_ack, root.GetAllocator());
+			lane.AddMember("depth", i->depth, root.GetAllocator());
+			lane.AddMember("depth.bytes", i->depth_bytes, root.GetAllocator());
+			lane.AddMember("in_flight", i->in_flight, root.GetAllocator());
+			lane.AddMember("age", i->age, root.GetAllocator());
+			classes.PushBack(lane, root.GetAllocator());
+		}
+		root.AddMember("classes", classes, root.GetAllocator());
+
+		rapidjson::Value groups(rapidjson::kArrayType);
+		for (size_t n = 0; n < group_lanes.size(); ++n) {
+			rapidjson::Value group(rapidjson::kObjectType);
+			rapidjson::Value group_name;
+			group_name.SetString(group_names[n + 1].c_str(), group_names[n + 1].size(), root.GetAllocator());
+			group.AddMember("name", group_name, root.GetAllocator());
+
+			rapidjson::Value group_classes(rapidjson::kArrayType);
+			for (auto i = group_lanes[n].begin(); i != group_lanes[n].end(); ++i) {
+				rapidjson::Value lane(rapidjson::kObjectType);
+				lane.AddMember("priority", i->priority, root.GetAllocator());
+				lane.AddMember("low-id", i->state.chunk_id_ack, root.GetAllocator());
+				lane.AddMember("depth", i->depth, root.GetAllocator());
+				lane.AddMember("depth.bytes", i->depth_bytes, root.GetAllocator());
+				lane.AddMember("in_flight", i->in_flight, root.GetAllocator());
+				lane.AddMember("age", i->age, root.GetAllocator());
+				group_classes.PushBack(lane, root.GetAllocator());
+			}
+			group.AddMember("classes", group_classes, root.GetAllocator());
+
+			groups.PushBack(group, root.GetAllocator());
+		}
+		root.AddMember("groups", groups, root.GetAllocator());
+
+		rapidjson::Value producer_stats(rapidjson::kArrayType);
+		for (auto i = producers.begin(); i != producers.end(); ++i) {
+			rapidjson::Value producer(rapidjson::kObjectType);
+			rapidjson::Value producer_name;
+			producer_name.SetString(i->name.c_str(), i->name.size(), root.GetAllocator());
+			producer.AddMember("name", producer_name, root.GetAllocator());
+			producer.AddMember("push.count", i->push_count, root.GetAllocator());
+			producer.AddMember("push.rate", m_producer_rates[i->name].get(), root.GetAllocator());
+			producer.AddMember("push.limited", i->limit_count, root.GetAllocator());
+			producer.AddMember("push.duplicates", i->duplicate_count, root.GetAllocator());
+			producer_stats.PushBack(producer, root.GetAllocator());
+		}
+		root.AddMember("producers", producer_stats, root.GetAllocator());
+
+		stat_guard.unlock();
+
 		root.AddMember("chunks_popped.write_data", st.chunks_popped.write_data, root.GetAllocator());
 		root.AddMember("chunks_popped.write_meta", st.chunks_popped.write_meta, root.GetAllocator());
 		root.AddMember("chunks_popped.read", st.chunks_popped.read, root.GetAllocator());
@@ -332,6 +798,124 @@ void queue_app_context::process(const std::string &cocaine_event, const std::vec
 			);
 }
 
+std::string queue_app_context::admit(const std::string &producer)
+{
+	// queue as a whole goes first, so that throttled pushes do not take producer's tokens
+	double retry = m_queue->throttle();
+	if (retry > 0) {
+		return cocaine::format("throttled, retry after %f", retry);
+	}
+
+	retry = m_queue->admit(producer);
+	if (retry > 0) {
+		return cocaine::format("rate limited, retry after %f", retry);
+	}
+
+	return std::string();
+}
+
+void queue_app_context::push(const ioremap::elliptics::data_pointer &d, const std::string &key, int priority,
+		double not_before, const std::string &producer, uint64_t sequence)
+{
+	uint64_t start = microseconds_now();
+	if (!m_queue->push(d, key, priority, not_before, producer, sequence)) {
+		// duplicate is replied just as the pushed entry, it's in the queue already
+		return;
+	}
+	uint64_t elapsed = microseconds_now() - start;
+	COCAINE_LOG_INFO(m_log, "push time %ld", elapsed);
+
+	std::lock_guard<std::mutex> guard(m_stat_mutex);
+	m_push_time.add(elapsed);
+	m_push_rate.update(1);
+	m_producer_rates[producer].update(1);
+
+	// rates are kept only for producers the queue keeps track of
+	if (m_producer_rates.size() > m_queue->max_producers()) {
+		std::set<std::string> names;
+		std::vector<ioremap::grape::producer_statistics> producers = m_queue->producers();
+		for (auto i = producers.begin(); i != producers.end(); ++i) {
+			names.insert(i->name);
+		}
+
+		for (auto i = m_producer_rates.begin(); i != m_producer_rates.end(); ) {
+			if (names.count(i->first)) {
+				++i;
+			} else {
+				m_producer_rates.erase(i++);
+			}
+		}
+	}
+}
+
+bool queue_app_context::finish_subscription(int id)
+{
+	// Final reply is sent under the lock, so that no entries handed
+	// to the stream meanwhile could follow it
+	std::lock_guard<std::mutex> guard(m_subscriptions_mutex);
+
+	auto it = m_subscriptions.find(id);
+	if (it == m_subscriptions.end()) {
+		return false;
+	}
+
+	m_queue->final(*it->second, ioremap::elliptics::data_pointer());
+	m_subscriptions.erase(it);
+	return true;
+}
+
+void queue_app_context::run_batch(std::shared_ptr<batch> b)
+{
+	const std::vector<ioremap::grape::queue_operation> &ops = b->envelope.operations;
+
+	while (b->next < ops.size()) {
+		const ioremap::grape::queue_operation &op = ops[b->next++];
+
+		if (op.type == ioremap::grape::queue_operation::ACK) {
+			uint64_t start = microseconds_now();
+			m_queue->ack(op.ids, b->envelope.group);
+
+			std::lock_guard<std::mutex> guard(m_stat_mutex);
+			m_ack_time.add(microseconds_now() - start);
+			m_ack_rate.update(op.ids.size());
+
+		} else if (op.type == ioremap::grape::queue_operation::TOUCH) {
+			m_queue->touch(op.ids, b->envelope.group);
+
+		} else if (op.type == ioremap::grape::queue_operation::PEEK) {
+			// the rest of operations runs when peek completes
+			m_queue->peek(op.num, op.max_bytes, op.max_wait, [this, b] (const peek_multi_type &d) {
+				b->result.extend(d);
+				run_batch(b);
+			}, b->envelope.group);
+			return;
+
+		} else {
+			COCAINE_LOG_ERROR(m_log, "%s, batch: skipping unknown operation %d",
+					b->action_id.c_str(), op.type);
+		}
+	}
+
+	if (!b->result.empty()) {
+		m_queue->final(b->context, ioremap::grape::serialize(b->result));
+	} else {
+		m_queue->final(b->context, ioremap::elliptics::data_pointer());
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(m_stat_mutex);
+		m_pop_time.add(microseconds_now() - b->start);
+		if (!b->result.empty()) {
+			m_pop_rate.update(b->result.sizes().size());
+		}
+	}
+
+	COCAINE_LOG_INFO(m_log, "%s, completed batch of %ld operations, peeked %ld entries",
+			b->action_id.c_str(),
+			ops.size(), b->result.sizes().size()
+			);
+}
+
 int main(int argc, char **argv)
 {
 	try {
@@ -0,0 +1,117 @@
+#include <chrono>
+#include <iostream>
+#include <map>
+
+#include <boost/program_options.hpp>
+
+#include "queue.hpp"
+
+// Chunk window against the two maps of chunks it replaced: a backlog of chunks
+// is walked through the popping line and then through the waiting for ack line
+// the way queue walks it, looking up the lowest active chunk after every step.
+// Chunks are created up front and are never read or written, so only
+// bookkeeping of the lines and destruction of chunks going out of them are timed.
+
+namespace {
+
+typedef std::chrono::duration<double, std::milli> milliseconds;
+
+double walk_maps(ioremap::elliptics::session &session, int count, long *sink)
+{
+	std::map<int, ioremap::grape::shared_chunk> popping, waiting;
+	for (int i = 0; i < count; ++i) {
+		popping.insert(std::make_pair(i, std::make_shared<ioremap::grape::chunk>(session, "bench", i, 1)));
+	}
+
+	auto start = std::chrono::steady_clock::now();
+
+	while (!popping.empty()) {
+		auto first = popping.begin();
+		int id = first->first;
+		waiting.insert(*first);
+		popping.erase(first);
+
+		auto found = waiting.find(id);
+		*sink += found->second->id();
+		waiting.erase(found);
+
+		int low = count;
+		if (!popping.empty()) {
+			low = std::min(low, popping.begin()->first);
+		}
+		if (!waiting.empty()) {
+			low = std::min(low, waiting.begin()->first);
+		}
+		*sink += low;
+	}
+
+	return milliseconds(std::chrono::steady_clock::now() - start).count();
+}
+
+double walk_window(ioremap::elliptics::session &session, int count, long *sink)
+{
+	using ioremap::grape::chunk_window;
+
+	chunk_window window;
+	for (int i = 0; i < count; ++i) {
+		window.insert(i, std::unique_ptr<ioremap::grape::chunk>(new ioremap::grape::chunk(session, "bench", i, 1)),
+				chunk_window::POPPABLE);
+	}
+
+	auto start = std::chrono::steady_clock::now();
+
+	for (int id = window.first(chunk_window::POPPABLE); id >= 0; id = window.first(chunk_window::POPPABLE)) {
+		window.set(id, chunk_window::WAITING_ACK);
+		window.clear(id, chunk_window::POPPABLE);
+
+		*sink += window.find(id)->id();
+		window.clear(id, chunk_window::WAITING_ACK);
+
+		*sink += window.empty() ? count : window.low();
+	}
+
+	return milliseconds(std::chrono::steady_clock::now() - start).count();
+}
+
+}
+
+using namespace boost::program_options;
+
+int main(int argc, char** argv)
+{
+	options_description opts("Options");
+	opts.add_options()
+		("help", "help message")
+		("chunks,n", value<int>()->default_value(100000), "chunks in the backlog")
+		("rounds,r", value<int>()->default_value(50), "walks of the backlog to average over")
+		;
+
+	variables_map args;
+	store(parse_command_line(argc, argv, opts), args);
+	notify(args);
+
+	if (args.count("help")) {
+		std::cout << opts << "\n";
+		return 1;
+	}
+
+	const int count = args["chunks"].as<int>();
+	const int rounds = args["rounds"].as<int>();
+
+	// chunks need a session to be created with, it's never used
+	ioremap::elliptics::file_logger log("/dev/null", 0);
+	ioremap::elliptics::node node(log);
+	ioremap::elliptics::session session(node);
+
+	long sink = 0;
+	double maps = 0, window = 0;
+	for (int i = 0; i < rounds; ++i) {
+		maps += walk_maps(session, count, &sink);
+		window += walk_window(session, count, &sink);
+	}
+
+	std::cout << count << " chunks, ms per walk: maps " << maps / rounds
+		<< ", window " << window / rounds << " (checksum " << sink << ")\n";
+
+	return 0;
+}
@@ -15,15 +15,28 @@ ioremap::grape::chunk_meta::chunk_meta(int max)
 	
 	m_ptr->max = max;
 
+	index_offsets();
 }
 
-bool ioremap::grape::chunk_meta::push(int size)
+void ioremap::grape::chunk_meta::index_offsets()
+{
+	m_offsets.assign(1, 0);
+	m_offsets.reserve(m_ptr->high + 1);
+	for (int i = 0; i < m_ptr->high; ++i) {
+		m_offsets.push_back(m_offsets.back() + m_ptr->entries[i].size);
+	}
+}
+
+bool ioremap::grape::chunk_meta::push(int size, int deliveries, int state)
 {
 	if (m_ptr->high >= m_ptr->max)
 		ioremap::elliptics::throw_error(-ERANGE, "chunk is full: high: %d, max: %d", m_ptr->high, m_ptr->max);
 
 	m_ptr->entries[m_ptr->high].size = size;
+	m_ptr->entries[m_ptr->high].state = state;
+	m_ptr->entries[m_ptr->high].deliveries = deliveries;
 	m_ptr->high++;
+	m_offsets.push_back(m_offsets.back() + size);
 
 	LOG_DEBUG("\tmeta.push: acked: %d, low: %d, high: %d, max: %d", m_ptr->acked, m_ptr->low, m_ptr->high, m_ptr->max);
 
@@ -76,6 +89,21 @@ bool ioremap::grape::chunk_meta::ack(int32_t pos, int state)
 	return complete();
 }
 
+int ioremap::grape::chunk_meta::deliver(int32_t pos)
+{
+	if (pos >= m_ptr->high) {
+		ioremap::elliptics::throw_error(-ERANGE, "invalid deliver: position can not be more than high mark: "
+				"pos: %d, high: %d, max: %d",
+				pos, m_ptr->high, m_ptr->max);
+	}
+
+	// saturate instead of wrapping around
+	if (m_ptr->entries[pos].deliveries < INT16_MAX)
+		++m_ptr->entries[pos].deliveries;
+
+	return m_ptr->entries[pos].deliveries;
+}
+
 std::string &ioremap::grape::chunk_meta::data()
 {
 	return m_data;
@@ -96,6 +124,11 @@ int ioremap::grape::chunk_meta::acked() const
 	return m_ptr->acked;
 }
 
+int ioremap::grape::chunk_meta::space() const
+{
+	return m_ptr->max - m_ptr->high;
+}
+
 bool ioremap::grape::chunk_meta::full() const
 {
 	return m_ptr->high == m_ptr->max;
@@ -119,6 +152,8 @@ void ioremap::grape::chunk_meta::assign(char *data, size_t size)
 
 	m_data.assign(data, size);
 	m_ptr = (struct chunk_disk *)m_data.data();
+
+	index_offsets();
 }
 
 ioremap::grape::chunk_entry ioremap::grape::chunk_meta::operator[] (int32_t pos) const
@@ -138,27 +173,52 @@ uint64_t ioremap::grape::chunk_meta::byte_offset(int32_t pos) const
 				pos, m_ptr->high, m_ptr->max);
 	}
 
-	uint64_t offset = 0;
-	for (int i = 0; i < pos; ++i) {
-		offset += m_ptr->entries[i].size;
-	}
+	return pos > 0 ? m_offsets[pos] : 0;
+}
+
+std::string ioremap::grape::chunk::data_key(const std::string &queue_id, int chunk_id)
+{
+	return queue_id + ".chunk." + std::to_string(chunk_id);
+}
+
+std::string ioremap::grape::chunk::meta_key(const std::string &meta_id, int chunk_id)
+{
+	return data_key(meta_id, chunk_id) + ".meta";
+}
 
-	return offset;
+std::string ioremap::grape::chunk::blob_key(const std::string &queue_id, int chunk_id, int index)
+{
+	return data_key(queue_id, chunk_id) + ".blob." + std::to_string(index);
 }
 
-ioremap::grape::chunk::chunk(ioremap::elliptics::session &session, const std::string &queue_id, int chunk_id, int max)
+std::string ioremap::grape::chunk::adopted_key(const std::string &queue_id, int chunk_id)
+{
+	return data_key(queue_id, chunk_id) + ".adopted";
+}
+
+ioremap::grape::chunk::chunk(ioremap::elliptics::session &session, const std::string &queue_id, int chunk_id, int max,
+		uint64_t tail_limit, const std::string &meta_id)
 	: m_chunk_id(chunk_id)
-	, m_data_key(queue_id + ".chunk." + std::to_string(chunk_id))
-	, m_meta_key(queue_id + ".chunk." + std::to_string(chunk_id) + ".meta")
+	, m_data_key(data_key(queue_id, chunk_id))
+	, m_meta_key(meta_key(meta_id.empty() ? queue_id : meta_id, chunk_id))
 	, m_session_data(session.clone())
 	, m_session_meta(session.clone())
+	, m_session_append(session.clone())
+	, m_data_offset(0)
+	, m_data_size(0)
+	, m_tail_limit(tail_limit)
+	, m_data_fresh(false)
 	, m_meta(max)
 	, m_fire_time(0)
 {
 	m_session_data.set_ioflags(DNET_IO_FLAGS_APPEND | DNET_IO_FLAGS_NOCSUM);
 	m_session_meta.set_ioflags(DNET_IO_FLAGS_NOCSUM | DNET_IO_FLAGS_OVERWRITE);
+	m_session_append.set_ioflags(DNET_IO_FLAGS_APPEND | DNET_IO_FLAGS_NOCSUM);
 
 	memset(&m_stat, 0, sizeof(struct chunk_stat));
+
+	// chunk starts empty, its entries could come either from meta load or from pushes
+	reset_iteration_mode();
 }
 
 ioremap::grape::chunk::~chunk()
@@ -168,13 +228,26 @@ ioremap::grape::chunk::~chunk()
 }
 
 void ioremap::grape::chunk::load_meta()
+{
+	load_meta(read_meta());
+}
+
+ioremap::elliptics::async_read_result ioremap::grape::chunk::read_meta()
+{
+	return m_session_meta.read_data(m_meta_key, 0, 0);
+}
+
+void ioremap::grape::chunk::load_meta(ioremap::elliptics::async_read_result result)
 {
 	try {
-		ioremap::elliptics::data_pointer d = m_session_meta.read_data(m_meta_key, 0, 0).get_one().file();
+		ioremap::elliptics::data_pointer d = result.get_one().file();
 		m_meta.assign((char *)d.data(), d.size());
 		++m_stat.read;
 		reset_iteration_mode();
 
+		// existing data is yet to be read, cache does not reach the end
+		m_data_size = m_meta.byte_offset(m_meta.high_mark());
+
 	} catch (const ioremap::elliptics::not_found_error &e) {
 		// ignore not-found exception - create empty chunk
 		LOG_ERROR("chunk %d, load_meta, ERROR: meta not found: %s", m_chunk_id, e.what());
@@ -191,95 +264,131 @@ void ioremap::grape::chunk::load_meta()
 
 bool ioremap::grape::chunk::expect_no_more()
 {
-	return m_meta.full() && iter->at_end();
+	return m_meta.full() && iter && iter->at_end();
 }
 
-void ioremap::grape::chunk::prepare_iteration()
+bool ioremap::grape::chunk::needs_data() const
 {
-	try {
-		// Actual data is read on first pop() and also reread on chunk's exhaustion
-		// (for data could be updated by push).
-		// Metadata is read only at start (as it resides in memory and properly updated by push).
-		//
-		if (iteration_state.byte_offset >= m_data.size()) {
-			LOG_INFO("chunk %d, prepare_iteration, (re)reading data, iteration.byte_offset %lld, m_data.size() %ld", m_chunk_id, iteration_state.byte_offset, m_data.size());
-			
-			m_data = m_session_data.read_data(m_data_key, 0, 0).get_one().file();
-		}
+	// Data is read when the next entry to pop is not in the cache:
+	// on first pop() of a chunk which existed before start, on replay
+	// of the entries dropped from the cache, and when pushes went past the cache.
+	// Metadata is read only at start (as it resides in memory and properly updated by push).
+	//
+	// Empty chunk has nothing to read, pop() takes fast track for it.
+	if (m_meta.high_mark() == 0 || m_data_fresh) {
+		return false;
+	}
 
-		if (!iter) {
-			LOG_INFO("chunk %d, prepare_iteration, initializing iterator", m_chunk_id);
-			reset_iteration_mode();
-		}
+	if (iteration_state.entry_index >= m_meta.high_mark()) {
+		return false;
+	}
 
-	} catch (const ioremap::elliptics::not_found_error &e) {
-		// Do not explode on not-found-error, return empty data pointer
-		LOG_ERROR("chunk %d, prepare_iteration, ERROR: %s", m_chunk_id, e.what());
+	uint64_t next_size = m_meta[iteration_state.entry_index].size;
 
-	} catch (const ioremap::elliptics::timeout_error &e) {
-		// Do not explode on timeout-error, return empty data pointer
-		LOG_ERROR("chunk %d, prepare_iteration, ERROR: %s", m_chunk_id, e.what());
+	return iteration_state.byte_offset < m_data_offset ||
+		iteration_state.byte_offset + next_size > m_data_offset + m_data.size();
+}
 
-		//XXX: this means we silently ignore unreachable data,
-		// and it can't be good
+ioremap::elliptics::async_read_result ioremap::grape::chunk::read_data()
+{
+	LOG_INFO("chunk %d, read_data, (re)reading data, iteration.byte_offset %lld, cached: %lld-%lld",
+			m_chunk_id, iteration_state.byte_offset, m_data_offset, m_data_offset + m_data.size());
 
-	} catch (const ioremap::elliptics::error &e) {
-		// Special case to ignore bad chunk meta format error
-		// (raised by chunk_clt::assign())
-		LOG_ERROR("chunk %d, prepare_iteration, ERROR: %s", m_chunk_id, e.what());
-		if (e.error_code() != -ERANGE) {
-			throw;
-		}
-	}
+	return m_session_data.read_data(m_data_key, 0, 0);
 }
 
-ioremap::elliptics::data_pointer ioremap::grape::chunk::pop(int *pos)
+ioremap::elliptics::async_read_result ioremap::grape::chunk::read_data(uint64_t offset, uint64_t size)
 {
-	ioremap::elliptics::data_pointer d;
-	*pos = -1;
+	LOG_INFO("chunk %d, read_data, reading %llu bytes from %llu", m_chunk_id,
+			(unsigned long long)size, (unsigned long long)offset);
 
-	// Fast track for the case when chunk is empty (not exist).
-	// It valid to check only metadata as push() updates metadata in memory
-	if (m_meta.high_mark() == 0) {
-		LOG_INFO("chunk %d, pop-single, empty", m_chunk_id);
-		return d;
-	}
+	return m_session_data.read_data(m_data_key, offset, size);
+}
 
-	prepare_iteration();
+void ioremap::grape::chunk::data_loaded(const ioremap::elliptics::data_pointer &d, const ioremap::elliptics::error_info &error,
+		uint64_t packed_size)
+{
+	// Next pop() must be served with whatever is here, even on read error,
+	// else consumer would wait on rereading forever
+	m_data_fresh = true;
 
-	// Iterator could still not be initialized here,
-	// if there was data read error inside prepare_iteration().
-	// Meta and data are inconsistent for now but next data reread could fix that. 
-	if (!iter) {
-		LOG_INFO("chunk %d, pop-single, chunk temporarily exhausted", m_chunk_id);
-		return d;
+	if (error) {
+		// Do not explode on errors (not-found and timeout ones mostly),
+		// chunk will look temporarily exhausted
+		LOG_ERROR("chunk %d, data_loaded, ERROR: %s", m_chunk_id, error.message().c_str());
+
+		//XXX: this means we silently ignore unreachable data,
+		// and it can't be good
+		return;
 	}
 
-	LOG_INFO("chunk %d, pop-single, iter: mode %d, index %d, offset %lld", m_chunk_id, iter->mode, iteration_state.entry_index, iteration_state.byte_offset);
+	std::string data;
+	uint64_t offset = 0;
 
-	if (iter->mode == iterator::REPLAY && iter->at_end()) {
-		LOG_INFO("chunk %d, pop-single, iter: mode %d, index %d, offset %lld, switching to mode %d", m_chunk_id, iter->mode, iteration_state.entry_index, iteration_state.byte_offset, iterator::FORWARD);
+	if (packed_size && d.size() == packed_size) {
+		// chunk is sealed, only blocks from the next entry to pop on are unpacked
+		offset = next_offset();
 
-		iter.reset(new forward_iterator(iteration_state, m_meta));
-		iter->begin();
+		try {
+			data = ioremap::grape::unpack_data(d, m_data_size, &offset);
+		} catch (const ioremap::elliptics::error &e) {
+			LOG_ERROR("chunk %d, data_loaded, ERROR: %s", m_chunk_id, e.what());
+			return;
+		}
+	} else {
+		data = d.to_string();
+
+		// Entries pushed after the read was issued could be missing from the read data,
+		// but they are in the cache if it reaches the end of the chunk
+		if (m_data_offset + m_data.size() == m_data_size &&
+				data.size() >= m_data_offset && data.size() < m_data_size) {
+			data.resize(m_data_offset);
+			data += m_data;
+		}
 	}
 
-	if (!iter->at_end()) {
-		int size = m_meta[iteration_state.entry_index].size;
-		d = ioremap::elliptics::data_pointer::copy((char *)m_data.data() + iteration_state.byte_offset, size);
-		*pos = iteration_state.entry_index;
+	cache_loaded(data, offset);
+}
 
-		iter->advance();
+void ioremap::grape::chunk::blocks_loaded(const ioremap::elliptics::data_pointer &index, uint64_t offset,
+		const ioremap::elliptics::data_pointer &blocks, const ioremap::elliptics::error_info &error)
+{
+	m_data_fresh = true;
 
-	} else {
-		LOG_INFO("chunk %d, pop-single, iter: mode %d, index %d, offset %lld, is at end", m_chunk_id, iter->mode, iteration_state.entry_index, iteration_state.byte_offset);
+	if (error) {
+		LOG_ERROR("chunk %d, blocks_loaded, ERROR: %s", m_chunk_id, error.message().c_str());
+		return;
+	}
+
+	std::string data;
+	try {
+		data = ioremap::grape::unpack_blocks(index, blocks, offset);
+	} catch (const ioremap::elliptics::error &e) {
+		LOG_ERROR("chunk %d, blocks_loaded, ERROR: %s", m_chunk_id, e.what());
+		return;
 	}
 
-	++m_stat.pop;
-	return d;
+	cache_loaded(data, offset);
+}
+
+uint64_t ioremap::grape::chunk::next_offset() const
+{
+	return iter ? iteration_state.byte_offset : 0;
 }
 
-ioremap::grape::data_array ioremap::grape::chunk::pop(int num)
+void ioremap::grape::chunk::cache_loaded(std::string &data, uint64_t offset)
+{
+	m_data.swap(data);
+	m_data_offset = offset;
+	++m_stat.read;
+
+	if (!iter) {
+		LOG_INFO("chunk %d, data_loaded, initializing iterator", m_chunk_id);
+		reset_iteration_mode();
+	}
+}
+
+ioremap::grape::data_array ioremap::grape::chunk::pop(int num, uint64_t max_bytes, bool oversized_first)
 {
 	ioremap::grape::data_array ret;
 
@@ -290,10 +399,10 @@ ioremap::grape::data_array ioremap::grape::chunk::pop(int num)
 		return ret;
 	}
 
-	prepare_iteration();
+	m_data_fresh = false;
 
 	// Iterator could still not be initialized here,
-	// if there was data read error inside prepare_iteration().
+	// if there was data read error inside data_loaded().
 	// Meta and data are inconsistent for now but next data reread could fix that. 
 	if (!iter) {
 		LOG_INFO("chunk %d, pop, chunk temporarily exhausted", m_chunk_id);
@@ -318,9 +427,22 @@ ioremap::grape::data_array ioremap::grape::chunk::pop(int num)
 		}
 
 		int size = m_meta[iteration_state.entry_index].size;
+
+		if (max_bytes && ret.data().size() + size > max_bytes && !(ret.empty() && oversized_first)) {
+			break;
+		}
+
+		// Data read could be issued before the last pushes had reached storage,
+		// or entry could have been dropped from the cache
+		if (iteration_state.byte_offset < m_data_offset ||
+				iteration_state.byte_offset + size > m_data_offset + m_data.size()) {
+			LOG_INFO("chunk %d, pop, iter: mode %d, index %d, offset %lld, data is not read yet", m_chunk_id, iter->mode, iteration_state.entry_index, iteration_state.byte_offset);
+			break;
+		}
+
 		entry_id.pos = iteration_state.entry_index;
-		ret.append((char *)m_data.data() + iteration_state.byte_offset, size, entry_id);
-		
+		ret.append(m_data.data() + (iteration_state.byte_offset - m_data_offset), size, entry_id);
+
 		iter->advance();
 
 		++m_stat.pop;
@@ -330,61 +452,202 @@ ioremap::grape::data_array ioremap::grape::chunk::pop(int num)
 	return ret;
 }
 
+bool ioremap::grape::chunk::needs_unacked_data() const
+{
+	// unlike pop() all entries up to the low mark are needed, regardless of iteration state
+	return m_data_offset != 0 || m_data.size() < m_meta.byte_offset(m_meta.low_mark());
+}
+
+bool ioremap::grape::chunk::unacked_loaded(const ioremap::elliptics::data_pointer &d,
+		const ioremap::elliptics::error_info &error, uint64_t packed_size)
+{
+	if (error) {
+		LOG_ERROR("chunk %d, unacked_loaded, ERROR: %s", m_chunk_id, error.message().c_str());
+		return false;
+	}
+
+	std::string data;
+	try {
+		if (packed_size && d.size() == packed_size) {
+			uint64_t offset = 0;
+			data = ioremap::grape::unpack_data(d, m_data_size, &offset);
+		} else {
+			data = d.to_string();
+		}
+	} catch (const ioremap::elliptics::error &e) {
+		LOG_ERROR("chunk %d, unacked_loaded, ERROR: %s", m_chunk_id, e.what());
+		return false;
+	}
+
+	if (data.size() < m_meta.byte_offset(m_meta.low_mark())) {
+		LOG_ERROR("chunk %d, unacked_loaded, ERROR: data is shorter than its meta states: data: %ld, meta: %lld",
+				m_chunk_id, data.size(), m_meta.byte_offset(m_meta.low_mark()));
+		return false;
+	}
+
+	m_data.swap(data);
+	m_data_offset = 0;
+	++m_stat.read;
+
+	return true;
+}
+
+ioremap::grape::data_array ioremap::grape::chunk::unacked()
+{
+	ioremap::grape::data_array ret;
+
+	if (needs_unacked_data()) {
+		ioremap::elliptics::throw_error(-ERANGE, "chunk %d, data of unacked entries is not loaded, cached: %lld-%lld",
+				m_chunk_id, m_data_offset, m_data_offset + m_data.size());
+	}
+
+	entry_id entry_id;
+	entry_id.chunk = m_chunk_id;
+
+	uint64_t offset = 0;
+	for (int i = 0; i < m_meta.low_mark(); ++i) {
+		chunk_entry entry = m_meta[i];
+		if (!(entry.state & ENTRY_ACKED)) {
+			entry_id.pos = i;
+			ret.append(m_data.data() + offset, entry.size, entry_id);
+		}
+		offset += entry.size;
+	}
+
+	return ret;
+}
+
 const ioremap::grape::chunk_meta &ioremap::grape::chunk::meta()
 {
 	return m_meta;
 }
 
-void ioremap::grape::chunk::write_meta()
+ioremap::elliptics::async_write_result ioremap::grape::chunk::write_meta()
 {
-	m_session_meta.write_data(m_meta_key, ioremap::elliptics::data_pointer::from_raw(m_meta.data()), 0);
 	++m_stat.write_meta;
+	return m_session_meta.write_data(m_meta_key, ioremap::elliptics::data_pointer::from_raw(m_meta.data()), 0);
 }
 
-void ioremap::grape::chunk::remove()
+void ioremap::grape::chunk::remove(ioremap::grape::reclaimer &reclaimer)
 {
-	m_session_meta.remove(m_meta_key);
-	m_session_data.remove(m_data_key);
+	reclaimer.enqueue(m_meta_key);
+	reclaimer.enqueue(m_data_key);
 	++m_stat.remove;
 }
 
-bool ioremap::grape::chunk::push(const ioremap::elliptics::data_pointer &d)
+void ioremap::grape::chunk::remove_meta(ioremap::grape::reclaimer &reclaimer)
 {
-	LOG_INFO("chunk %d, push-single, index %d", m_chunk_id, m_meta.high_mark());
-
-	// if given chunk already has some cached data, update it too
-	if (m_data.size()) {
-		std::string tmp = m_data.to_string();
-		tmp += d.to_string();
+	reclaimer.enqueue(m_meta_key);
+	++m_stat.remove;
+}
 
-		m_data = ioremap::elliptics::data_pointer::copy(tmp.data(), tmp.size());
+void ioremap::grape::chunk::rewind(const ioremap::grape::chunk_meta &meta, int pos)
+{
+	for (int i = 0; i < meta.high_mark(); ++i) {
+		m_meta.push(meta[i].size, 0, meta[i].state & ~ENTRY_ACKED);
+	}
+	for (int i = 0; i < pos && i < meta.high_mark(); ++i) {
+		m_meta.pop();
+		m_meta.ack(i, m_meta[i].state | ENTRY_ACKED);
 	}
 
-	m_session_data.write_data(m_data_key, d, 0);
-	++m_stat.write_data;
+	// cache is empty and reaches the end of the chunk,
+	// entries to deliver are read from storage
+	m_data_size = m_meta.byte_offset(m_meta.high_mark());
+	m_data.clear();
+	m_data_offset = m_data_size;
+
+	reset_iteration_mode();
+}
+
+bool ioremap::grape::chunk::push(const ioremap::elliptics::data_pointer &d, int deliveries, int state)
+{
+	append(d);
+	return commit(std::vector<pending_entry>(1, pending_entry(d, state)), deliveries);
+}
+
+ioremap::elliptics::async_write_result ioremap::grape::chunk::append(const ioremap::elliptics::data_pointer &d)
+{
+	// Nothing but the append session and the key is touched here,
+	// so that this could run outside of the queue lock
 	//XXX: not going to wait for completion? what if write happen to be unsuccessfull?
+	return m_session_append.write_data(m_data_key, d, 0);
+}
+
+bool ioremap::grape::chunk::commit(const std::vector<pending_entry> &entries, int deliveries)
+{
+	LOG_INFO("chunk %d, push, index %d, entries %ld", m_chunk_id, m_meta.high_mark(), entries.size());
+
+	// Pushed entries are handed to consumers straight from the cache
+	// (instead of being read back from storage) while the cache reaches the end of the chunk
+	bool tail = m_tail_limit && m_data_offset + m_data.size() == m_data_size;
+
+	for (auto i = entries.begin(); i != entries.end(); ++i) {
+		if (tail) {
+			m_data.append((const char *)i->data.data(), i->data.size());
+		}
+		m_data_size += i->data.size();
+
+		m_meta.push(i->data.size(), deliveries, i->state);
+		++m_stat.write_data;
+		++m_stat.push;
+	}
+
+	if (tail) {
+		trim_data();
+	}
 
-	m_meta.push(d.size());
 	if (m_meta.full()) {
 		//XXX: is it good to write meta only for full chunks?
 		write_meta();
 	}
 
-	++m_stat.push;
 	return m_meta.full();
 }
 
-bool ioremap::grape::chunk::ack(int pos)
+void ioremap::grape::chunk::trim_data()
+{
+	if (m_data.size() <= m_tail_limit) {
+		return;
+	}
+
+	// delivered entries are not needed unless chunk is replayed,
+	// and then they are read from storage
+	uint64_t consumed = 0;
+	if (iteration_state.byte_offset > m_data_offset) {
+		consumed = std::min<uint64_t>(iteration_state.byte_offset - m_data_offset, m_data.size());
+	}
+	m_data.erase(0, consumed);
+	m_data_offset += consumed;
+
+	// consumers are far behind pushes, they have to read from storage anyway,
+	// cache is left to follow the end of the chunk
+	if (m_data.size() > m_tail_limit) {
+		LOG_INFO("chunk %d, consumers are %lld bytes behind, dropping cache", m_chunk_id, m_data.size());
+
+		m_data_offset += m_data.size();
+		m_data.clear();
+	}
+}
+
+bool ioremap::grape::chunk::ack(int pos, bool write)
 {
 	//FIXME: check if pos < low < high 
-	m_meta.ack(pos, 1);
-	write_meta();
+	m_meta.ack(pos, m_meta[pos].state | ENTRY_ACKED);
+	if (write) {
+		write_meta();
+	}
 
 	++m_stat.ack;
 
 	return m_meta.complete();
 }
 
+void ioremap::grape::chunk::deliver(int32_t pos)
+{
+	m_meta.deliver(pos);
+}
+
 void ioremap::grape::chunk::reset_iteration()
 {
 	iteration_state = iteration();
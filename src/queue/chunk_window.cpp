@@ -0,0 +1,201 @@
+#include "queue.hpp"
+
+namespace {
+	const size_t INITIAL_WINDOW_CAPACITY = 16;
+}
+
+ioremap::grape::chunk_window::chunk_window()
+	: m_slots(INITIAL_WINDOW_CAPACITY)
+	, m_low(0)
+	, m_high(0)
+{
+	m_first[0] = m_first[1] = 0;
+	m_count[0] = m_count[1] = 0;
+}
+
+int ioremap::grape::chunk_window::flag_index(int flag)
+{
+	return (flag == POPPABLE) ? 0 : 1;
+}
+
+ioremap::grape::chunk_window::slot &ioremap::grape::chunk_window::at(int chunk_id)
+{
+	return m_slots[chunk_id & (m_slots.size() - 1)];
+}
+
+const ioremap::grape::chunk_window::slot &ioremap::grape::chunk_window::at(int chunk_id) const
+{
+	return m_slots[chunk_id & (m_slots.size() - 1)];
+}
+
+ioremap::grape::chunk *ioremap::grape::chunk_window::find(int chunk_id) const
+{
+	if (chunk_id < m_low || chunk_id >= m_high) {
+		return NULL;
+	}
+
+	return at(chunk_id).ptr.get();
+}
+
+ioremap::grape::chunk *ioremap::grape::chunk_window::insert(int chunk_id, std::unique_ptr<chunk> c, int flags)
+{
+	if (chunk_id < 0) {
+		ioremap::elliptics::throw_error(-EINVAL, "invalid chunk window insertion: chunk id: %d", chunk_id);
+	}
+	// chunk with no flags would never be dropped, nothing clears a flag it doesn't have
+	if (!(flags & (POPPABLE | WAITING_ACK))) {
+		ioremap::elliptics::throw_error(-EINVAL, "invalid chunk window insertion: chunk id: %d, no flags: %d",
+				chunk_id, flags);
+	}
+
+	reserve(chunk_id);
+
+	slot &s = at(chunk_id);
+	if (!s.ptr) {
+		s.ptr = std::move(c);
+	}
+
+	set(chunk_id, flags & POPPABLE);
+	set(chunk_id, flags & WAITING_ACK);
+
+	return s.ptr.get();
+}
+
+bool ioremap::grape::chunk_window::test(int chunk_id, int flag) const
+{
+	if (chunk_id < m_low || chunk_id >= m_high) {
+		return false;
+	}
+
+	return (at(chunk_id).flags & flag) != 0;
+}
+
+void ioremap::grape::chunk_window::set(int chunk_id, int flag)
+{
+	if (!flag || !find(chunk_id)) {
+		return;
+	}
+
+	slot &s = at(chunk_id);
+	if (s.flags & flag) {
+		return;
+	}
+
+	s.flags |= flag;
+
+	int i = flag_index(flag);
+	++m_count[i];
+	m_first[i] = std::min(m_first[i], chunk_id);
+}
+
+void ioremap::grape::chunk_window::clear(int chunk_id, int flag)
+{
+	if (!test(chunk_id, flag)) {
+		return;
+	}
+
+	slot &s = at(chunk_id);
+	s.flags &= ~flag;
+	--m_count[flag_index(flag)];
+
+	if (s.flags == 0) {
+		s.ptr.reset();
+		trim();
+	}
+}
+
+int ioremap::grape::chunk_window::first(int flag)
+{
+	int i = flag_index(flag);
+
+	int id = std::max(m_first[i], m_low);
+	while (id < m_high && !(at(id).flags & flag)) {
+		++id;
+	}
+	m_first[i] = id;
+
+	return (id < m_high) ? id : -1;
+}
+
+int ioremap::grape::chunk_window::next(int chunk_id, int flag) const
+{
+	for (int id = std::max(chunk_id + 1, m_low); id < m_high; ++id) {
+		if (at(id).flags & flag) {
+			return id;
+		}
+	}
+
+	return -1;
+}
+
+size_t ioremap::grape::chunk_window::count(int flag) const
+{
+	return m_count[flag_index(flag)];
+}
+
+bool ioremap::grape::chunk_window::empty() const
+{
+	return m_low == m_high;
+}
+
+int ioremap::grape::chunk_window::low() const
+{
+	return m_low;
+}
+
+int ioremap::grape::chunk_window::high() const
+{
+	return m_high;
+}
+
+void ioremap::grape::chunk_window::reset()
+{
+	for (int id = m_low; id < m_high; ++id) {
+		slot &s = at(id);
+		s.ptr.reset();
+		s.flags = 0;
+	}
+
+	m_low = m_high = 0;
+	m_first[0] = m_first[1] = 0;
+	m_count[0] = m_count[1] = 0;
+}
+
+void ioremap::grape::chunk_window::reserve(int chunk_id)
+{
+	if (empty()) {
+		m_low = m_high = chunk_id;
+	}
+
+	int low = std::min(m_low, chunk_id);
+	int high = std::max(m_high, chunk_id + 1);
+
+	size_t capacity = m_slots.size();
+	while (capacity < (size_t)(high - low)) {
+		capacity *= 2;
+	}
+
+	if (capacity != m_slots.size()) {
+		std::vector<slot> slots(capacity);
+		for (int id = m_low; id < m_high; ++id) {
+			slot &s = at(id);
+			slot &d = slots[id & (capacity - 1)];
+			d.ptr = std::move(s.ptr);
+			d.flags = s.flags;
+		}
+		m_slots.swap(slots);
+	}
+
+	m_low = low;
+	m_high = high;
+}
+
+void ioremap::grape::chunk_window::trim()
+{
+	while (m_low < m_high && at(m_low).flags == 0) {
+		++m_low;
+	}
+	while (m_high > m_low && at(m_high - 1).flags == 0) {
+		--m_high;
+	}
+}
@@ -0,0 +1,154 @@
+#include <zlib.h>
+
+#include "queue.hpp"
+
+namespace {
+	const uint64_t PACKED_MAGIC = 0x3130304b43415047ULL; // "GPACK001"
+
+	const uint32_t *block_sizes(const ioremap::elliptics::data_pointer &d)
+	{
+		return (const uint32_t *)(d.data<char>() + sizeof(ioremap::grape::packed_header));
+	}
+
+	// Takes the header off @index, returns false if it's not the header of packed data
+	// of @raw_size bytes or if sizes of all blocks do not follow it
+	bool read_header(const ioremap::elliptics::data_pointer &index, uint64_t raw_size,
+			ioremap::grape::packed_header *header)
+	{
+		if (index.size() < sizeof(*header)) {
+			return false;
+		}
+
+		memcpy(header, index.data(), sizeof(*header));
+
+		if (header->magic != PACKED_MAGIC || header->raw_size != raw_size || !header->block_size) {
+			return false;
+		}
+		if (header->blocks != (raw_size + header->block_size - 1) / header->block_size) {
+			return false;
+		}
+
+		return index.size() >= sizeof(*header) + (uint64_t)header->blocks * sizeof(uint32_t);
+	}
+}
+
+ioremap::elliptics::data_pointer ioremap::grape::pack_data(const ioremap::elliptics::data_pointer &raw, uint32_t block_size)
+{
+	ioremap::grape::packed_header header;
+	header.magic = PACKED_MAGIC;
+	header.raw_size = raw.size();
+	header.block_size = block_size;
+	header.blocks = (raw.size() + block_size - 1) / block_size;
+
+	std::vector<uint32_t> sizes;
+	sizes.reserve(header.blocks);
+
+	std::string blocks;
+	blocks.reserve(compressBound(block_size) * header.blocks);
+
+	std::string block;
+	for (uint64_t offset = 0; offset < raw.size(); offset += block_size) {
+		uLong size = std::min<uint64_t>(block_size, raw.size() - offset);
+
+		uLongf packed_size = compressBound(size);
+		block.resize(packed_size);
+
+		int err = compress2((Bytef *)&block[0], &packed_size,
+				(const Bytef *)raw.data<char>() + offset, size, Z_BEST_SPEED);
+		if (err != Z_OK) {
+			ioremap::elliptics::throw_error(-EINVAL, "block at %llu: compression failed: %d",
+					(unsigned long long)offset, err);
+		}
+
+		sizes.push_back(packed_size);
+		blocks.append(block.data(), packed_size);
+	}
+
+	std::string data;
+	data.reserve(sizeof(header) + sizes.size() * sizeof(uint32_t) + blocks.size());
+	data.append((const char *)&header, sizeof(header));
+	data.append((const char *)sizes.data(), sizes.size() * sizeof(uint32_t));
+	data.append(blocks);
+
+	return ioremap::elliptics::data_pointer::copy(data.data(), data.size());
+}
+
+uint64_t ioremap::grape::packed_index_size(uint64_t raw_size, uint32_t block_size)
+{
+	return sizeof(ioremap::grape::packed_header) + (raw_size + block_size - 1) / block_size * sizeof(uint32_t);
+}
+
+uint64_t ioremap::grape::packed_block_offset(const ioremap::elliptics::data_pointer &index, uint64_t raw_size,
+		uint64_t packed_size, uint64_t *offset)
+{
+	ioremap::grape::packed_header header;
+	if (!read_header(index, raw_size, &header)) {
+		ioremap::elliptics::throw_error(-EINVAL, "malformed packed data index: %ld bytes, expected %llu raw bytes",
+				index.size(), (unsigned long long)raw_size);
+	}
+
+	uint32_t first = std::min<uint64_t>(*offset, header.raw_size) / header.block_size;
+	*offset = (uint64_t)first * header.block_size;
+
+	const uint32_t *sizes = block_sizes(index);
+	uint64_t size = sizeof(header) + (uint64_t)header.blocks * sizeof(uint32_t);
+	uint64_t block_offset = size;
+	for (uint32_t i = 0; i < header.blocks; ++i) {
+		if (i == first) {
+			block_offset = size;
+		}
+		size += sizes[i];
+	}
+	if (first == header.blocks) {
+		block_offset = size;
+	}
+
+	if (size != packed_size) {
+		ioremap::elliptics::throw_error(-EINVAL, "malformed packed data index: blocks take %llu bytes, "
+				"packed data has %llu", (unsigned long long)size, (unsigned long long)packed_size);
+	}
+
+	return block_offset;
+}
+
+std::string ioremap::grape::unpack_blocks(const ioremap::elliptics::data_pointer &index,
+		const ioremap::elliptics::data_pointer &blocks, uint64_t offset)
+{
+	ioremap::grape::packed_header header;
+	memcpy(&header, index.data(), sizeof(header));
+
+	const uint32_t *sizes = block_sizes(index);
+	const char *block = blocks.data<char>();
+	const char *end = block + blocks.size();
+
+	std::string raw;
+	raw.resize(header.raw_size - offset);
+
+	uint64_t raw_offset = 0;
+	for (uint32_t i = offset / header.block_size; i < header.blocks; ++i) {
+		if (sizes[i] > (uint64_t)(end - block)) {
+			ioremap::elliptics::throw_error(-EINVAL, "block %u: packed data is cut short: %ld bytes left, block has %u",
+					i, end - block, sizes[i]);
+		}
+
+		uLongf size = std::min<uint64_t>(header.block_size, raw.size() - raw_offset);
+		uLongf expected = size;
+
+		int err = uncompress((Bytef *)&raw[raw_offset], &size, (const Bytef *)block, sizes[i]);
+		if (err != Z_OK || size != expected) {
+			ioremap::elliptics::throw_error(-EINVAL, "block %u: decompression failed: %d, size: %lu, expected: %lu",
+					i, err, (unsigned long)size, (unsigned long)expected);
+		}
+
+		block += sizes[i];
+		raw_offset += size;
+	}
+
+	return raw;
+}
+
+std::string ioremap::grape::unpack_data(const ioremap::elliptics::data_pointer &d, uint64_t raw_size, uint64_t *offset)
+{
+	uint64_t block_offset = packed_block_offset(d, raw_size, d.size(), offset);
+	return unpack_blocks(d, d.skip(block_offset), *offset);
+}
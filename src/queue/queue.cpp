@@ -1,3 +1,9 @@
+#include <algorithm>
+#include <climits>
+#include <iterator>
+#include <cmath>
+#include <thread>
+
 #include <cocaine/framework/logging.hpp>
 
 #include "grape/rapidjson/document.h"
@@ -28,375 +34,3633 @@ std::shared_ptr<cocaine::framework::logger_t> grape_queue_module_get_logger() {
 namespace ioremap { namespace grape {
 
 const int DEFAULT_MAX_CHUNK_SIZE = 10000;
-
-queue::queue(const std::string &queue_id)
-	: m_chunk_max(DEFAULT_MAX_CHUNK_SIZE)
-	, m_queue_id(queue_id)
-	, m_queue_state_id(m_queue_id + ".state")
-	, m_last_timeout_check_time(0)
+const double DEFAULT_ACK_TIMEOUT = 5.0;
+const int DEFAULT_RECLAIM_CONCURRENCY = 64;
+const size_t PUSH_RING_SIZE = 1024;
+const uint64_t DEFAULT_HOT_TAIL_SIZE = 16 * 1024 * 1024;
+const double DEFAULT_DELAY_BUCKET_WIDTH = 1.0;
+const double DEFAULT_THROTTLE_RETRY = 1.0;
+const int DEFAULT_MAX_PRODUCERS = 10000;
+const int DEFAULT_MAX_KEY_BACKLOG = 100000;
+const double DEFAULT_PACK_DELAY = 60.0;
+const int DEFAULT_DISPATCH_THREADS = 1;
+const double DEFAULT_SUBSCRIPTION_LEASE = 60.0;
+
+// Keyed entry is stored as key size (uint16_t), key and entry data itself
+ioremap::elliptics::data_pointer frame_keyed(const std::string &key, const ioremap::elliptics::data_pointer &d)
 {
+	if (key.size() > UINT16_MAX) {
+		ioremap::elliptics::throw_error(-EINVAL, "ordering key is too long: %ld bytes", key.size());
+	}
+
+	uint16_t key_size = key.size();
+
+	std::string framed;
+	framed.reserve(sizeof(key_size) + key.size() + d.size());
+	framed.append((const char *)&key_size, sizeof(key_size));
+	framed.append(key);
+	framed.append((const char *)d.data(), d.size());
+
+	return ioremap::elliptics::data_pointer::copy(framed.data(), framed.size());
 }
 
-void queue::initialize(const std::string &config)
+// Returns size of the key prefix, zero if entry data is malformed
+size_t unframe_keyed(const char *data, size_t size, std::string *key)
 {
-	memset(&m_statistics, 0, sizeof(m_statistics));
-
-	rapidjson::Document doc;
-	m_client = elliptics_client_state::create(config, doc);
+	uint16_t key_size;
+	if (size < sizeof(key_size)) {
+		return 0;
+	}
+	memcpy(&key_size, data, sizeof(key_size));
 
-	LOG_INFO("init: elliptics client created");
+	if (size < sizeof(key_size) + key_size) {
+		return 0;
+	}
+	key->assign(data + sizeof(key_size), key_size);
 
-	if (doc.HasMember("chunk-max-size"))
-		m_chunk_max = doc["chunk-max-size"].GetInt();
+	return sizeof(key_size) + key_size;
+}
 
-	memset(&m_state, 0, sizeof(m_state));
+pending_entry make_pending(const ioremap::elliptics::data_pointer &d, const std::string &key, int priority)
+{
+	if (key.empty()) {
+		return pending_entry(d, 0, priority);
+	}
 
-	try {
-		ioremap::elliptics::data_pointer d = m_client.create_session().read_data(m_queue_state_id, 0, 0).get_one().file();
-		auto *state = d.data<queue_state>();
-	
-		m_state.chunk_id_push = state->chunk_id_push;
-		m_state.chunk_id_ack = state->chunk_id_ack;
+	return pending_entry(frame_keyed(key, d), ENTRY_KEYED, priority);
+}
 
-		LOG_INFO("init: queue meta found: chunk_id_ack %d, chunk_id_push %d",
-				m_state.chunk_id_ack, m_state.chunk_id_push
-				);
+double unix_time()
+{
+	return std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
 
-	} catch (const ioremap::elliptics::not_found_error &) {
-		LOG_INFO("init: no queue meta found, starting in pristine state");
-	}
+// Drops producers which pushed least recently till at most @max of them are left
+template <typename T>
+void forget_producers(std::map<std::string, T> &table, size_t max)
+{
+	while (table.size() > max) {
+		auto idle = table.begin();
+		for (auto it = table.begin(); it != table.end(); ++it) {
+			if (it->second.last_push < idle->second.last_push) {
+				idle = it;
+			}
+		}
 
-	// load metadata of existing chunk into memory
-	ioremap::elliptics::session tmp = m_client.create_session();
-	for (int i = m_state.chunk_id_ack; i <= m_state.chunk_id_push; ++i) {
-		auto p = std::make_shared<chunk>(tmp, m_queue_id, i, m_chunk_max);
-		m_chunks.insert(std::make_pair(i, p));
-		p->load_meta();
+		LOG_INFO("producer '%s' pushed least recently, forgetting it", idle->first.c_str());
+		table.erase(idle);
 	}
+}
 
-	LOG_INFO("init: queue started");
+queue::queue(const std::string &queue_id)
+	: m_chunk_max(DEFAULT_MAX_CHUNK_SIZE)
+	, m_ack_timeout(DEFAULT_ACK_TIMEOUT)
+	, m_max_deliveries(0)
+	, m_max_key_backlog(DEFAULT_MAX_KEY_BACKLOG)
+	, m_compact_max_unacked(0)
+	, m_hot_tail_size(DEFAULT_HOT_TAIL_SIZE)
+	, m_relaxed_order_chunks(0)
+	, m_queue_id(queue_id)
+	, m_retention_time(0)
+	, m_max_age(0)
+	, m_max_bytes(0)
+	, m_blob_threshold(0)
+	, m_pack_block_size(0)
+	, m_pack_delay(DEFAULT_PACK_DELAY)
+	, m_packing(-1)
+	, m_packing_removed(false)
+	, m_push_ring(PUSH_RING_SIZE)
+	, m_push_done(0)
+	, m_push_writes(0)
+	, m_dispatch_threads(DEFAULT_DISPATCH_THREADS)
+	, m_high_entries(0)
+	, m_low_entries(0)
+	, m_high_bytes(0)
+	, m_low_bytes(0)
+	, m_high_writes(0)
+	, m_low_writes(0)
+	, m_throttle_retry(DEFAULT_THROTTLE_RETRY)
+	, m_backlog_throttled(false)
+	, m_writes_throttled(false)
+	, m_max_producers(DEFAULT_MAX_PRODUCERS)
+	, m_sequences_due(0)
+	, m_next_subscription_id(0)
+	, m_subscription_lease(DEFAULT_SUBSCRIPTION_LEASE)
+	, m_stopping(false)
+	, m_epoch(0)
+	, m_lane_count(0)
+	, m_dead_letter_id(m_queue_id + ".dead-letter")
+	, m_delay_bucket_width(DEFAULT_DELAY_BUCKET_WIDTH)
+	, m_delay_due(0)
+{
+	memset(&m_dead_letter_state, 0, sizeof(m_dead_letter_state));
 }
 
-void queue::write_state()
+queue::~queue()
 {
-	m_client.create_session().write_data(m_queue_state_id,
-			ioremap::elliptics::data_pointer::from_raw(&m_state, sizeof(queue_state)),
-			0);
+	{
+		std::lock_guard<std::mutex> guard(m_mutex);
+		m_stopping = true;
+	}
+	m_timer_cond.notify_all();
+	m_pack_cond.notify_all();
 
-	m_statistics.state_write_count++;
+	if (m_timer_thread.joinable()) {
+		m_timer_thread.join();
+	}
+	if (m_pack_thread.joinable()) {
+		m_pack_thread.join();
+	}
+
+	// sequence numbers not yet written by the timer
+	if (m_sequences_due) {
+		write_sequences();
+	}
 }
 
-void queue::clear()
+void queue::initialize(const std::string &config)
 {
-	LOG_INFO("clearing queue");
+	memset(&m_statistics, 0, sizeof(m_statistics));
 
-	LOG_INFO("erasing state");
-	queue_state state = m_state;
-	memset(&m_state, 0, sizeof(m_state));
-	write_state();
+	rapidjson::Document doc;
+	m_client = elliptics_client_state::create(config, doc);
 
-	LOG_INFO("removing chunks, from %d to %d", state.chunk_id_ack, state.chunk_id_push);
-	std::map<int, shared_chunk> remove_list;
-	remove_list.swap(m_chunks);
-	remove_list.insert(m_wait_ack.cbegin(), m_wait_ack.cend());
-	m_wait_ack.clear();
+	LOG_INFO("init: elliptics client created");
 
-	for (auto i = remove_list.cbegin(); i != remove_list.cend(); ++i) {
-		int chunk_id = i->first;
-		auto chunk = i->second;
-		chunk->remove();
+	if (doc.HasMember("chunk-max-size"))
+		m_chunk_max = doc["chunk-max-size"].GetInt();
+	if (doc.HasMember("ack-timeout"))
+		m_ack_timeout = doc["ack-timeout"].GetDouble();
+	if (doc.HasMember("max-deliveries"))
+		m_max_deliveries = doc["max-deliveries"].GetInt();
+	if (doc.HasMember("key-backlog-max"))
+		m_max_key_backlog = doc["key-backlog-max"].GetInt();
+	if (doc.HasMember("compact-max-unacked"))
+		m_compact_max_unacked = doc["compact-max-unacked"].GetInt();
+	if (doc.HasMember("hot-tail-size"))
+		m_hot_tail_size = doc["hot-tail-size"].GetUint64();
+	if (doc.HasMember("relaxed-order-chunks"))
+		m_relaxed_order_chunks = doc["relaxed-order-chunks"].GetInt();
+	if (doc.HasMember("delay-bucket-width"))
+		m_delay_bucket_width = doc["delay-bucket-width"].GetDouble();
+	if (doc.HasMember("retention-time"))
+		m_retention_time = doc["retention-time"].GetDouble();
+	if (doc.HasMember("max-age"))
+		m_max_age = doc["max-age"].GetDouble();
+	if (doc.HasMember("max-bytes"))
+		m_max_bytes = doc["max-bytes"].GetUint64();
+	if (doc.HasMember("blob-threshold"))
+		m_blob_threshold = doc["blob-threshold"].GetUint64();
+	if (doc.HasMember("pack-block-size"))
+		m_pack_block_size = doc["pack-block-size"].GetUint();
+	if (doc.HasMember("pack-delay"))
+		m_pack_delay = doc["pack-delay"].GetDouble();
+	if (doc.HasMember("subscription-lease"))
+		m_subscription_lease = doc["subscription-lease"].GetDouble();
+	if (doc.HasMember("backlog-high-entries"))
+		m_high_entries = doc["backlog-high-entries"].GetUint64();
+	m_low_entries = m_high_entries;
+	if (doc.HasMember("backlog-low-entries"))
+		m_low_entries = doc["backlog-low-entries"].GetUint64();
+	if (doc.HasMember("backlog-high-bytes"))
+		m_high_bytes = doc["backlog-high-bytes"].GetUint64();
+	m_low_bytes = m_high_bytes;
+	if (doc.HasMember("backlog-low-bytes"))
+		m_low_bytes = doc["backlog-low-bytes"].GetUint64();
+	if (doc.HasMember("push-high-writes"))
+		m_high_writes = doc["push-high-writes"].GetInt();
+	m_low_writes = m_high_writes;
+	if (doc.HasMember("push-low-writes"))
+		m_low_writes = doc["push-low-writes"].GetInt();
+	if (doc.HasMember("throttle-retry-after"))
+		m_throttle_retry = doc["throttle-retry-after"].GetDouble();
+
+	if (doc.HasMember("producer-limits")) {
+		const rapidjson::Value &limits = doc["producer-limits"];
+		for (auto i = limits.MemberBegin(); i != limits.MemberEnd(); ++i) {
+			producer_bucket b;
+			memset(&b, 0, sizeof(b));
+			if (i->value.HasMember("rate"))
+				b.rate = i->value["rate"].GetDouble();
+			b.burst = std::max(1.0, b.rate);
+			if (i->value.HasMember("burst"))
+				b.burst = std::max(1.0, i->value["burst"].GetDouble());
+			b.tokens = b.burst;
+
+			m_producer_limits[i->name.GetString()] = b;
+		}
+	}
+	if (doc.HasMember("max-producers")) {
+		int max_producers = doc["max-producers"].GetInt();
+		if (max_producers < 1) {
+			ioremap::elliptics::throw_error(-EINVAL, "invalid max-producers: %d", max_producers);
+		}
+		m_max_producers = max_producers;
+	}
+	if (doc.HasMember("dispatch-threads")) {
+		int dispatch_threads = doc["dispatch-threads"].GetInt();
+		if (dispatch_threads < 1) {
+			ioremap::elliptics::throw_error(-EINVAL, "invalid dispatch-threads: %d", dispatch_threads);
+		}
+		m_dispatch_threads = dispatch_threads;
 	}
 
-	remove_list.clear();
+	if (m_delay_bucket_width <= 0) {
+		ioremap::elliptics::throw_error(-EINVAL, "invalid delay bucket width: %f", m_delay_bucket_width);
+	}
 
-	LOG_INFO("dropping statistics");
-	clear_counters();
+	int reclaim_concurrency = DEFAULT_RECLAIM_CONCURRENCY;
+	if (doc.HasMember("reclaim-concurrency"))
+		reclaim_concurrency = doc["reclaim-concurrency"].GetInt();
 
-	LOG_INFO("queue cleared");
-}
+	m_reclaimer = std::make_shared<reclaimer>(m_client.create_session(), reclaim_concurrency);
 
-void queue::push(const ioremap::elliptics::data_pointer &d)
-{
-	auto found = m_chunks.find(m_state.chunk_id_push);
-	if (found == m_chunks.end()) {
-		// create new empty chunk
-		ioremap::elliptics::session tmp = m_client.create_session();
-		auto p = std::make_shared<chunk>(tmp, m_queue_id, m_state.chunk_id_push, m_chunk_max);
-		auto inserted = m_chunks.insert(std::make_pair(m_state.chunk_id_push, p));
+	// weight of every priority class, class 0 is the lowest one
+	std::vector<int> weights(1, 1);
+	if (doc.HasMember("priority-weights")) {
+		const rapidjson::Value &array = doc["priority-weights"];
+		weights.clear();
+		for (auto i = array.Begin(); i != array.End(); ++i) {
+			weights.push_back(std::max(1, i->GetInt()));
+		}
+		if (weights.empty() || weights.size() > (size_t)(INT_MAX / LANE_CHUNK_SPAN)) {
+			ioremap::elliptics::throw_error(-EINVAL, "invalid number of priority classes: %ld", weights.size());
+		}
+	}
 
-		found = inserted.first;
+	// the default group is always there, it has empty name
+	std::vector<std::string> names(1, std::string());
+	if (doc.HasMember("consumer-groups")) {
+		const rapidjson::Value &array = doc["consumer-groups"];
+		for (auto i = array.Begin(); i != array.End(); ++i) {
+			std::string name = i->GetString();
+			if (name.empty() || std::find(names.begin(), names.end(), name) != names.end()) {
+				ioremap::elliptics::throw_error(-EINVAL, "invalid consumer group name: '%s'", name.c_str());
+			}
+			names.push_back(name);
+		}
 	}
 
-	int chunk_id = found->first;
-	auto chunk = found->second;
+	m_lane_count = weights.size();
+	m_groups.clear();
+	for (auto name = names.begin(); name != names.end(); ++name) {
+		std::string id = name->empty() ? m_queue_id : m_queue_id + ".group." + *name;
+		std::unique_ptr<consumer_group> g(new consumer_group(*name, id));
+
+		for (size_t i = 0; i < weights.size(); ++i) {
+			// class 0 keeps the state key of a queue without classes
+			std::string state_id = id + ".state";
+			if (i > 0) {
+				state_id += "." + std::to_string(i);
+			}
+			g->lanes.emplace_back(new lane(i, weights[i], i + 1 == weights.size(), state_id));
+		}
+		g->lane_turn = g->lanes.size() - 1;
 
-	if (chunk->push(d)) {
-		LOG_INFO("chunk %d filled", chunk_id);
+		m_groups.push_back(std::move(g));
+	}
 
-		++m_state.chunk_id_push;
-		write_state();
+	ioremap::elliptics::session tmp = m_client.create_session();
 
-		chunk->add(&m_statistics.chunks_pushed);
+	// Group which has no state yet joins the queue at the push chunk of the default group,
+	// entries pushed before it joined are taken as acked
+	std::set<lane *> joining;
+	for (auto g = m_groups.begin(); g != m_groups.end(); ++g) {
+		for (auto it = (*g)->lanes.begin(); it != (*g)->lanes.end(); ++it) {
+			lane &l = **it;
+
+			try {
+				ioremap::elliptics::data_pointer d = tmp.read_data(l.state_id, 0, 0).get_one().file();
+				auto *state = d.data<queue_state>();
+
+				l.state.chunk_id_push = state->chunk_id_push;
+				l.state.chunk_id_ack = state->chunk_id_ack;
+
+				// Class could have had more chunk ids before classes were added,
+				// its chunks would be taken for ones of the next class
+				if (l.state.chunk_id_ack < l.base() || l.state.chunk_id_ack > l.state.chunk_id_push ||
+						l.state.chunk_id_push > l.end()) {
+					ioremap::elliptics::throw_error(-ERANGE, "group '%s', class %d: chunk ids %d-%d are out of "
+							"the class range %d-%d, queue can't be run with this many priority classes",
+							(*g)->name.c_str(), l.priority, l.state.chunk_id_ack, l.state.chunk_id_push,
+							l.base(), l.end());
+				}
+
+				LOG_INFO("init: group '%s', class %d, queue meta found: chunk_id_ack %d, chunk_id_push %d",
+						(*g)->name.c_str(), l.priority, l.state.chunk_id_ack, l.state.chunk_id_push
+						);
+
+			} catch (const ioremap::elliptics::not_found_error &) {
+				if (g == m_groups.begin()) {
+					LOG_INFO("init: class %d, no queue meta found, starting in pristine state", l.priority);
+				} else {
+					LOG_INFO("init: group '%s', class %d, no queue meta found, joining the queue",
+							(*g)->name.c_str(), l.priority);
+					joining.insert(&l);
+				}
+			}
+		}
 	}
 
-	++m_statistics.push_count;
-}
-
-ioremap::elliptics::data_pointer queue::peek(entry_id *entry_id)
-{
-	check_timeouts();
+	for (auto it = joining.begin(); it != joining.end(); ++it) {
+		lane &l = **it;
+		l.state.chunk_id_ack = l.state.chunk_id_push = m_groups[0]->lanes[l.priority]->state.chunk_id_push;
+	}
 
-	ioremap::elliptics::data_pointer d;
-	*entry_id = {-1, -1};
+	// load metadata of existing chunks into memory,
+	// all reads are sent at once and then waited for
+	std::vector<ioremap::elliptics::async_read_result> metas;
+
+	for (auto g = m_groups.begin(); g != m_groups.end(); ++g) {
+		for (auto it = (*g)->lanes.begin(); it != (*g)->lanes.end(); ++it) {
+			lane &l = **it;
+			if (joining.count(&l)) {
+				continue;
+			}
+
+			for (int i = l.state.chunk_id_ack; i <= l.state.chunk_id_push; ++i) {
+				std::unique_ptr<chunk> p(new chunk(tmp, m_queue_id, i, m_chunk_max, m_hot_tail_size, (*g)->id));
+				metas.push_back(p->read_meta());
+				l.chunks.insert(i, std::move(p), chunk_window::POPPABLE);
+			}
+		}
+	}
 
-	while (true) {
-		auto found = m_chunks.begin();
-		if (found == m_chunks.end()) {
-			break;
+	auto meta = metas.begin();
+	for (auto g = m_groups.begin(); g != m_groups.end(); ++g) {
+		for (auto it = (*g)->lanes.begin(); it != (*g)->lanes.end(); ++it) {
+			lane &l = **it;
+			if (joining.count(&l)) {
+				continue;
+			}
+
+			for (int i = l.state.chunk_id_ack; i <= l.state.chunk_id_push; ++i) {
+				l.chunks.find(i)->load_meta(*meta++);
+			}
 		}
+	}
 
-		int chunk_id = found->first;
-		auto chunk = found->second;
+	for (size_t n = 1; n < m_groups.size(); ++n) {
+		consumer_group &g = *m_groups[n];
+		for (auto it = g.lanes.begin(); it != g.lanes.end(); ++it) {
+			lane &l = **it;
+			if (!joining.count(&l)) {
+				continue;
+			}
+
+			int chunk_id = l.state.chunk_id_push;
+			std::unique_ptr<chunk> p(new chunk(tmp, m_queue_id, chunk_id, m_chunk_max, m_hot_tail_size, g.id));
+			const chunk_meta &head = m_groups[0]->lanes[l.priority]->chunks.find(chunk_id)->meta();
+			p->rewind(head, head.high_mark());
+			p->write_meta();
+			l.chunks.insert(chunk_id, std::move(p), chunk_window::POPPABLE);
+
+			write_state(l);
+		}
+	}
 
-		entry_id->chunk = chunk_id;
-		d = chunk->pop(&entry_id->pos);
+	m_data_low.assign(m_lane_count, INT_MAX);
+	for (auto g = m_groups.begin(); g != m_groups.end(); ++g) {
+		for (auto it = (*g)->lanes.begin(); it != (*g)->lanes.end(); ++it) {
+			recount(**it);
 
-		LOG_INFO("popping entry %d-%d (%ld)'%s'", entry_id->chunk, entry_id->pos, d.size(), d.to_string());
-		if (!d.empty()) {
-			m_statistics.pop_count++;
+			int &low = m_data_low[(*it)->priority];
+			low = std::min(low, (*it)->state.chunk_id_ack);
+		}
+	}
 
-			// set or reset timeout timer for the chunk
-			update_chunk_timeout(chunk_id, chunk);
+	m_stored_chunks.clear();
+	try {
+		ioremap::elliptics::data_pointer d = tmp.read_data(m_queue_id + ".time-index", 0, 0).get_one().file();
+		const chunk_time_disk *times = d.data<chunk_time_disk>();
+		for (size_t i = 0; i < d.size() / sizeof(chunk_time_disk); ++i) {
+			m_stored_chunks[times[i].chunk_id] = stored_chunk{times[i].time, times[i].size, times[i].blobs,
+				times[i].packed_size};
+		}
 
+		// blobs handed over to chunks are kept in memory to be removed along with them
+		for (size_t i = 0; i < d.size() / sizeof(chunk_time_disk); ++i) {
+			if (!times[i].adopted) {
+				continue;
+			}
+
+			try {
+				m_stored_chunks[times[i].chunk_id].adopted = deserialize<std::vector<std::string>>(
+						tmp.read_data(chunk::adopted_key(m_queue_id, times[i].chunk_id), 0, 0).get_one().file());
+			} catch (const ioremap::elliptics::not_found_error &) {
+				LOG_ERROR("init: chunk %d, keys of its %d adopted blobs are not found, they are left behind",
+						times[i].chunk_id, times[i].adopted);
+			}
 		}
+	} catch (const ioremap::elliptics::not_found_error &) {
+	}
 
-		if (chunk_id == m_state.chunk_id_push) {
-			break;
+	// chunks created before the time index was kept are taken as created right now
+	bool indexed = true;
+	double now = unix_time();
+	for (size_t priority = 0; priority < m_lane_count; ++priority) {
+		for (int i = m_data_low[priority]; i <= m_groups[0]->lanes[priority]->state.chunk_id_push; ++i) {
+			if (m_stored_chunks.insert(std::make_pair(i, stored_chunk{now, 0, 0})).second) {
+				indexed = false;
+			}
+
+			// chunks filled before sizes were kept
+			chunk *c = m_groups[0]->lanes[priority]->chunks.find(i);
+			stored_chunk &stored = m_stored_chunks[i];
+			if (c && c->meta().full() && !stored.size) {
+				stored.size = c->meta().byte_offset(c->meta().high_mark());
+				indexed = false;
+			}
 		}
+	}
+	if (!indexed) {
+		write_time_index();
+	}
 
-		if (chunk->expect_no_more()) {
-			//FIXME: this could happen to be called many times for the same chunk
-			// (between queue restarts or because of chunk replaying)
-			chunk->add(&m_statistics.chunks_popped);
+	if (retaining()) {
+		LOG_INFO("init: retaining chunks for %f seconds", m_retention_time);
+		start_timer();
+	}
+	if (truncating()) {
+		start_timer();
+	}
 
-			LOG_INFO("chunk %d exhausted, dropped from the popping line", chunk_id);
+	try {
+		ioremap::elliptics::data_pointer d = tmp.read_data(m_queue_id + ".sequences", 0, 0).get_one().file();
+		m_done_sequences = deserialize<std::map<std::string, producer_sequence>>(d);
+		// limit could have been lowered since
+		forget_producers(m_done_sequences, m_max_producers);
+		m_sequences = m_done_sequences;
 
-			// drop chunk from the pop list
-			m_chunks.erase(found);
+		LOG_INFO("init: sequence numbers of %ld producers found", m_done_sequences.size());
+	} catch (const ioremap::elliptics::not_found_error &) {
+	}
+
+	// only the index of delayed entries is read, buckets are read when due
+	m_delayed.clear();
+	try {
+		ioremap::elliptics::data_pointer d = tmp.read_data(m_queue_id + ".delayed.state", 0, 0).get_one().file();
+		const delay_bucket_disk *buckets = d.data<delay_bucket_disk>();
+		for (size_t i = 0; i < d.size() / sizeof(delay_bucket_disk); ++i) {
+			delay_bucket &b = m_delayed[buckets[i].bucket];
+			b.chunks = buckets[i].chunks;
+			b.promoted = buckets[i].promoted;
 		}
+	} catch (const ioremap::elliptics::not_found_error &) {
+	}
 
-		break;
+	if (!m_delayed.empty()) {
+		LOG_INFO("init: %ld delay buckets found", m_delayed.size());
+
+		m_delay_due = m_delayed.begin()->first * m_delay_bucket_width;
+		start_timer();
 	}
 
-	return d;
+	update_backlog();
+
+	LOG_INFO("init: queue started, %ld priority classes, %ld consumer groups", m_lane_count, m_groups.size());
 }
 
-void queue::update_chunk_timeout(int chunk_id, shared_chunk chunk)
+void queue::write_state(lane &l)
 {
-	// add chunk to the waiting list and postpone its deadline time
-	m_wait_ack.insert({chunk_id, chunk});
-	//TODO: make acking timeout value configurable
-	chunk->reset_time(5.0);	
+	m_client.create_session().write_data(l.state_id,
+			ioremap::elliptics::data_pointer::from_raw(&l.state, sizeof(queue_state)),
+			0);
+
+	m_statistics.state_write_count++;
 }
 
-void queue::check_timeouts()
+size_t queue::class_of(int chunk_id) const
 {
-	struct timeval tv;
-	gettimeofday(&tv, NULL);
+	return std::min((size_t)(chunk_id / LANE_CHUNK_SPAN), m_lane_count - 1);
+}
 
-	// check no more then once in 1 second
-	//TODO: make timeout check interval configurable
-	if ((tv.tv_sec - m_last_timeout_check_time) < 1) {
-		return;
+lane *queue::lane_of(consumer_group &g, int chunk_id)
+{
+	if (chunk_id < 0) {
+		return NULL;
 	}
-	m_last_timeout_check_time = tv.tv_sec;
-
-	LOG_INFO("checking timeouts: %ld waiting chunks", m_wait_ack.size());
 
-	auto i = m_wait_ack.begin();
-	while (i != m_wait_ack.end()) {
-		int chunk_id = i->first;
-		auto chunk = i->second;
+	return g.lanes[class_of(chunk_id)].get();
+}
 
-		if (chunk->get_time() > tv.tv_sec) {
-			++i;
-			continue;
+consumer_group &queue::group(const std::string &name)
+{
+	for (auto g = m_groups.begin(); g != m_groups.end(); ++g) {
+		if ((*g)->name == name) {
+			return **g;
 		}
+	}
 
-		// Time passed but chunk still is not complete
-		// so we must replay unacked items from it.
-		LOG_ERROR("chunk %d timed out, returning back to the popping line, current time: %ld, chunk expiration time: %f",
-				chunk_id, tv.tv_sec, chunk->get_time());
+	ioremap::elliptics::throw_error(-ENOENT, "there is no consumer group '%s'", name.c_str());
+	return *m_groups[0];
+}
 
-		// There are two cases when chunk can still be in m_chunks
-		// while experiencing a timeout:
-		// 1) if it's a single chunk in the queue (and serves both
-		//    as a push and a pop/ack target)
-		// 2) if iteration of this chunk was preempted by other timed out chunk
-		//    and then later this chunk timed out in its turn
-		// Timeout requires switch chunk's iteration into the replay mode.
+void queue::reclaim_data(int priority)
+{
+	int low = INT_MAX;
+	for (auto g = m_groups.begin(); g != m_groups.end(); ++g) {
+		low = std::min(low, (*g)->lanes[priority]->state.chunk_id_ack);
+	}
 
-		auto inserted = m_chunks.insert({chunk_id, chunk});
-		if (!inserted.second) {
-			LOG_INFO("chunk %d is already in popping line", chunk_id);
-		} else {
-			LOG_INFO("chunk %d inserted back to the popping line anew", chunk_id);
+	// seek could have moved it down
+	m_data_low[priority] = low;
+	update_backlog();
+
+	// retained chunks all groups are done with are packed right away
+	if (m_retention_time > 0) {
+		double now = unix_time();
+		bool due = false;
+		for (auto it = m_sealed.lower_bound(priority * LANE_CHUNK_SPAN); it != m_sealed.end() && it->first < low; ++it) {
+			if (it->second > now) {
+				it->second = now;
+				due = true;
+			}
 		}
-		chunk->reset_iteration();
-
-		auto hold = i;
-		++i;
-		m_wait_ack.erase(hold);
+		if (due) {
+			m_pack_cond.notify_one();
+		}
+	}
 
-		// number of popped but still unacked entries
-		m_statistics.timeout_count += (chunk->meta().low_mark() - chunk->meta().acked());
+	expire_chunks();
+	if (retaining()) {
+		start_timer();
+		m_timer_cond.notify_one();
 	}
 }
 
-void queue::ack(const entry_id id)
+void queue::expire_chunks()
 {
-	auto found = m_wait_ack.find(id.chunk);
-	if (found == m_wait_ack.end()) {
-		LOG_ERROR("ack for chunk %d (pos %d) which is not in waiting list", id.chunk, id.pos);
-		return;
+	double now = unix_time();
+	bool changed = false;
+
+	for (size_t priority = 0; priority < m_data_low.size(); ++priority) {
+		int end = m_groups[0]->lanes[priority]->end();
+
+		auto it = m_stored_chunks.lower_bound(priority * LANE_CHUNK_SPAN);
+		while (it != m_stored_chunks.end() && it->first < m_data_low[priority]) {
+			// chunk was taking entries until the next one was created
+			auto next = std::next(it);
+			if (m_retention_time > 0) {
+				if (next == m_stored_chunks.end() || next->first >= end) {
+					break;
+				}
+				if (next->second.time + m_retention_time > now) {
+					break;
+				}
+			}
+
+			if (m_retention_time > 0) {
+				remove_retained(it->first);
+			} else {
+				// every group has removed its own meta already
+				remove_data(it->first);
+			}
+
+			it = m_stored_chunks.erase(it);
+			changed = true;
+		}
 	}
 
-	auto chunk = found->second;
-	chunk->ack(id.pos);
-	if (chunk->meta().acked() == chunk->meta().low_mark()) {
-		// Real end of the chunk's lifespan, all popped entries are acked
+	if (changed) {
+		write_time_index();
+	}
+}
+
+void queue::remove_retained(int chunk_id)
+{
+	remove_data(chunk_id);
+	for (auto g = m_groups.begin(); g != m_groups.end(); ++g) {
+		m_reclaimer->enqueue(chunk::meta_key((*g)->id, chunk_id));
+	}
+}
 
-		m_wait_ack.erase(found);
+void queue::remove_data(int chunk_id)
+{
+	m_sealed.erase(chunk_id);
 
-		chunk->add(&m_statistics.chunks_popped);
+	if (chunk_id == m_packing) {
+		m_packing_removed = true;
+	} else {
+		m_reclaimer->enqueue(chunk::data_key(m_queue_id, chunk_id));
+	}
 
-		// Chunk would be uncomplete here only if its the only chunk in the queue
-		// (filled partially and serving both as a push and a pop/ack target)
-		if (chunk->meta().complete()) {
-			chunk->remove();
-			LOG_INFO("chunk %d complete", id.chunk);
+	auto stored = m_stored_chunks.find(chunk_id);
+	if (stored != m_stored_chunks.end()) {
+		for (int i = 0; i < stored->second.blobs; ++i) {
+			m_reclaimer->enqueue(chunk::blob_key(m_queue_id, chunk_id, i));
 		}
 
-		// Set chunk_id_ack to the lowest active chunk
-		//NOTE: its important to have m_chunks and m_wait_ack both sorted
-		m_state.chunk_id_ack = m_state.chunk_id_push;
-		if (!m_chunks.empty()) {
-			m_state.chunk_id_ack = std::min(m_state.chunk_id_ack, m_chunks.begin()->first);
+		const std::vector<std::string> &adopted = stored->second.adopted;
+		for (auto key = adopted.begin(); key != adopted.end(); ++key) {
+			m_reclaimer->enqueue(*key);
 		}
-		if (!m_wait_ack.empty()) {
-			m_state.chunk_id_ack = std::min(m_state.chunk_id_ack, m_wait_ack.begin()->first);	
+		if (!adopted.empty()) {
+			m_reclaimer->enqueue(chunk::adopted_key(m_queue_id, chunk_id));
 		}
-
-		write_state();
 	}
-
-	++m_statistics.ack_count;
 }
 
-ioremap::elliptics::data_pointer queue::pop()
+bool queue::retaining() const
 {
-	entry_id id;
-	ioremap::elliptics::data_pointer d = peek(&id);
-	if (!d.empty()) {
-		ack(id);
+	if (m_retention_time <= 0) {
+		return false;
+	}
+
+	for (size_t priority = 0; priority < m_data_low.size(); ++priority) {
+		auto it = m_stored_chunks.lower_bound(priority * LANE_CHUNK_SPAN);
+		if (it != m_stored_chunks.end() && it->first < m_data_low[priority]) {
+			return true;
+		}
 	}
-	return d;
+
+	return false;
 }
 
-data_array queue::pop(int num)
+bool queue::truncating() const
 {
-	data_array d = peek(num);
-	if (!d.empty()) {
-		ack(d.ids());
+	if (m_max_age <= 0 && !m_max_bytes) {
+		return false;
+	}
+
+	// push chunk is never dropped
+	for (size_t priority = 0; priority < m_lane_count; ++priority) {
+		auto it = m_stored_chunks.lower_bound(priority * LANE_CHUNK_SPAN);
+		if (it != m_stored_chunks.end() && it->first < m_groups[0]->lanes[priority]->state.chunk_id_push) {
+			return true;
+		}
 	}
-	return d;
+
+	return false;
 }
 
-data_array queue::peek(int num)
+void queue::truncate_chunks()
 {
-	check_timeouts();
+	double now = unix_time();
+
+	// Chunk was taking entries until the next one was created,
+	// all of them are older than max-age when the next one is
+	for (size_t priority = 0; m_max_age > 0 && priority < m_lane_count; ++priority) {
+		int push_id = m_groups[0]->lanes[priority]->state.chunk_id_push;
+
+		while (true) {
+			auto it = m_stored_chunks.lower_bound(priority * LANE_CHUNK_SPAN);
+			if (it == m_stored_chunks.end() || it->first >= push_id) {
+				break;
+			}
+
+			auto next = std::next(it);
+			if (next == m_stored_chunks.end() || next->second.time + m_max_age > now) {
+				break;
+			}
+
+			LOG_INFO("chunk %d is older than %f seconds, dropping it", it->first, m_max_age);
+			drop_chunk(priority, it->first);
+		}
+	}
 
-	data_array ret;
+	if (!m_max_bytes) {
+		return;
+	}
 
-	while (num > 0) {
-		auto found = m_chunks.begin();
-		if (found == m_chunks.end()) {
-			break;
+	uint64_t size = 0;
+	for (auto it = m_stored_chunks.begin(); it != m_stored_chunks.end(); ++it) {
+		size += it->second.size;
+	}
+
+	// the oldest of the lowest chunks of all classes goes first
+	while (size > m_max_bytes) {
+		auto oldest = m_stored_chunks.end();
+		size_t oldest_priority = 0;
+		for (size_t priority = 0; priority < m_lane_count; ++priority) {
+			auto it = m_stored_chunks.lower_bound(priority * LANE_CHUNK_SPAN);
+			if (it == m_stored_chunks.end() || it->first >= m_groups[0]->lanes[priority]->state.chunk_id_push) {
+				continue;
+			}
+			if (oldest == m_stored_chunks.end() || it->second.time < oldest->second.time) {
+				oldest = it;
+				oldest_priority = priority;
+			}
 		}
 
-		int chunk_id = found->first;
-		auto chunk = found->second;
+		if (oldest == m_stored_chunks.end()) {
+			break;
+		}
 
-		data_array d = chunk->pop(num);
-		LOG_INFO("chunk %d, popping %d entries", chunk_id, d.sizes().size());
-		if (!d.empty()) {
-			m_statistics.pop_count += d.sizes().size();
+		LOG_INFO("stored data is over %llu bytes, dropping chunk %d",
+				(unsigned long long)m_max_bytes, oldest->first);
 
-			ret.extend(d);
+		size -= std::min(size, oldest->second.size);
+		drop_chunk(oldest_priority, oldest->first);
+	}
+}
 
-			// set or reset timeout timer for the chunk
-			update_chunk_timeout(chunk_id, chunk);
+void queue::drop_chunk(size_t priority, int chunk_id)
+{
+	uint64_t size = m_stored_chunks[chunk_id].size;
+	remove_retained(chunk_id);
+	m_stored_chunks.erase(chunk_id);
+	write_time_index();
+
+	// retained chunk has no group to move past it
+	for (auto it = m_groups.begin(); it != m_groups.end(); ++it) {
+		consumer_group &g = **it;
+		lane &l = *g.lanes[priority];
+
+		chunk *chunk = l.chunks.find(chunk_id);
+		if (chunk) {
+			const chunk_meta &meta = chunk->meta();
+			m_statistics.expire_entries += meta.high_mark() - meta.acked();
+			if (!size) {
+				size = meta.byte_offset(meta.high_mark());
+			}
+
+			forget_entries(g, chunk_id);
+			count_chunk(l, chunk, -1);
+			if (l.last_relaxed_chunk == chunk_id) {
+				l.last_relaxed_chunk = -1;
+			}
+
+			// chunk object is destroyed here
+			l.chunks.clear(chunk_id, chunk_window::POPPABLE);
+			l.chunks.clear(chunk_id, chunk_window::WAITING_ACK);
+		}
 
+		if (l.state.chunk_id_ack <= chunk_id) {
+			update_chunk_id_ack(l);
 		}
+	}
 
-		if (chunk_id == m_state.chunk_id_push) {
-			break;
+	++m_statistics.expire_chunks;
+	m_statistics.expire_bytes += size;
+}
+
+void queue::forget_entries(consumer_group &g, int chunk_id)
+{
+	auto in_chunk = [chunk_id] (const consumer_group::keyed_entry &e) {
+		return e.id.chunk == chunk_id;
+	};
+
+	// entries of the chunk are in a row in maps keyed by entry id
+	entry_id begin, end;
+	begin.chunk = chunk_id;
+	begin.pos = 0;
+	end.chunk = chunk_id + 1;
+	end.pos = 0;
+
+	for (auto it = g.waiting.lower_bound(begin); it != g.waiting.end() && it->first < end; ) {
+		auto backlog = g.key_backlog.find(it->second);
+		if (backlog != g.key_backlog.end()) {
+			auto &entries = backlog->second;
+			entries.erase(std::remove_if(entries.begin(), entries.end(), in_chunk), entries.end());
+			if (entries.empty()) {
+				g.key_backlog.erase(backlog);
+			}
 		}
+		g.waiting.erase(it++);
+	}
+	g.released.erase(g.released.lower_bound(begin), g.released.lower_bound(end));
 
-		if (chunk->expect_no_more()) {
-			//FIXME: this could happen to be called many times for the same chunk
-			// (between queue restarts or because of chunk replaying)
-			chunk->add(&m_statistics.chunks_popped);
+	// keys owned by entries of the chunk pass on to the next entries
+	std::vector<entry_id> owners;
+	for (auto it = g.owned_keys.lower_bound(begin); it != g.owned_keys.end() && it->first < end; ++it) {
+		owners.push_back(it->first);
+	}
+	for (auto id = owners.begin(); id != owners.end(); ++id) {
+		release_key(g, *id);
+	}
 
-			LOG_INFO("chunk %d exhausted, dropped from the popping line", chunk_id);
+	forget_remap(g, chunk_id);
+	g.compact_writes.erase(chunk_id);
+}
 
-			// drop chunk from the pop list
-			m_chunks.erase(found);
-		}
+void queue::forget_remap(consumer_group &g, int chunk_id)
+{
+	// entries relocated from the chunk, their chunks keep the stale
+	// back reference till they go, remapping is looked up by the compacted chunk only
+	g.remap.erase(chunk_id);
 
-		num -= d.sizes().size();
+	// entries relocated to the chunk, only compacted chunks listed for it are looked through
+	auto sources = g.remapped_to.find(chunk_id);
+	if (sources == g.remapped_to.end()) {
+		return;
 	}
 
-	return ret;
+	for (auto source = sources->second.begin(); source != sources->second.end(); ++source) {
+		auto entries = g.remap.find(*source);
+		if (entries == g.remap.end()) {
+			continue;
+		}
+
+		for (auto it = entries->second.begin(); it != entries->second.end(); ) {
+			if (it->second.chunk == chunk_id) {
+				entries->second.erase(it++);
+			} else {
+				++it;
+			}
+		}
+		if (entries->second.empty()) {
+			g.remap.erase(entries);
+		}
+	}
+	g.remapped_to.erase(sources);
 }
 
-void queue::ack(const std::vector<entry_id> &ids)
+bool queue::remapped(const consumer_group &g, const entry_id id, entry_id *new_id) const
 {
-	for (auto i = ids.begin(); i != ids.end(); ++i) {
-		const entry_id &id = *i;
-		ack(id);
+	auto entries = g.remap.find(id.chunk);
+	if (entries == g.remap.end()) {
+		return false;
+	}
+
+	auto relocated = entries->second.find(id.pos);
+	if (relocated == entries->second.end()) {
+		return false;
 	}
+
+	*new_id = relocated->second;
+	return true;
 }
 
-void queue::reply(const ioremap::elliptics::exec_context &context,
-		const ioremap::elliptics::data_pointer &d, ioremap::elliptics::exec_context::final_state state)
+bool queue::take_remapped(consumer_group &g, const entry_id id, entry_id *new_id)
 {
-	m_client.create_session().reply(context, d, state);
+	if (!remapped(g, id, new_id)) {
+		return false;
+	}
+
+	auto entries = g.remap.find(id.chunk);
+	entries->second.erase(id.pos);
+	if (entries->second.empty()) {
+		g.remap.erase(entries);
+	}
+	return true;
 }
 
-void queue::final(const ioremap::elliptics::exec_context &context, const ioremap::elliptics::data_pointer &d)
+ioremap::elliptics::async_write_result queue::write_time_index()
 {
-	reply(context, d, ioremap::elliptics::exec_context::final);
+	std::vector<chunk_time_disk> times;
+	times.reserve(m_stored_chunks.size());
+	for (auto it = m_stored_chunks.begin(); it != m_stored_chunks.end(); ++it) {
+		chunk_time_disk t;
+		t.chunk_id = it->first;
+		t.blobs = it->second.blobs;
+		t.time = it->second.time;
+		t.size = it->second.size;
+		t.packed_size = it->second.packed_size;
+		t.adopted = it->second.adopted.size();
+		times.push_back(t);
+	}
+
+	return m_client.create_session().write_data(m_queue_id + ".time-index",
+			ioremap::elliptics::data_pointer::copy(times.data(), times.size() * sizeof(chunk_time_disk)),
+			0);
 }
 
-const std::string &queue::queue_id() const
+uint64_t queue::packed_size(int chunk_id) const
 {
-	return m_queue_id;
+	auto stored = m_stored_chunks.find(chunk_id);
+	return stored != m_stored_chunks.end() ? stored->second.packed_size : 0;
 }
 
-const queue_state &queue::state()
+void queue::seek(const entry_id id, const std::string &group_name)
 {
-	return m_state;
+	std::vector<peek_request> completed;
+
+	{
+		// chunks of the group are replaced, pushes must not be in the middle of committing to them
+		std::lock_guard<std::mutex> push_guard(m_push_mutex);
+		std::lock_guard<std::mutex> guard(m_mutex);
+
+		consumer_group &g = group(group_name);
+		lane *l = lane_of(g, id.chunk);
+		if (!l || id.pos < 0) {
+			ioremap::elliptics::throw_error(-EINVAL, "invalid entry to seek to: %d-%d", id.chunk, id.pos);
+		}
+
+		seek_lane(g, *l, id, &completed);
+	}
+
+	complete_peeks(completed);
 }
 
-const queue_statistics &queue::statistics()
+void queue::seek(double time, const std::string &group_name)
 {
-	return m_statistics;
+	std::vector<peek_request> completed;
+
+	{
+		std::lock_guard<std::mutex> push_guard(m_push_mutex);
+		std::lock_guard<std::mutex> guard(m_mutex);
+
+		consumer_group &g = group(group_name);
+		for (auto it = g.lanes.begin(); it != g.lanes.end(); ++it) {
+			lane &l = **it;
+
+			// The last chunk created no later than @time could still take entries after it,
+			// all stored chunks are newer when there is no such one
+			auto end = m_stored_chunks.lower_bound(l.end());
+			auto chunk = m_stored_chunks.lower_bound(l.base());
+			for (auto i = chunk; i != end && i->second.time <= time; ++i) {
+				chunk = i;
+			}
+
+			entry_id id = {chunk != end ? chunk->first : l.state.chunk_id_push, 0};
+			seek_lane(g, l, id, &completed);
+		}
+	}
+
+	complete_peeks(completed);
 }
 
-void queue::clear_counters()
+void queue::seek_lane(consumer_group &g, lane &l, const entry_id id, std::vector<peek_request> *completed)
 {
-	memset(&m_statistics, 0, sizeof(m_statistics));
+	int push_id = l.state.chunk_id_push;
+	if (id.chunk > push_id || !m_stored_chunks.count(id.chunk)) {
+		ioremap::elliptics::throw_error(-ERANGE, "entry %d-%d is not stored", id.chunk, id.pos);
+	}
+
+	LOG_INFO("group '%s', class %d, seeking to %d-%d", g.name.c_str(), l.priority, id.chunk, id.pos);
+
+	ioremap::elliptics::session tmp = m_client.create_session();
+
+	// Entries of a chunk are the same for all groups, they are taken from
+	// whichever group has the chunk in memory or, failing that, in storage
+	std::map<int, std::unique_ptr<chunk>> chunks;
+	std::vector<int> missing;
+	for (int chunk_id = id.chunk; chunk_id <= push_id; ++chunk_id) {
+		std::unique_ptr<chunk> p(new chunk(tmp, m_queue_id, chunk_id, m_chunk_max, m_hot_tail_size, g.id));
+
+		chunk *source = NULL;
+		for (auto h = m_groups.begin(); h != m_groups.end() && !source; ++h) {
+			source = (*h)->lanes[l.priority]->chunks.find(chunk_id);
+		}
+
+		if (source) {
+			p->rewind(source->meta(), chunk_id == id.chunk ? id.pos : 0);
+		} else {
+			missing.push_back(chunk_id);
+		}
+		chunks[chunk_id] = std::move(p);
+	}
+
+	for (auto h = m_groups.begin(); h != m_groups.end() && !missing.empty(); ++h) {
+		std::vector<std::unique_ptr<chunk>> stored;
+		std::vector<ioremap::elliptics::async_read_result> metas;
+		for (auto chunk_id = missing.begin(); chunk_id != missing.end(); ++chunk_id) {
+			stored.emplace_back(new chunk(tmp, m_queue_id, *chunk_id, m_chunk_max, 0, (*h)->id));
+			metas.push_back(stored.back()->read_meta());
+		}
+
+		std::vector<int> left;
+		for (size_t i = 0; i < missing.size(); ++i) {
+			stored[i]->load_meta(metas[i]);
+			if (stored[i]->meta().high_mark() == 0) {
+				left.push_back(missing[i]);
+				continue;
+			}
+
+			chunks[missing[i]]->rewind(stored[i]->meta(), missing[i] == id.chunk ? id.pos : 0);
+		}
+		missing.swap(left);
+	}
+
+	if (!missing.empty()) {
+		ioremap::elliptics::throw_error(-ENOENT, "class %d, no meta of chunk %d is left", l.priority, missing[0]);
+	}
+
+	// Entries given away before are forgotten, late acks and touches for them are ignored.
+	// Chunk sought past its end is left out.
+	l.chunks.reset();
+	l.last_relaxed_chunk = -1;
+	l.state.chunk_id_ack = id.chunk;
+
+	for (auto it = chunks.begin(); it != chunks.end(); ++it) {
+		const chunk_meta &meta = it->second->meta();
+		it->second->write_meta();
+
+		if (it->first == l.state.chunk_id_ack && it->first != push_id &&
+				meta.full() && meta.acked() == meta.high_mark()) {
+			++l.state.chunk_id_ack;
+			continue;
+		}
+		l.chunks.insert(it->first, std::move(it->second), chunk_window::POPPABLE);
+	}
+	write_state(l);
+	recount(l);
+
+	// chunks of the class are gone, so is remapping from and to them
+	std::vector<int> remapped_chunks;
+	for (auto i = g.remap.begin(); i != g.remap.end(); ++i) {
+		if (class_of(i->first) == (size_t)l.priority) {
+			remapped_chunks.push_back(i->first);
+		}
+	}
+	for (auto i = g.remapped_to.begin(); i != g.remapped_to.end(); ++i) {
+		if (class_of(i->first) == (size_t)l.priority) {
+			remapped_chunks.push_back(i->first);
+		}
+	}
+	for (auto i = remapped_chunks.begin(); i != remapped_chunks.end(); ++i) {
+		forget_remap(g, *i);
+	}
+
+	// Key ownership is dropped for all classes, entries of the other classes
+	// waiting for their keys are given away on replay
+	g.key_owners.clear();
+	g.owned_keys.clear();
+	g.key_backlog.clear();
+	g.waiting.clear();
+	g.released.clear();
+	g.compact_reads.clear();
+	g.compact_failed.clear();
+	g.compact_writes.clear();
+
+	++m_epoch;
+
+	reclaim_data(l.priority);
+
+	// Timeouts are not checked here: compaction pushes entries and takes the push lock,
+	// which seek() already holds. Sought lane has no chunks waiting for acks anyway.
+	process_peeks(g, completed);
+}
+
+void queue::clear()
+{
+	std::lock_guard<std::mutex> pack_guard(m_pack_mutex);
+	std::lock_guard<std::mutex> promote_guard(m_promote_mutex);
+	std::lock_guard<std::mutex> delay_guard(m_delay_mutex);
+	std::lock_guard<std::mutex> push_guard(m_push_mutex);
+	std::lock_guard<std::mutex> guard(m_mutex);
+
+	LOG_INFO("clearing queue");
+
+	// Chunks are removed by the reclaimer, but clear() returns only after they are gone:
+	// chunk ids start over, so late removes would hit chunks pushed after clear()
+	std::vector<int> data_high(m_data_low);
+
+	for (auto g = m_groups.begin(); g != m_groups.end(); ++g) {
+		for (auto it = (*g)->lanes.begin(); it != (*g)->lanes.end(); ++it) {
+			lane &l = **it;
+
+			LOG_INFO("group '%s', class %d, erasing state", (*g)->name.c_str(), l.priority);
+			queue_state state = l.state;
+			l.state.chunk_id_push = l.state.chunk_id_ack = l.base();
+			write_state(l);
+
+			LOG_INFO("group '%s', class %d, removing chunks, from %d to %d",
+					(*g)->name.c_str(), l.priority, state.chunk_id_ack, state.chunk_id_push);
+
+			for (int i = l.chunks.low(); i < l.chunks.high(); ++i) {
+				chunk *chunk = l.chunks.find(i);
+				if (chunk) {
+					chunk->remove_meta(*m_reclaimer);
+				}
+			}
+			data_high[l.priority] = std::max(data_high[l.priority], state.chunk_id_push + 1);
+
+			l.chunks.reset();
+			l.last_relaxed_chunk = -1;
+			l.quota = 0;
+			recount(l);
+		}
+
+		(*g)->remap.clear();
+		(*g)->remapped_to.clear();
+		(*g)->key_owners.clear();
+		(*g)->owned_keys.clear();
+		(*g)->key_backlog.clear();
+		(*g)->waiting.clear();
+		(*g)->released.clear();
+		(*g)->compact_reads.clear();
+		(*g)->compact_failed.clear();
+		(*g)->compact_writes.clear();
+	}
+
+	for (auto it = m_stored_chunks.begin(); it != m_stored_chunks.end(); ++it) {
+		size_t priority = class_of(it->first);
+		if (it->first < m_data_low[priority]) {
+			remove_retained(it->first);
+		}
+	}
+
+	for (size_t priority = 0; priority < m_data_low.size(); ++priority) {
+		for (int i = m_data_low[priority]; i < data_high[priority]; ++i) {
+			remove_data(i);
+		}
+		m_data_low[priority] = priority * LANE_CHUNK_SPAN;
+	}
+	m_stored_chunks.clear();
+	write_time_index();
+	m_sealed.clear();
+
+	++m_epoch;
+
+	LOG_INFO("removing %ld delay buckets", m_delayed.size());
+	ioremap::elliptics::session tmp = m_client.create_session();
+	for (auto it = m_delayed.begin(); it != m_delayed.end(); ++it) {
+		for (int i = 0; i < it->second.chunks; ++i) {
+			chunk c(tmp, delay_bucket_id(it->first), i, m_chunk_max);
+
+			// blobs of promoted entries belong to queue chunks, they are removed above
+			try {
+				c.load_meta();
+				for (int32_t pos = 0; pos < c.meta().high_mark(); ++pos) {
+					if ((c.meta()[pos].state & ENTRY_BLOB) && !(c.meta()[pos].state & ENTRY_ACKED)) {
+						m_reclaimer->enqueue(chunk::blob_key(delay_bucket_id(it->first), i, pos));
+					}
+				}
+			} catch (const ioremap::elliptics::not_found_error &) {
+			}
+
+			c.remove(*m_reclaimer);
+		}
+	}
+	m_delayed.clear();
+	m_delay_due = 0;
+	write_delay_state();
+
+	update_backlog();
+
+	// removes scheduled before clear() are waited for as well, their keys are reused just the same
+	LOG_INFO("waiting for removes: %lld keys are pending", (long long)m_reclaimer->stat().pending);
+	m_reclaimer->drain();
+
+	LOG_INFO("dropping statistics");
+	memset(&m_statistics, 0, sizeof(m_statistics));
+
+	LOG_INFO("queue cleared");
+}
+
+bool producer_sequence::mark(uint64_t sequence)
+{
+	if (sequence > high) {
+		uint64_t shift = sequence - high;
+		window = shift < WINDOW ? (window << shift) | 1 : 1;
+		high = sequence;
+		return true;
+	}
+
+	uint64_t age = high - sequence;
+	if (age >= WINDOW || (window & (1ULL << age))) {
+		return false;
+	}
+
+	window |= 1ULL << age;
+	return true;
+}
+
+bool producer_sequence::stale(uint64_t sequence) const
+{
+	return sequence <= high && high - sequence >= WINDOW;
+}
+
+void producer_sequence::unmark(uint64_t sequence)
+{
+	if (sequence <= high && high - sequence < WINDOW) {
+		window &= ~(1ULL << (high - sequence));
+	}
+}
+
+bool queue::push(const ioremap::elliptics::data_pointer &d, const std::string &key, int priority, double not_before,
+		const std::string &producer, uint64_t sequence)
+{
+	if (!sequence) {
+		submit(d, key, priority, not_before);
+		return true;
+	}
+
+	// sequence number is taken right away, so that concurrent retries would not both get through
+	{
+		std::lock_guard<std::mutex> guard(m_producer_mutex);
+		producer_sequence &taken = this->sequence(m_sequences, producer);
+		// it could be a retry of a push long done as well as a new entry,
+		// neither dropping nor pushing it is safe
+		if (taken.stale(sequence)) {
+			ioremap::elliptics::throw_error(-ESTALE, "stale sequence %llu of producer '%s': "
+					"it's older than the last %llu numbers after %llu",
+					(unsigned long long)sequence, producer.c_str(),
+					(unsigned long long)producer_sequence::WINDOW, (unsigned long long)taken.high);
+		}
+		if (!taken.mark(sequence)) {
+			LOG_INFO("producer '%s', entry %llu is pushed already, dropping it",
+					producer.c_str(), (unsigned long long)sequence);
+			++bucket(producer).duplicate_count;
+			return false;
+		}
+	}
+
+	try {
+		submit(d, key, priority, not_before);
+	} catch (...) {
+		// failed push is to be retried
+		std::lock_guard<std::mutex> guard(m_producer_mutex);
+		auto it = m_sequences.find(producer);
+		if (it != m_sequences.end()) {
+			it->second.unmark(sequence);
+		}
+		throw;
+	}
+
+	// Sequence number is stored once its entry is submitted, append of the entry
+	// could still be on its way to storage: queue going down before the sequences
+	// are written lets the retry through, append failing after they are written
+	// makes the retry dropped
+	{
+		std::lock_guard<std::mutex> guard(m_producer_mutex);
+		this->sequence(m_done_sequences, producer).mark(sequence);
+	}
+
+	std::lock_guard<std::mutex> guard(m_mutex);
+	if (!m_sequences_due) {
+		m_sequences_due = unix_time();
+		start_timer();
+		m_timer_cond.notify_one();
+	}
+
+	return true;
+}
+
+void queue::submit(const ioremap::elliptics::data_pointer &d, const std::string &key, int priority, double not_before)
+{
+	std::vector<peek_request> completed;
+
+	// classes are set at initialization and never change
+	if (priority < 0 || (size_t)priority >= m_lane_count) {
+		ioremap::elliptics::throw_error(-EINVAL, "invalid priority class %d, queue has %ld classes",
+				priority, m_lane_count);
+	}
+
+	if (not_before > unix_time()) {
+		if (key.size() > UINT16_MAX) {
+			ioremap::elliptics::throw_error(-EINVAL, "ordering key is too long: %ld bytes", key.size());
+		}
+
+		push_request req;
+		req.data = d.to_string();
+		req.key = key;
+		req.priority = priority;
+		req.not_before = not_before;
+
+		std::lock_guard<std::mutex> guard(m_delay_mutex);
+		delay_entry(req);
+		return;
+	}
+
+	pending_entry entry = make_pending(d, key, priority);
+
+	{
+		uint64_t ticket;
+		while (!m_push_ring.enqueue(entry, &ticket)) {
+			// ring is full, help to drain it
+			std::unique_lock<std::mutex> guard(m_push_mutex);
+			if (!drain_pushes(&completed)) {
+				m_push_cond.wait(guard);
+			}
+		}
+
+		std::exception_ptr error;
+		{
+			// Entry could have been sent already by the previous holder of the push lock,
+			// otherwise it's sent here along with everything submitted so far
+			std::unique_lock<std::mutex> guard(m_push_mutex);
+
+			// our entry is in the ring, submitters waiting for it to be written can go on
+			m_push_cond.notify_all();
+
+			while (m_push_done <= ticket) {
+				// Entries submitted before ours could still be being written into the ring,
+				// their submitters wake us up once they get the push lock
+				if (!drain_pushes(&completed)) {
+					m_push_cond.wait(guard);
+				}
+			}
+
+			auto failed = m_push_failed.find(ticket);
+			if (failed != m_push_failed.end()) {
+				error = failed->second;
+				m_push_failed.erase(failed);
+			}
+		}
+
+		if (error) {
+			// entries of the others could have got through
+			complete_peeks(completed);
+			std::rethrow_exception(error);
+		}
+	}
+
+	// waiting peeks which got pushed entries
+	complete_peeks(completed);
+}
+
+double queue::throttle()
+{
+	if (m_high_writes > 0) {
+		int writes = m_push_writes;
+		if (writes >= m_high_writes) {
+			m_writes_throttled = true;
+		} else if (writes <= m_low_writes) {
+			m_writes_throttled = false;
+		}
+	}
+
+	if (!m_backlog_throttled && !m_writes_throttled) {
+		return 0;
+	}
+
+	std::lock_guard<std::mutex> guard(m_mutex);
+	++m_statistics.throttle_count;
+
+	return m_throttle_retry;
+}
+
+producer_bucket &queue::bucket(const std::string &producer)
+{
+	auto it = m_producers.find(producer);
+	if (it == m_producers.end()) {
+		forget_producers(m_producers, m_max_producers - 1);
+
+		auto limit = m_producer_limits.find(producer);
+		if (limit == m_producer_limits.end()) {
+			limit = m_producer_limits.find("*");
+		}
+
+		producer_bucket b;
+		memset(&b, 0, sizeof(b));
+		if (limit != m_producer_limits.end()) {
+			b = limit->second;
+		}
+		b.last_refill = unix_time();
+
+		it = m_producers.insert(std::make_pair(producer, b)).first;
+	}
+	it->second.last_push = unix_time();
+
+	return it->second;
+}
+
+producer_sequence &queue::sequence(std::map<std::string, producer_sequence> &table, const std::string &producer)
+{
+	auto it = table.find(producer);
+	if (it == table.end()) {
+		forget_producers(table, m_max_producers - 1);
+		it = table.insert(std::make_pair(producer, producer_sequence())).first;
+	}
+	it->second.last_push = unix_time();
+
+	return it->second;
+}
+
+double queue::admit(const std::string &producer)
+{
+	std::lock_guard<std::mutex> guard(m_producer_mutex);
+
+	producer_bucket &b = bucket(producer);
+	if (b.rate > 0) {
+		double now = unix_time();
+		b.tokens = std::min(b.burst, b.tokens + (now - b.last_refill) * b.rate);
+		b.last_refill = now;
+
+		if (b.tokens < 1) {
+			++b.limit_count;
+			return (1 - b.tokens) / b.rate;
+		}
+		b.tokens -= 1;
+	}
+
+	++b.push_count;
+	return 0;
+}
+
+size_t queue::max_producers() const
+{
+	return m_max_producers;
+}
+
+int queue::dispatch_threads() const
+{
+	return m_dispatch_threads;
+}
+
+std::vector<producer_statistics> queue::producers()
+{
+	std::lock_guard<std::mutex> guard(m_producer_mutex);
+
+	std::vector<producer_statistics> producers;
+	for (auto it = m_producers.begin(); it != m_producers.end(); ++it) {
+		producer_statistics st;
+		st.name = it->first;
+		st.push_count = it->second.push_count;
+		st.limit_count = it->second.limit_count;
+		st.duplicate_count = it->second.duplicate_count;
+		producers.push_back(st);
+	}
+
+	return producers;
+}
+
+void queue::update_backlog()
+{
+	if (!m_high_entries && !m_high_bytes) {
+		return;
+	}
+
+	// filled chunks the slowest group is not done with
+	uint64_t entries = 0;
+	uint64_t bytes = 0;
+	for (size_t priority = 0; priority < m_lane_count; ++priority) {
+		int push_id = m_groups[0]->lanes[priority]->state.chunk_id_push;
+
+		auto end = m_stored_chunks.lower_bound(push_id);
+		for (auto it = m_stored_chunks.lower_bound(m_data_low[priority]); it != end; ++it) {
+			entries += m_chunk_max;
+			bytes += it->second.size;
+		}
+	}
+
+	bool over = (m_high_entries && entries >= m_high_entries) || (m_high_bytes && bytes >= m_high_bytes);
+	bool under = (!m_high_entries || entries <= m_low_entries) && (!m_high_bytes || bytes <= m_low_bytes);
+
+	if (over && !m_backlog_throttled) {
+		LOG_INFO("backlog is over its high watermark: %llu entries, %llu bytes, throttling pushes",
+				(unsigned long long)entries, (unsigned long long)bytes);
+		m_backlog_throttled = true;
+	} else if (under && m_backlog_throttled) {
+		LOG_INFO("backlog is down to its low watermark: %llu entries, %llu bytes, pushes are welcome",
+				(unsigned long long)entries, (unsigned long long)bytes);
+		m_backlog_throttled = false;
+	}
+}
+
+bool queue::drain_pushes(std::vector<peek_request> *completed)
+{
+	// tickets of the batch go in a row
+	uint64_t first = m_push_ring.head();
+
+	std::vector<pending_entry> batch;
+	pending_entry entry;
+	while (m_push_ring.dequeue(&entry)) {
+		batch.push_back(entry);
+	}
+
+	if (batch.empty()) {
+		return false;
+	}
+
+	// every ticket of the batch is done whatever happens, failed ones take their error
+	std::vector<std::exception_ptr> failed(batch.size());
+	send_batch(batch, &failed, completed);
+
+	for (size_t i = 0; i < failed.size(); ++i) {
+		if (failed[i]) {
+			m_push_failed[first + i] = failed[i];
+		}
+	}
+
+	m_push_done = m_push_ring.head();
+	// submitters of the batch and the ones waiting for room in the ring
+	m_push_cond.notify_all();
+	return true;
+}
+
+void queue::send_batch(const std::vector<pending_entry> &batch, std::vector<std::exception_ptr> *failed,
+		std::vector<peek_request> *completed)
+{
+	// every class gets its entries in order of submission, higher classes first
+	for (size_t priority = m_lane_count; priority-- > 0; ) {
+		std::vector<pending_entry> entries;
+		std::vector<size_t> index;
+		for (size_t i = 0; i < batch.size(); ++i) {
+			if (batch[i].priority == (int)priority) {
+				entries.push_back(batch[i]);
+				index.push_back(i);
+			}
+		}
+
+		if (entries.empty()) {
+			continue;
+		}
+
+		size_t sent = 0;
+		try {
+			send_entries(priority, entries, &sent, completed);
+		} catch (const std::exception &e) {
+			LOG_ERROR("class %ld, %ld of %ld entries failed to be sent: %s",
+					priority, entries.size() - sent, entries.size(), e.what());
+
+			std::exception_ptr error = std::current_exception();
+			for (size_t i = sent; i < index.size(); ++i) {
+				(*failed)[index[i]] = error;
+			}
+		}
+	}
+}
+
+void queue::send_entries(int priority, const std::vector<pending_entry> &batch, size_t *sent,
+		std::vector<peek_request> *completed)
+{
+	for (size_t offset = 0; offset < batch.size(); ) {
+		// every group has its own push chunk of the same id
+		std::vector<chunk *> chunks;
+		size_t num = batch.size() - offset;
+		int blob = 0, blobs = 0;
+		{
+			std::lock_guard<std::mutex> guard(m_mutex);
+			for (auto g = m_groups.begin(); g != m_groups.end(); ++g) {
+				chunk *chunk = push_chunk(**g, *(*g)->lanes[priority]);
+				num = std::min(num, (size_t)chunk->meta().space());
+				chunks.push_back(chunk);
+			}
+
+			// blobs are counted before they are written, so that
+			// none is left behind when the chunk data is removed
+			blobs = std::count_if(batch.begin() + offset, batch.begin() + offset + num,
+					[this] (const pending_entry &entry) { return oversized(entry); });
+			if (blobs) {
+				stored_chunk &stored = m_stored_chunks[chunks[0]->id()];
+				blob = stored.blobs;
+				stored.blobs += blobs;
+				write_time_index();
+			}
+		}
+
+		// Push chunk is neither dropped nor filled by anyone else while push lock is held,
+		// so entries are sent to storage outside of the queue lock.
+		// Chunk data is shared by the groups, it's sent once.
+		std::vector<pending_entry> entries(batch.begin() + offset, batch.begin() + offset + num);
+		adopt_blobs(chunks[0]->id(), entries);
+		uint64_t blob_bytes = store_blobs(chunks[0]->id(), blob, &entries);
+		for (auto i = entries.begin(); i != entries.end(); ++i) {
+			track_write(chunks[0]->append(i->data));
+		}
+
+		{
+			std::lock_guard<std::mutex> guard(m_mutex);
+			for (size_t n = 0; n < m_groups.size(); ++n) {
+				commit_entries(*m_groups[n]->lanes[priority], chunks[n], entries, 0);
+			}
+			m_statistics.push_count += num;
+			*sent += num;
+			m_statistics.blob_count += blobs;
+			m_statistics.blob_bytes += blob_bytes;
+
+			// waiting peeks and subscribers are served with new entries right away
+			for (auto g = m_groups.begin(); g != m_groups.end(); ++g) {
+				if (hungry(**g)) {
+					process_peeks(**g, completed);
+				}
+			}
+		}
+
+		offset += num;
+	}
+}
+
+bool queue::oversized(const pending_entry &entry) const
+{
+	return m_blob_threshold && entry.data.size() > m_blob_threshold;
+}
+
+uint64_t queue::store_blobs(int chunk_id, int blob, std::vector<pending_entry> *entries)
+{
+	ioremap::elliptics::session tmp = m_client.create_session();
+	std::vector<ioremap::elliptics::async_write_result> writes;
+	uint64_t bytes = 0;
+
+	for (auto i = entries->begin(); i != entries->end(); ++i) {
+		if (!oversized(*i)) {
+			continue;
+		}
+
+		std::string key;
+		ioremap::elliptics::data_pointer payload = i->data;
+		if (i->state & ENTRY_KEYED) {
+			payload = i->data.skip(unframe_keyed(i->data.data<char>(), i->data.size(), &key));
+		}
+
+		blob_ref ref;
+		ref.key = chunk::blob_key(m_queue_id, chunk_id, blob++);
+		ref.size = payload.size();
+		writes.push_back(tmp.write_data(ref.key, payload, 0));
+		track_write(writes.back());
+		bytes += ref.size;
+
+		ioremap::elliptics::data_pointer d = serialize(ref);
+		i->data = (i->state & ENTRY_KEYED) ? frame_keyed(key, d) : d;
+		i->state |= ENTRY_BLOB;
+	}
+
+	// chunk never refers to a blob which is not there
+	for (auto w = writes.begin(); w != writes.end(); ++w) {
+		w->wait();
+	}
+
+	return bytes;
+}
+
+void queue::adopt_blobs(int chunk_id, const std::vector<pending_entry> &entries)
+{
+	std::vector<std::string> keys;
+	for (auto i = entries.begin(); i != entries.end(); ++i) {
+		if (!(i->state & ENTRY_BLOB)) {
+			continue;
+		}
+
+		std::string key;
+		ioremap::elliptics::data_pointer d = i->data;
+		if (i->state & ENTRY_KEYED) {
+			d = i->data.skip(unframe_keyed(i->data.data<char>(), i->data.size(), &key));
+		}
+		keys.push_back(deserialize<blob_ref>(d).key);
+	}
+
+	if (keys.empty()) {
+		return;
+	}
+
+	ioremap::elliptics::data_pointer list;
+	{
+		std::lock_guard<std::mutex> guard(m_mutex);
+		std::vector<std::string> &adopted = m_stored_chunks[chunk_id].adopted;
+		adopted.insert(adopted.end(), keys.begin(), keys.end());
+		list = serialize(adopted);
+		write_time_index();
+	}
+
+	// Keys are in storage before the chunk refers to the blobs, push lock keeps
+	// writes of the list in order. Bucket chunk is removed only after its entries
+	// are pushed, so queue going down before this gives them (and blobs) once again
+	m_client.create_session().write_data(chunk::adopted_key(m_queue_id, chunk_id), list, 0).wait();
+}
+
+void queue::track_write(ioremap::elliptics::async_write_result write)
+{
+	++m_push_writes;
+	write.connect(
+		ioremap::elliptics::async_write_result::result_function(),
+		[this] (const ioremap::elliptics::error_info &) {
+			--m_push_writes;
+		}
+	);
+}
+
+chunk *queue::push_chunk(consumer_group &g, lane &l)
+{
+	int chunk_id = l.state.chunk_id_push;
+
+	// further ids belong to the next class
+	if (chunk_id >= l.end()) {
+		ioremap::elliptics::throw_error(-ENOSPC, "class %d has run out of chunk ids: %d", l.priority, chunk_id);
+	}
+
+	chunk *chunk = l.chunks.find(chunk_id);
+	if (!chunk) {
+		// create new empty chunk
+		ioremap::elliptics::session tmp = m_client.create_session();
+		std::unique_ptr<ioremap::grape::chunk> p(new ioremap::grape::chunk(tmp, m_queue_id, chunk_id, m_chunk_max,
+					m_hot_tail_size, g.id));
+		chunk = l.chunks.insert(chunk_id, std::move(p), chunk_window::POPPABLE);
+
+		// every group gets here for the same chunk
+		if (m_stored_chunks.insert(std::make_pair(chunk_id, stored_chunk{unix_time(), 0, 0})).second) {
+			write_time_index();
+		}
+	}
+
+	// chunk is left full if queue went down right before writing its state
+	if (chunk->meta().full()) {
+		LOG_INFO("chunk %d is full already, moving on", chunk_id);
+
+		++l.state.chunk_id_push;
+		write_state(l);
+
+		return push_chunk(g, l);
+	}
+
+	return chunk;
+}
+
+entry_id queue::push_entry(consumer_group &g, lane &l, const ioremap::elliptics::data_pointer &d, int deliveries,
+		std::vector<ioremap::elliptics::async_write_result> *writes)
+{
+	chunk *chunk = push_chunk(g, l);
+
+	entry_id id = {chunk->id(), chunk->meta().high_mark()};
+
+	writes->push_back(chunk->append(d));
+	commit_entries(l, chunk, std::vector<pending_entry>(1, pending_entry(d, 0, l.priority)), deliveries);
+
+	return id;
+}
+
+void queue::commit_entries(lane &l, chunk *chunk, const std::vector<pending_entry> &entries, int deliveries)
+{
+	count_chunk(l, chunk, -1);
+	bool filled = chunk->commit(entries, deliveries);
+	count_chunk(l, chunk, 1);
+
+	if (filled) {
+		LOG_INFO("chunk %d filled", chunk->id());
+
+		// every group fills the same chunk
+		stored_chunk &stored = m_stored_chunks[chunk->id()];
+		if (!stored.size) {
+			stored.size = chunk->meta().byte_offset(chunk->meta().high_mark());
+			write_time_index();
+			update_backlog();
+
+			if (m_pack_block_size) {
+				m_sealed[chunk->id()] = unix_time() + m_pack_delay;
+				start_packer();
+				m_pack_cond.notify_one();
+			}
+
+			// chunks are dropped by the timer, never in the middle of a push
+			if (truncating()) {
+				start_timer();
+				m_timer_cond.notify_one();
+			}
+		}
+
+		++l.state.chunk_id_push;
+		write_state(l);
+
+		chunk->add(&m_statistics.chunks_pushed);
+	}
+}
+
+std::string queue::delay_bucket_id(int64_t bucket) const
+{
+	return m_queue_id + ".delayed." + std::to_string(bucket);
+}
+
+void queue::delay_entry(push_request req)
+{
+	int64_t bucket = (int64_t)std::ceil(req.not_before / m_delay_bucket_width);
+	delay_bucket &b = m_delayed[bucket];
+
+	if (!b.tail) {
+		ioremap::elliptics::session tmp = m_client.create_session();
+		b.tail = std::make_shared<chunk>(tmp, delay_bucket_id(bucket), b.chunks, m_chunk_max);
+		++b.chunks;
+		write_delay_state();
+	}
+
+	// Blob is named after the position the entry takes in the bucket chunk,
+	// it's given to the queue chunk the entry is promoted into, see adopt_blobs()
+	int state = 0;
+	uint64_t blob_bytes = 0;
+	if (m_blob_threshold && req.data.size() > m_blob_threshold) {
+		blob_ref ref;
+		ref.key = chunk::blob_key(delay_bucket_id(bucket), b.tail->id(), b.tail->meta().high_mark());
+		ref.size = req.data.size();
+		m_client.create_session().write_data(ref.key,
+				ioremap::elliptics::data_pointer::copy(req.data.data(), req.data.size()), 0).wait();
+
+		blob_bytes = ref.size;
+		req.data = serialize(ref).to_string();
+		state = ENTRY_BLOB;
+	}
+
+	// Delayed entries are not kept anywhere but in storage,
+	// so bucket meta is kept up to date on every push
+	if (b.tail->push(serialize(req), 0, state)) {
+		b.tail.reset();
+	} else {
+		b.tail->write_meta();
+	}
+
+	std::lock_guard<std::mutex> guard(m_mutex);
+	++m_statistics.delay_count;
+	if (state) {
+		++m_statistics.blob_count;
+		m_statistics.blob_bytes += blob_bytes;
+	}
+
+	double due = m_delayed.begin()->first * m_delay_bucket_width;
+	if (m_delay_due != due) {
+		m_delay_due = due;
+		start_timer();
+		m_timer_cond.notify_one();
+	}
+}
+
+void queue::write_delay_state()
+{
+	std::vector<delay_bucket_disk> buckets;
+	for (auto it = m_delayed.begin(); it != m_delayed.end(); ++it) {
+		delay_bucket_disk b;
+		b.bucket = it->first;
+		b.chunks = it->second.chunks;
+		b.promoted = it->second.promoted;
+		buckets.push_back(b);
+	}
+
+	m_client.create_session().write_data(m_queue_id + ".delayed.state",
+			ioremap::elliptics::data_pointer::copy(buckets.data(), buckets.size() * sizeof(delay_bucket_disk)),
+			0);
+}
+
+void queue::write_sequences()
+{
+	ioremap::elliptics::data_pointer d;
+	{
+		std::lock_guard<std::mutex> guard(m_producer_mutex);
+		d = serialize(m_done_sequences);
+	}
+
+	try {
+		m_client.create_session().write_data(m_queue_id + ".sequences", d, 0).wait();
+	} catch (const std::exception &e) {
+		LOG_ERROR("sequence numbers write failed, retrying: %s", e.what());
+
+		std::lock_guard<std::mutex> guard(m_mutex);
+		m_sequences_due = unix_time() + 1;
+	}
+}
+
+bool queue::read_delay_chunk(chunk &c, std::vector<pending_entry> *entries, std::vector<int32_t> *positions)
+{
+	ioremap::elliptics::data_pointer d;
+
+	try {
+		c.load_meta();
+		if (c.meta().high_mark() == 0) {
+			return true;
+		}
+
+		ioremap::elliptics::read_result_entry entry = c.read_data().get_one();
+		if (entry.error()) {
+			entry.error().throw_error();
+		}
+		d = entry.file();
+	} catch (const ioremap::elliptics::not_found_error &e) {
+		// chunk was promoted and removed, but the index update did not make it to storage
+		LOG_ERROR("delay chunk %d, data not found, taking it as promoted: %s", c.id(), e.what());
+		return true;
+	} catch (const ioremap::elliptics::error &e) {
+		LOG_ERROR("delay chunk %d, read error: %s", c.id(), e.what());
+		return false;
+	}
+
+	const chunk_meta &meta = c.meta();
+	for (int32_t pos = 0; pos < meta.high_mark(); ++pos) {
+		if (meta[pos].state & ENTRY_ACKED) {
+			continue;
+		}
+
+		// entries which data never made it to storage are lost, just as in any other chunk
+		uint64_t offset = meta.byte_offset(pos);
+		if (offset + meta[pos].size > d.size()) {
+			LOG_ERROR("delay chunk %d, data of %d entries of %d is missing",
+					c.id(), meta.high_mark() - pos, meta.high_mark());
+			break;
+		}
+
+		auto req = deserialize<push_request>(
+				ioremap::elliptics::data_pointer::copy((char *)d.data() + offset, meta[pos].size));
+
+		// number of classes could have been lowered since the entry was put off
+		int priority = std::min(req.priority, (int)m_lane_count - 1);
+		entries->push_back(make_pending(
+				ioremap::elliptics::data_pointer::copy(req.data.data(), req.data.size()), req.key, priority));
+		entries->back().state |= meta[pos].state & ENTRY_BLOB;
+		positions->push_back(pos);
+	}
+
+	return true;
+}
+
+void queue::promote_delayed()
+{
+	std::vector<peek_request> completed;
+
+	std::lock_guard<std::mutex> promote_guard(m_promote_mutex);
+
+	double retry = 0;
+
+	while (true) {
+		int64_t bucket;
+		int index;
+		{
+			std::lock_guard<std::mutex> delay_guard(m_delay_mutex);
+
+			// only due buckets are touched, they are the first ones in the map
+			if (m_delayed.empty() || m_delayed.begin()->first * m_delay_bucket_width > unix_time()) {
+				break;
+			}
+
+			bucket = m_delayed.begin()->first;
+			delay_bucket &b = m_delayed.begin()->second;
+			if (b.promoted >= b.chunks) {
+				LOG_INFO("delay bucket %lld, all %d chunks are promoted", (long long)bucket, b.chunks);
+				m_delayed.erase(m_delayed.begin());
+				write_delay_state();
+				continue;
+			}
+
+			// due bucket takes no more pushes, its tail is not written anymore
+			b.tail.reset();
+			index = b.promoted;
+		}
+
+		ioremap::elliptics::session tmp = m_client.create_session();
+		chunk c(tmp, delay_bucket_id(bucket), index, m_chunk_max);
+
+		// one chunk of the bucket is read at a time and with the delay lock released
+		std::vector<pending_entry> entries;
+		std::vector<int32_t> positions;
+		try {
+			if (!read_delay_chunk(c, &entries, &positions)) {
+				// chunk stays till storage gets back
+				retry = unix_time() + 1;
+				break;
+			}
+		} catch (const std::exception &e) {
+			LOG_ERROR("delay bucket %lld, chunk %d, promotion failed, retrying: %s", (long long)bucket, index, e.what());
+			retry = unix_time() + 1;
+			break;
+		}
+
+		LOG_INFO("delay bucket %lld, chunk %d is due, promoting %ld entries", (long long)bucket, index, entries.size());
+
+		std::vector<std::exception_ptr> failed(entries.size());
+		{
+			std::lock_guard<std::mutex> push_guard(m_push_mutex);
+			send_batch(entries, &failed, &completed);
+		}
+
+		// Entries which got through are acked in the chunk meta, so that only the failed
+		// ones are pushed once the chunk is retried. Queue going down before the meta
+		// (or the bucket index) is written pushes the chunk once again after restart.
+		size_t sent = 0;
+		for (size_t i = 0; i < entries.size(); ++i) {
+			if (!failed[i]) {
+				c.ack(positions[i], false);
+				++sent;
+			}
+		}
+
+		{
+			std::lock_guard<std::mutex> guard(m_mutex);
+			m_statistics.promote_count += sent;
+		}
+
+		if (sent != entries.size()) {
+			LOG_ERROR("delay bucket %lld, chunk %d, %ld of %ld entries failed to be promoted, retrying",
+					(long long)bucket, index, entries.size() - sent, entries.size());
+
+			if (sent) {
+				try {
+					c.write_meta().wait();
+				} catch (const std::exception &e) {
+					LOG_ERROR("delay bucket %lld, chunk %d, promotion progress write failed: %s",
+							(long long)bucket, index, e.what());
+				}
+			}
+
+			retry = unix_time() + 1;
+			break;
+		}
+
+		// Chunk is removed only after its entries are pushed
+		{
+			std::lock_guard<std::mutex> delay_guard(m_delay_mutex);
+			++m_delayed[bucket].promoted;
+			write_delay_state();
+		}
+		c.remove(*m_reclaimer);
+	}
+
+	{
+		std::lock_guard<std::mutex> delay_guard(m_delay_mutex);
+		std::lock_guard<std::mutex> guard(m_mutex);
+		if (retry) {
+			m_delay_due = retry;
+		} else {
+			m_delay_due = m_delayed.empty() ? 0 : m_delayed.begin()->first * m_delay_bucket_width;
+		}
+	}
+
+	complete_peeks(completed);
+}
+
+bool queue::undeliverable(chunk *chunk, int32_t pos)
+{
+	if (m_max_deliveries <= 0) {
+		return false;
+	}
+
+	return chunk->meta()[pos].deliveries > m_max_deliveries;
+}
+
+void queue::dead_letter(const entry_id id, const ioremap::elliptics::data_pointer &d)
+{
+	if (!m_dead_letter) {
+		ioremap::elliptics::session tmp = m_client.create_session();
+
+		try {
+			ioremap::elliptics::data_pointer state = tmp.read_data(m_dead_letter_id + ".state", 0, 0).get_one().file();
+			m_dead_letter_state = *state.data<queue_state>();
+		} catch (const ioremap::elliptics::not_found_error &) {
+			memset(&m_dead_letter_state, 0, sizeof(m_dead_letter_state));
+		}
+
+		m_dead_letter = std::make_shared<chunk>(tmp, m_dead_letter_id, m_dead_letter_state.chunk_id_push, m_chunk_max);
+		m_dead_letter->load_meta();
+	}
+
+	LOG_ERROR("entry %d-%d exceeded %d deliveries, moving it to dead-letter chunk %d",
+			id.chunk, id.pos, m_max_deliveries, m_dead_letter->id());
+
+	// filled chunk writes its meta itself, meta of the one being filled
+	// is written once per served request, see flush_dead_letters()
+	if (m_dead_letter->push(d)) {
+		++m_dead_letter_state.chunk_id_push;
+		m_client.create_session().write_data(m_dead_letter_id + ".state",
+				ioremap::elliptics::data_pointer::from_raw(&m_dead_letter_state, sizeof(queue_state)),
+				0);
+		m_dead_letter.reset();
+	}
+
+	++m_statistics.dead_letter_count;
+	m_statistics.dead_letter_bytes += d.size();
+}
+
+void queue::flush_dead_letters(consumer_group &g, std::vector<entry_id> &dead)
+{
+	if (dead.empty()) {
+		return;
+	}
+
+	if (m_dead_letter) {
+		m_dead_letter->write_meta();
+	}
+
+	// Dead entries are acked only after iteration for ack could finalize and drop the chunk.
+	// Meta of their chunks is written once for all of them, chunk which ack completes
+	// writes its meta right away
+	std::set<int> chunks;
+	for (auto i = dead.begin(); i != dead.end(); ++i) {
+		ack_entry(g, *i, false);
+		chunks.insert(i->chunk);
+	}
+	dead.clear();
+
+	for (auto i = chunks.begin(); i != chunks.end(); ++i) {
+		lane *l = lane_of(g, *i);
+		chunk *chunk = l ? l->chunks.find(*i) : NULL;
+		if (chunk) {
+			chunk->write_meta();
+		}
+	}
+}
+
+void queue::update_chunk_timeout(consumer_group &g, int chunk_id, chunk *chunk)
+{
+	// add chunk to the waiting list and postpone its deadline time
+	lane_of(g, chunk_id)->chunks.set(chunk_id, chunk_window::WAITING_ACK);
+	chunk->reset_time(m_ack_timeout);
+}
+
+void queue::check_timeouts(consumer_group &g)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+
+	// check no more then once in 1 second
+	//TODO: make timeout check interval configurable
+	if ((tv.tv_sec - g.last_timeout_check_time) < 1) {
+		return;
+	}
+	g.last_timeout_check_time = tv.tv_sec;
+
+	for (auto it = g.lanes.begin(); it != g.lanes.end(); ++it) {
+		check_timeouts(g, **it, tv.tv_sec);
+	}
+}
+
+void queue::check_timeouts(consumer_group &g, lane &l, time_t now)
+{
+	LOG_INFO("group '%s', class %d, checking timeouts: %ld waiting chunks",
+			g.name.c_str(), l.priority, l.chunks.count(chunk_window::WAITING_ACK));
+
+	int next_id = -1;
+	for (int chunk_id = l.chunks.first(chunk_window::WAITING_ACK); chunk_id >= 0; chunk_id = next_id) {
+		next_id = l.chunks.next(chunk_id, chunk_window::WAITING_ACK);
+
+		chunk *chunk = l.chunks.find(chunk_id);
+
+		if (chunk->get_time() > now) {
+			continue;
+		}
+
+		// Few stragglers of the otherwise acked chunk are not worth
+		// holding the whole chunk, relocate them instead of replaying.
+		// Chunk stays waiting while data of the stragglers is being read
+		// and then while relocated stragglers are being written.
+		if (compact(g, l, chunk_id, chunk) == COMPACT_PENDING) {
+			continue;
+		}
+
+		// Time passed but chunk still is not complete
+		// so we must replay unacked items from it.
+		LOG_ERROR("chunk %d timed out, returning back to the popping line, current time: %ld, chunk expiration time: %f",
+				chunk_id, now, chunk->get_time());
+
+		// There are two cases when chunk can still be in the popping line
+		// while experiencing a timeout:
+		// 1) if it's a single chunk in the queue (and serves both
+		//    as a push and a pop/ack target)
+		// 2) if iteration of this chunk was preempted by other timed out chunk
+		//    and then later this chunk timed out in its turn
+		// Timeout requires switch chunk's iteration into the replay mode.
+
+		if (l.chunks.test(chunk_id, chunk_window::POPPABLE)) {
+			LOG_INFO("chunk %d is already in popping line", chunk_id);
+		} else {
+			l.chunks.set(chunk_id, chunk_window::POPPABLE);
+			LOG_INFO("chunk %d inserted back to the popping line anew", chunk_id);
+		}
+		chunk->reset_iteration();
+
+		// persist delivery counters, so that entries which
+		// kill their consumers would be dead-lettered even after restart
+		if (m_max_deliveries > 0) {
+			chunk->write_meta();
+		}
+
+		// number of popped but still unacked entries
+		m_statistics.timeout_count += (chunk->meta().low_mark() - chunk->meta().acked());
+
+		l.chunks.clear(chunk_id, chunk_window::WAITING_ACK);
+	}
+}
+
+queue::compaction queue::compact(consumer_group &g, lane &l, int chunk_id, chunk *chunk)
+{
+	// relocated entries would be pushed for one group only,
+	// while chunks of all groups must stay the same
+	if (m_compact_max_unacked <= 0 || m_groups.size() > 1) {
+		return COMPACT_SKIPPED;
+	}
+	if (g.compact_writes.count(chunk_id)) {
+		return COMPACT_PENDING;
+	}
+
+	// Only chunks which were delivered completely could be compacted,
+	// then unacked entries are the only ones left alive in the chunk.
+	const chunk_meta &meta = chunk->meta();
+	if (chunk_id == l.state.chunk_id_push || !meta.full() || !meta.exhausted()) {
+		return COMPACT_SKIPPED;
+	}
+	if (meta.low_mark() - meta.acked() > m_compact_max_unacked) {
+		return COMPACT_SKIPPED;
+	}
+	// relocated entries must not run the class out of chunk ids midway
+	if (l.end() - l.state.chunk_id_push <= 1 + (meta.low_mark() - meta.acked()) / m_chunk_max) {
+		return COMPACT_SKIPPED;
+	}
+
+	// Relocated entry would change its id and lose its place among entries of its key,
+	// blob would go away along with the chunk it was written for
+	for (int pos = 0; pos < meta.low_mark(); ++pos) {
+		if ((meta[pos].state & (ENTRY_KEYED | ENTRY_BLOB)) && !(meta[pos].state & ENTRY_ACKED)) {
+			return COMPACT_SKIPPED;
+		}
+	}
+
+	// Data is read the way pop() reads it: asynchronously, chunk is checked
+	// again once the read completes
+	if (g.compact_failed.erase(chunk_id)) {
+		LOG_ERROR("chunk %d, compaction failed, falling back to replay", chunk_id);
+		return COMPACT_SKIPPED;
+	}
+	if (chunk->needs_unacked_data()) {
+		if (!g.compact_reads.count(chunk_id)) {
+			read_unacked_data(g, chunk_id, chunk);
+		}
+		return COMPACT_PENDING;
+	}
+
+	// Relocation pushes entries, so the push lock is taken here against the lock order.
+	// It's never waited for: compaction gives way to replay while pushes are in progress.
+	std::unique_lock<std::mutex> push_guard(m_push_mutex, std::try_to_lock);
+	if (!push_guard.owns_lock()) {
+		LOG_INFO("chunk %d, compaction skipped: push is in progress", chunk_id);
+		return COMPACT_SKIPPED;
+	}
+
+	data_array entries;
+	try {
+		entries = chunk->unacked();
+	} catch (const ioremap::elliptics::error &e) {
+		LOG_ERROR("chunk %d, compaction failed, falling back to replay: %s", chunk_id, e.what());
+		return COMPACT_SKIPPED;
+	}
+
+	LOG_INFO("chunk %d, compacting: relocating %ld unacked entries to the head of the queue",
+			chunk_id, entries.ids().size());
+
+	std::vector<ioremap::elliptics::async_write_result> writes;
+	size_t offset = 0;
+	for (size_t i = 0; i < entries.ids().size(); ++i) {
+		const entry_id &id = entries.ids()[i];
+		int size = entries.sizes()[i];
+
+		entry_id relocated = push_entry(g, l,
+				ioremap::elliptics::data_pointer::copy(entries.data().data() + offset, size),
+				meta[id.pos].deliveries, &writes);
+		g.remap[id.chunk][id.pos] = relocated;
+		g.remapped_to[relocated.chunk].insert(id.chunk);
+
+		LOG_INFO("entry %d-%d relocated to %d-%d", id.chunk, id.pos, relocated.chunk, relocated.pos);
+
+		offset += size;
+	}
+	m_statistics.relocate_count += entries.ids().size();
+
+	// Chunk is the only copy of the stragglers till their appends are stored,
+	// so it keeps waiting for acks meanwhile and is dropped only then
+	g.compact_writes.insert(chunk_id);
+
+	int epoch = m_epoch;
+	consumer_group *group = &g;
+	auto pending = std::make_shared<std::atomic<size_t>>(writes.size());
+	auto failed = std::make_shared<std::atomic<bool>>(false);
+
+	for (auto write = writes.begin(); write != writes.end(); ++write) {
+		write->connect(
+			ioremap::elliptics::async_write_result::result_function(),
+			[this, group, epoch, chunk_id, pending, failed] (const ioremap::elliptics::error_info &error) {
+				if (error) {
+					*failed = true;
+				}
+				if (--*pending == 0) {
+					relocation_written(group, epoch, chunk_id, *failed);
+				}
+			}
+		);
+	}
+
+	return COMPACT_PENDING;
+}
+
+void queue::relocation_written(consumer_group *g, int epoch, int chunk_id, bool failed)
+{
+	std::lock_guard<std::mutex> guard(m_mutex);
+
+	// queue could have been cleared or the chunk dropped while entries were being written
+	if (epoch != m_epoch || !g->compact_writes.erase(chunk_id)) {
+		return;
+	}
+
+	// Chunk could have been acked completely meanwhile,
+	// acks of its entries went to the entries themselves
+	lane *l = lane_of(*g, chunk_id);
+	chunk *chunk = l ? l->chunks.find(chunk_id) : NULL;
+	if (!chunk || !l->chunks.test(chunk_id, chunk_window::WAITING_ACK)) {
+		g->remap.erase(chunk_id);
+		return;
+	}
+
+	if (failed) {
+		// Relocated copies stay in the queue, as entries of any failed append do,
+		// while the original entries are replayed and acked by their own ids
+		LOG_ERROR("chunk %d, relocated entries were not stored", chunk_id);
+		g->remap.erase(chunk_id);
+		g->compact_failed.insert(chunk_id);
+		return;
+	}
+
+	chunk->add(&m_statistics.chunks_popped);
+	if (m_retention_time <= 0) {
+		chunk->remove_meta(*m_reclaimer);
+	}
+	++m_statistics.compact_count;
+
+	// chunk object is destroyed here
+	count_chunk(*l, chunk, -1);
+	l->chunks.clear(chunk_id, chunk_window::POPPABLE);
+	l->chunks.clear(chunk_id, chunk_window::WAITING_ACK);
+
+	LOG_INFO("chunk %d compacted", chunk_id);
+
+	update_chunk_id_ack(*l);
+}
+
+void queue::read_unacked_data(consumer_group &g, int chunk_id, chunk *chunk)
+{
+	LOG_INFO("chunk %d, reading data of %d unacked entries for compaction",
+			chunk_id, chunk->meta().low_mark() - chunk->meta().acked());
+
+	g.compact_reads.insert(chunk_id);
+
+	int epoch = m_epoch;
+	consumer_group *group = &g;
+	auto data = std::make_shared<ioremap::elliptics::data_pointer>();
+
+	chunk->read_data().connect(
+		[data] (const ioremap::elliptics::read_result_entry &entry) {
+			if (!entry.error()) {
+				*data = entry.file();
+			}
+		},
+		[this, group, epoch, chunk_id, data] (const ioremap::elliptics::error_info &error) {
+			// timer checks timeouts of the group once the read is done, chunk is compacted then
+			chunk_data_loaded(group, epoch, chunk_id, [this, group, chunk_id, data, &error] (ioremap::grape::chunk *loaded) {
+				group->compact_reads.erase(chunk_id);
+				if (!loaded->unacked_loaded(*data, error, packed_size(chunk_id))) {
+					group->compact_failed.insert(chunk_id);
+				}
+			});
+		}
+	);
+}
+
+void queue::ack(const entry_id id)
+{
+	ack(std::vector<entry_id>(1, id));
+}
+
+void queue::ack_entry(consumer_group &g, const entry_id id, bool write)
+{
+	lane *l = lane_of(g, id.chunk);
+	if (!l || !l->chunks.test(id.chunk, chunk_window::WAITING_ACK)) {
+		entry_id new_id;
+		if (take_remapped(g, id, &new_id)) {
+			LOG_INFO("ack for relocated entry %d-%d, acking it as %d-%d", id.chunk, id.pos, new_id.chunk, new_id.pos);
+			ack_entry(g, new_id);
+			return;
+		}
+
+		LOG_ERROR("ack for chunk %d (pos %d) which is not in waiting list", id.chunk, id.pos);
+		return;
+	}
+
+	chunk *chunk = l->chunks.find(id.chunk);
+	// id comes from the consumer, meta is not indexed with whatever it sent
+	if (id.pos < 0 || id.pos >= chunk->meta().high_mark()) {
+		LOG_ERROR("ack for entry %d-%d which is past the end of the chunk: %d entries",
+				id.chunk, id.pos, chunk->meta().high_mark());
+		return;
+	}
+	if (chunk->meta()[id.pos].state & ENTRY_ACKED) {
+		LOG_INFO("ack for entry %d-%d which is already acked", id.chunk, id.pos);
+		return;
+	}
+
+	// ack which completes the chunk writes its meta anyway, chunk is gone right after it
+	count_chunk(*l, chunk, -1);
+	chunk->ack(id.pos, write || chunk->meta().acked() + 1 == chunk->meta().low_mark());
+	count_chunk(*l, chunk, 1);
+	release_key(g, id);
+
+	if (chunk->meta().acked() == chunk->meta().low_mark()) {
+		// Real end of the chunk's lifespan, all popped entries are acked
+
+		chunk->add(&m_statistics.chunks_popped);
+
+		// Chunk would be uncomplete here only if its the only chunk in the queue
+		// (filled partially and serving both as a push and a pop/ack target).
+		// Chunk data goes when all groups are done with the chunk, see reclaim_data(),
+		// retained chunks keep their meta until then
+		if (chunk->meta().complete()) {
+			if (m_retention_time <= 0) {
+				chunk->remove_meta(*m_reclaimer);
+			}
+			LOG_INFO("group '%s', chunk %d complete", g.name.c_str(), id.chunk);
+		}
+
+		// chunk object is destroyed here unless it's still in the popping line
+		l->chunks.clear(id.chunk, chunk_window::WAITING_ACK);
+
+		// Relocated entries of this chunk could be acked by their new ids,
+		// remapping for them is not needed anymore
+		forget_remap(g, id.chunk);
+
+		update_chunk_id_ack(*l);
+	}
+
+	++m_statistics.ack_count;
+}
+
+void queue::update_chunk_id_ack(lane &l)
+{
+	// Set chunk_id_ack to the lowest active chunk
+	l.state.chunk_id_ack = l.state.chunk_id_push;
+	if (!l.chunks.empty()) {
+		l.state.chunk_id_ack = std::min(l.state.chunk_id_ack, l.chunks.low());
+	}
+
+	write_state(l);
+
+	reclaim_data(l.priority);
+}
+
+void queue::touch(const entry_id id)
+{
+	std::lock_guard<std::mutex> guard(m_mutex);
+	touch_entry(*m_groups[0], id);
+}
+
+void queue::touch_entry(consumer_group &g, const entry_id id)
+{
+	// Acking deadline is tracked per chunk, so prolonging lease of the entry
+	// means postponing deadline of the chunk it belongs to.
+	entry_id new_id;
+	if (remapped(g, id, &new_id)) {
+		touch_entry(g, new_id);
+		return;
+	}
+
+	lane *l = lane_of(g, id.chunk);
+	if (!l || !l->chunks.test(id.chunk, chunk_window::WAITING_ACK)) {
+		LOG_ERROR("touch for chunk %d (pos %d) which is not in waiting list", id.chunk, id.pos);
+		return;
+	}
+
+	chunk *chunk = l->chunks.find(id.chunk);
+	if (id.pos < 0 || id.pos >= chunk->meta().high_mark()) {
+		LOG_ERROR("touch for entry %d-%d which is past the end of the chunk: %d entries",
+				id.chunk, id.pos, chunk->meta().high_mark());
+		return;
+	}
+	if (chunk->meta()[id.pos].state & ENTRY_ACKED) {
+		LOG_INFO("touch for entry %d-%d which is already acked", id.chunk, id.pos);
+		return;
+	}
+
+	chunk->reset_time(m_ack_timeout);
+
+	++m_statistics.touch_count;
+}
+
+void queue::peek(int num, uint64_t max_bytes, double max_wait, peek_handler handler, const std::string &group_name)
+{
+	std::vector<peek_request> completed;
+
+	{
+		std::lock_guard<std::mutex> guard(m_mutex);
+		consumer_group &g = group(group_name);
+
+		peek_request req;
+		req.num = num;
+		req.max_bytes = max_bytes;
+		req.handler = handler;
+		if (max_wait > 0) {
+			req.deadline = std::chrono::steady_clock::now() +
+				std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(max_wait));
+
+			start_timer();
+		}
+		g.peeks.push_back(std::move(req));
+
+		check_timeouts(g);
+		process_peeks(g, &completed);
+	}
+
+	complete_peeks(completed);
+}
+
+void queue::pop(int num, uint64_t max_bytes, double max_wait, peek_handler handler, const std::string &group_name)
+{
+	peek(num, max_bytes, max_wait, [this, handler, group_name] (const data_array &d) {
+		if (!d.empty()) {
+			ack(d.ids(), group_name);
+		}
+		handler(d);
+	}, group_name);
+}
+
+int queue::subscribe(peek_handler handler, expire_handler expired, const std::string &group_name)
+{
+	std::lock_guard<std::mutex> guard(m_mutex);
+	consumer_group &g = group(group_name);
+
+	int id = m_next_subscription_id++;
+
+	subscription sub;
+	sub.credit_entries = 0;
+	sub.credit_bytes = 0;
+	sub.count_bytes = false;
+	sub.starved_since = unix_time();
+	sub.handler = handler;
+	sub.expired = expired;
+	g.subscriptions[id] = sub;
+
+	// timeouts are checked on behalf of subscribers, which never call peek()
+	start_timer();
+	m_timer_cond.notify_one();
+
+	LOG_INFO("group '%s', subscription %d started, %ld subscriptions", g.name.c_str(), id, g.subscriptions.size());
+
+	return id;
+}
+
+bool queue::grant(int subscription_id, int entries, uint64_t bytes)
+{
+	std::vector<peek_request> completed;
+
+	{
+		std::lock_guard<std::mutex> guard(m_mutex);
+
+		consumer_group *g = NULL;
+		auto it = m_groups[0]->subscriptions.end();
+		for (auto i = m_groups.begin(); i != m_groups.end() && !g; ++i) {
+			it = (*i)->subscriptions.find(subscription_id);
+			if (it != (*i)->subscriptions.end()) {
+				g = i->get();
+			}
+		}
+
+		if (!g) {
+			LOG_ERROR("credit for subscription %d which does not exist", subscription_id);
+			return false;
+		}
+
+		subscription &sub = it->second;
+		sub.credit_entries += entries;
+		if (bytes) {
+			sub.credit_bytes += bytes;
+			sub.count_bytes = true;
+		}
+		if (sub.credit_entries > 0 && !(sub.count_bytes && sub.credit_bytes == 0)) {
+			sub.starved_since = 0;
+		}
+
+		LOG_INFO("subscription %d, credit granted: entries %d, bytes %lld, now: entries %d, bytes %lld",
+				subscription_id, entries, bytes, sub.credit_entries, sub.credit_bytes);
+
+		check_timeouts(*g);
+		process_peeks(*g, &completed);
+	}
+
+	complete_peeks(completed);
+
+	return true;
+}
+
+bool queue::unsubscribe(int subscription_id)
+{
+	std::lock_guard<std::mutex> guard(m_mutex);
+
+	LOG_INFO("subscription %d finished", subscription_id);
+
+	for (auto g = m_groups.begin(); g != m_groups.end(); ++g) {
+		if ((*g)->subscriptions.erase(subscription_id)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool queue::hungry(const consumer_group &g) const
+{
+	if (!g.waiters.empty()) {
+		return true;
+	}
+
+	for (auto i = g.subscriptions.begin(); i != g.subscriptions.end(); ++i) {
+		if (i->second.credit_entries > 0) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void queue::process_peeks(consumer_group &g, std::vector<peek_request> *completed)
+{
+	// waiting requests are older, they get another try first
+	if (!g.waiters.empty()) {
+		g.peeks.insert(g.peeks.begin(),
+				std::make_move_iterator(g.waiters.begin()), std::make_move_iterator(g.waiters.end()));
+		g.waiters.clear();
+	}
+
+	auto now = std::chrono::steady_clock::now();
+
+	while (!g.peeks.empty()) {
+		peek_request &req = g.peeks.front();
+
+		if (!serve(g, req)) {
+			LOG_INFO("group '%s', peek request parked: %ld requests are waiting for data of %ld chunks",
+					g.name.c_str(), g.peeks.size(), g.reading_chunks.size());
+			break;
+		}
+
+		if (req.result.empty() && req.deadline > now) {
+			g.waiters.push_back(std::move(req));
+		} else {
+			completed->push_back(std::move(req));
+		}
+		g.peeks.pop_front();
+	}
+
+	if (!g.waiters.empty()) {
+		m_timer_cond.notify_one();
+	}
+
+	// subscribers get what is left after requests
+	if (g.peeks.empty()) {
+		serve_subscriptions(g, completed);
+	}
+}
+
+void queue::serve_subscriptions(consumer_group &g, std::vector<peek_request> *completed)
+{
+	if (g.subscriptions.empty()) {
+		return;
+	}
+
+	// Every subscriber is served once per call in turns,
+	// starting from the one next to the last served
+	auto start = g.subscriptions.upper_bound(g.last_served_subscription);
+	for (size_t n = 0; n < g.subscriptions.size(); ++n, ++start) {
+		if (start == g.subscriptions.end()) {
+			start = g.subscriptions.begin();
+		}
+
+		subscription &sub = start->second;
+		if (sub.credit_entries <= 0 || (sub.count_bytes && sub.credit_bytes == 0)) {
+			continue;
+		}
+
+		peek_request req;
+		req.num = sub.credit_entries;
+		req.max_bytes = sub.count_bytes ? sub.credit_bytes : 0;
+		req.handler = sub.handler;
+
+		bool parked = !serve(g, req);
+
+		if (!req.result.empty()) {
+			g.last_served_subscription = start->first;
+
+			sub.credit_entries -= req.result.ids().size();
+			if (sub.count_bytes) {
+				sub.credit_bytes -= std::min<uint64_t>(sub.credit_bytes, req.result.data().size());
+			}
+			if (sub.credit_entries <= 0 || (sub.count_bytes && sub.credit_bytes == 0)) {
+				sub.starved_since = unix_time();
+			}
+
+			completed->push_back(std::move(req));
+		}
+
+		// the rest will be served when data is read
+		if (parked) {
+			break;
+		}
+	}
+}
+
+void queue::expire_subscriptions(consumer_group &g, std::vector<expire_handler> *expired)
+{
+	if (m_subscription_lease <= 0) {
+		return;
+	}
+
+	// Subscriber which doesn't grant credit for the entries it was given is either
+	// gone or stuck, the stream it left open would keep the timer running forever
+	double deadline = unix_time() - m_subscription_lease;
+	for (auto it = g.subscriptions.begin(); it != g.subscriptions.end(); ) {
+		if (it->second.starved_since && it->second.starved_since < deadline) {
+			LOG_ERROR("group '%s', subscription %d expired: no credit for %f seconds",
+					g.name.c_str(), it->first, m_subscription_lease);
+			expired->push_back(it->second.expired);
+			g.subscriptions.erase(it++);
+		} else {
+			++it;
+		}
+	}
+}
+
+void queue::start_packer()
+{
+	if (!m_pack_thread.joinable()) {
+		m_pack_thread = std::thread(&queue::run_packer, this);
+	}
+}
+
+void queue::run_packer()
+{
+	std::unique_lock<std::mutex> guard(m_mutex);
+
+	while (!m_stopping) {
+		auto due = std::min_element(m_sealed.begin(), m_sealed.end(),
+				[] (const std::pair<const int, double> &a, const std::pair<const int, double> &b) {
+					return a.second < b.second;
+				});
+		if (due == m_sealed.end()) {
+			m_pack_cond.wait(guard);
+			continue;
+		}
+
+		double left = due->second - unix_time();
+		if (left > 0) {
+			m_pack_cond.wait_for(guard, std::chrono::duration<double>(left));
+			continue;
+		}
+
+		// packing reads and writes chunk data, it's done outside of the queue lock
+		int chunk_id = due->first;
+		guard.unlock();
+		pack_chunk(chunk_id);
+		guard.lock();
+	}
+}
+
+void queue::pack_chunk(int chunk_id)
+{
+	std::lock_guard<std::mutex> pack_guard(m_pack_mutex);
+
+	uint64_t size;
+	{
+		std::lock_guard<std::mutex> guard(m_mutex);
+
+		// chunk could have been removed (or the queue cleared) while the lock was released
+		if (!m_sealed.erase(chunk_id)) {
+			return;
+		}
+		auto stored = m_stored_chunks.find(chunk_id);
+		if (stored == m_stored_chunks.end()) {
+			return;
+		}
+		size = stored->second.size;
+
+		m_packing = chunk_id;
+		m_packing_removed = false;
+	}
+
+	ioremap::elliptics::session tmp = m_client.create_session();
+	std::string key = chunk::data_key(m_queue_id, chunk_id);
+	uint64_t packed_size = 0;
+	bool failed = false;
+
+	try {
+		ioremap::elliptics::data_pointer d = tmp.read_data(key, 0, 0).get_one().file();
+
+		// data which doesn't match its meta is left unpacked, as is data which packing doesn't shrink
+		if (d.size() != size) {
+			LOG_ERROR("chunk %d, packing skipped: data has %ld bytes, meta states %llu",
+					chunk_id, d.size(), (unsigned long long)size);
+		} else {
+			ioremap::elliptics::data_pointer p = pack_data(d, m_pack_block_size);
+			if (p.size() < d.size() && record_packed(chunk_id, p.size())) {
+				tmp.write_data(key, p, 0).wait();
+				packed_size = p.size();
+			}
+		}
+	} catch (const std::exception &e) {
+		LOG_ERROR("chunk %d, packing failed, retrying later: %s", chunk_id, e.what());
+		failed = true;
+	}
+
+	std::lock_guard<std::mutex> guard(m_mutex);
+	m_packing = -1;
+	if (m_packing_removed) {
+		m_reclaimer->enqueue(key);
+	} else if (failed) {
+		// the others are not held up by the chunk
+		m_sealed[chunk_id] = unix_time() + 1;
+	}
+
+	if (packed_size) {
+		LOG_INFO("chunk %d packed: %llu bytes to %llu", chunk_id,
+				(unsigned long long)size, (unsigned long long)packed_size);
+
+		++m_statistics.pack_count;
+		m_statistics.pack_raw_bytes += size;
+		m_statistics.pack_bytes += packed_size;
+	}
+}
+
+bool queue::record_packed(int chunk_id, uint64_t packed_size)
+{
+	std::unique_lock<std::mutex> guard(m_mutex);
+
+	auto stored = m_stored_chunks.find(chunk_id);
+	if (m_packing_removed || stored == m_stored_chunks.end()) {
+		return false;
+	}
+	stored->second.packed_size = packed_size;
+	ioremap::elliptics::async_write_result index = write_time_index();
+	guard.unlock();
+
+	// Packed data must not get to storage before its size does. Should the write
+	// fail after all, readers still tell raw data by its size
+	index.wait();
+	return true;
+}
+
+void queue::start_timer()
+{
+	if (!m_timer_thread.joinable()) {
+		m_timer_thread = std::thread(&queue::run_timer, this);
+	}
+}
+
+void queue::run_timer()
+{
+	std::unique_lock<std::mutex> guard(m_mutex);
+
+	while (!m_stopping) {
+		bool idle = !m_delay_due && !m_sequences_due && !retaining() && !truncating();
+		for (auto g = m_groups.begin(); g != m_groups.end() && idle; ++g) {
+			idle = !(*g)->reading_done && (*g)->waiters.empty() && (*g)->subscriptions.empty();
+		}
+
+		if (idle) {
+			m_timer_cond.wait(guard);
+			continue;
+		}
+
+		auto now = std::chrono::steady_clock::now();
+		auto next = std::chrono::steady_clock::time_point::max();
+
+		if (m_delay_due) {
+			double left = m_delay_due - unix_time();
+			if (left <= 0) {
+				// promotion takes the delay and push locks, which go before the queue lock
+				guard.unlock();
+				promote_delayed();
+				guard.lock();
+				continue;
+			}
+
+			next = now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+					std::chrono::duration<double>(left));
+		}
+
+		if (m_sequences_due) {
+			double left = m_sequences_due - unix_time();
+			if (left <= 0) {
+				// pushes done during the write are written by the next one
+				m_sequences_due = 0;
+				guard.unlock();
+				write_sequences();
+				guard.lock();
+				continue;
+			}
+
+			next = std::min(next, now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+					std::chrono::duration<double>(left)));
+		}
+
+		// Nothing thrown here must leave the timer thread, whatever failed
+		// is tried again on one of the next rounds
+		if (retaining()) {
+			try {
+				expire_chunks();
+			} catch (const std::exception &e) {
+				LOG_ERROR("expiring retained chunks failed: %s", e.what());
+			}
+			next = std::min(next, now + std::chrono::seconds(1));
+		}
+
+		std::vector<peek_request> completed;
+		std::vector<expire_handler> expired;
+
+		try {
+			if (truncating()) {
+				truncate_chunks();
+				next = std::min(next, now + std::chrono::seconds(1));
+
+				// keys of dropped entries could have passed on
+				for (auto g = m_groups.begin(); g != m_groups.end(); ++g) {
+					if (!(*g)->released.empty() && hungry(**g)) {
+						process_peeks(**g, &completed);
+					}
+				}
+			}
+
+			for (auto it = m_groups.begin(); it != m_groups.end(); ++it) {
+				consumer_group &g = **it;
+
+				if (g.reading_done) {
+					check_timeouts(g);
+					process_peeks(g, &completed);
+					g.reading_done = false;
+				}
+
+				for (auto i = g.waiters.begin(); i != g.waiters.end(); ) {
+					if (i->deadline <= now) {
+						completed.push_back(std::move(*i));
+						i = g.waiters.erase(i);
+					} else {
+						next = std::min(next, i->deadline);
+						++i;
+					}
+				}
+			}
+
+			if (!completed.empty()) {
+				LOG_INFO("%ld waiting peek requests timed out", completed.size());
+			}
+
+			// Nobody else would check timeouts for subscribers,
+			// replayed entries go straight to them
+			for (auto it = m_groups.begin(); it != m_groups.end(); ++it) {
+				consumer_group &g = **it;
+
+				if (!g.subscriptions.empty()) {
+					expire_subscriptions(g, &expired);
+					check_timeouts(g);
+					process_peeks(g, &completed);
+
+					next = std::min(next, now + std::chrono::seconds(1));
+				}
+			}
+		} catch (const std::exception &e) {
+			LOG_ERROR("timer round failed, retrying in a second: %s", e.what());
+			next = std::min(next, now + std::chrono::seconds(1));
+		}
+
+		if (completed.empty() && expired.empty()) {
+			m_timer_cond.wait_until(guard, next);
+			continue;
+		}
+
+		guard.unlock();
+		complete_peeks(completed);
+		for (auto i = expired.begin(); i != expired.end(); ++i) {
+			(*i)();
+		}
+		guard.lock();
+	}
+}
+
+void queue::complete_peeks(std::vector<peek_request> &completed)
+{
+	for (auto i = completed.begin(); i != completed.end(); ++i) {
+		i->handler(i->result);
+	}
+}
+
+bool queue::serve(consumer_group &g, peek_request &req)
+{
+	serve_released(g, req);
+
+	bool parked = false;
+
+	if (g.lanes.size() == 1) {
+		int taken = 0;
+		parked = !serve_lane(g, req, *g.lanes[0], req.num, &taken);
+		req.num -= taken;
+	} else {
+		// Classes take turns from the highest one down, class is given up to its weight
+		// of entries in its turn and passes the turn when it has nothing more to give.
+		// Turns carry over from request to request.
+		size_t idle = 0;
+		while (req.num > 0 && idle < g.lanes.size()) {
+			lane &l = *g.lanes[g.lane_turn];
+			if (l.quota <= 0) {
+				l.quota = l.weight;
+			}
+
+			int limit = std::min(req.num, l.quota);
+			int taken = 0;
+			parked = !serve_lane(g, req, l, limit, &taken);
+
+			req.num -= taken;
+			l.quota -= taken;
+			idle = taken ? 0 : idle + 1;
+
+			if (parked || (req.max_bytes && req.result.data().size() >= req.max_bytes)) {
+				break;
+			}
+
+			if (taken < limit) {
+				l.quota = 0;
+			}
+			if (l.quota <= 0) {
+				g.lane_turn = g.lane_turn ? g.lane_turn - 1 : g.lanes.size() - 1;
+			}
+		}
+	}
+
+	flush_dead_letters(g, req.dead);
+
+	return !parked;
+}
+
+bool queue::serve_lane(consumer_group &g, peek_request &req, lane &l, int limit, int *taken)
+{
+	if (m_relaxed_order_chunks > 1) {
+		return serve_relaxed(g, req, l, limit, taken);
+	}
+
+	bool parked = false;
+	// every popped entry could end up waiting for its key
+	int num = std::min(limit, key_backlog_room(g));
+
+	while (num > 0) {
+		if (req.max_bytes && req.result.data().size() >= req.max_bytes) {
+			break;
+		}
+
+		int chunk_id = l.chunks.first(chunk_window::POPPABLE);
+		if (chunk_id < 0) {
+			break;
+		}
+
+		chunk *chunk = l.chunks.find(chunk_id);
+
+		if (chunk->needs_data()) {
+			read_chunk_data(g, chunk_id, chunk);
+			parked = true;
+			break;
+		}
+
+		uint64_t max_bytes = req.max_bytes ? req.max_bytes - req.result.data().size() : 0;
+		count_chunk(l, chunk, -1);
+		data_array d = chunk->pop(num, max_bytes, req.result.empty());
+		count_chunk(l, chunk, 1);
+		LOG_INFO("chunk %d, popping %d entries", chunk_id, d.sizes().size());
+		deliver(g, req, chunk_id, chunk, d);
+
+		num -= d.sizes().size();
+		*taken += d.sizes().size();
+
+		if (chunk_id == l.state.chunk_id_push) {
+			break;
+		}
+
+		if (chunk->expect_no_more()) {
+			//FIXME: this could happen to be called many times for the same chunk
+			// (between queue restarts or because of chunk replaying)
+			chunk->add(&m_statistics.chunks_popped);
+
+			LOG_INFO("chunk %d exhausted, dropped from the popping line", chunk_id);
+
+			// drop chunk from the pop list
+			l.chunks.clear(chunk_id, chunk_window::POPPABLE);
+
+		} else if (d.empty()) {
+			// chunk has nothing to give right now (its data could be unreadable
+			// or its next entry does not fit into the byte limit), do not spin on it
+			break;
+		}
+	}
+
+	return !parked;
+}
+
+bool queue::serve_relaxed(consumer_group &g, peek_request &req, lane &l, int limit, int *taken)
+{
+	// Chunks at the head of the popping line are served in turns, every request
+	// starts from the chunk next to the one served last. Entries of a chunk are
+	// still given away in order, but a chunk waiting for its data (or replaying)
+	// does not hold up entries of the other ones.
+	std::vector<int> ids;
+	for (int id = l.chunks.first(chunk_window::POPPABLE);
+			id >= 0 && ids.size() < (size_t)m_relaxed_order_chunks;
+			id = l.chunks.next(id, chunk_window::POPPABLE)) {
+		ids.push_back(id);
+	}
+
+	size_t start = std::upper_bound(ids.begin(), ids.end(), l.last_relaxed_chunk) - ids.begin();
+	bool reading = false;
+	int num = std::min(limit, key_backlog_room(g));
+
+	for (size_t n = 0; n < ids.size() && num > 0; ++n) {
+		if (req.max_bytes && req.result.data().size() >= req.max_bytes) {
+			break;
+		}
+
+		int chunk_id = ids[(start + n) % ids.size()];
+		chunk *chunk = l.chunks.find(chunk_id);
+
+		if (chunk->needs_data()) {
+			read_chunk_data(g, chunk_id, chunk);
+			reading = true;
+			continue;
+		}
+
+		uint64_t max_bytes = req.max_bytes ? req.max_bytes - req.result.data().size() : 0;
+		count_chunk(l, chunk, -1);
+		data_array d = chunk->pop(num, max_bytes, req.result.empty());
+		count_chunk(l, chunk, 1);
+		LOG_INFO("chunk %d, relaxed order, popping %d entries", chunk_id, d.sizes().size());
+		deliver(g, req, chunk_id, chunk, d);
+
+		if (!d.empty()) {
+			l.last_relaxed_chunk = chunk_id;
+		}
+
+		if (chunk_id != l.state.chunk_id_push && chunk->expect_no_more()) {
+			chunk->add(&m_statistics.chunks_popped);
+
+			LOG_INFO("chunk %d exhausted, dropped from the popping line", chunk_id);
+
+			l.chunks.clear(chunk_id, chunk_window::POPPABLE);
+		}
+
+		num -= d.sizes().size();
+		*taken += d.sizes().size();
+	}
+
+	// request waits for chunk data only if nothing else could be given to it
+	return !(reading && req.result.empty());
+}
+
+void queue::deliver(consumer_group &g, peek_request &req, int chunk_id, chunk *chunk, const data_array &d)
+{
+	if (d.empty()) {
+		return;
+	}
+
+	m_statistics.pop_count += d.sizes().size();
+
+	// set or reset timeout timer for the chunk
+	update_chunk_timeout(g, chunk_id, chunk);
+
+	size_t offset = 0;
+	for (size_t i = 0; i < d.ids().size(); ++i) {
+		const entry_id &id = d.ids()[i];
+		const char *data = d.data().data() + offset;
+		int size = d.sizes()[i];
+		int flags = (chunk->meta()[id.pos].state & ENTRY_BLOB) ? data_array::BLOB : 0;
+
+		offset += size;
+
+		if (chunk->meta()[id.pos].state & ENTRY_KEYED) {
+			std::string key;
+			size_t header = unframe_keyed(data, size, &key);
+			if (!header) {
+				LOG_ERROR("entry %d-%d, malformed ordering key, delivering entry as is", id.chunk, id.pos);
+			} else {
+				data += header;
+				size -= header;
+
+				if (!claim_key(g, id, key, data, size, flags)) {
+					continue;
+				}
+			}
+		}
+
+		chunk->deliver(id.pos);
+
+		if (undeliverable(chunk, id.pos)) {
+			ioremap::elliptics::data_pointer letter = ioremap::elliptics::data_pointer::copy(data, size);
+
+			// blob goes away along with the chunk, dead letter takes the payload itself
+			if (flags & data_array::BLOB) {
+				try {
+					auto ref = deserialize<blob_ref>(letter);
+					letter = m_client.create_session().read_data(ref.key, 0, 0).get_one().file();
+				} catch (const std::exception &e) {
+					LOG_ERROR("entry %d-%d, blob read error, moving the reference: %s",
+							id.chunk, id.pos, e.what());
+				}
+			}
+
+			dead_letter(id, letter);
+			req.dead.push_back(id);
+		} else {
+			req.result.append(data, size, id, flags);
+		}
+	}
+}
+
+bool queue::claim_key(consumer_group &g, const entry_id id, const std::string &key,
+		const char *data, size_t size, int flags)
+{
+	auto owner = g.key_owners.find(key);
+	if (owner == g.key_owners.end()) {
+		g.key_owners[key] = id;
+		g.owned_keys[id] = key;
+		return true;
+	}
+
+	if (owner->second == id) {
+		// Replayed owner is given away again, unless it was released
+		// and is still waiting to be given away
+		return !g.released.count(id);
+	}
+
+	// replayed entry could be waiting for the key already
+	if (g.waiting.count(id)) {
+		return false;
+	}
+
+	std::deque<consumer_group::keyed_entry> &backlog = g.key_backlog[key];
+
+	consumer_group::keyed_entry entry;
+	entry.id = id;
+	entry.data.assign(data, size);
+	entry.flags = flags;
+	backlog.push_back(entry);
+	g.waiting[id] = key;
+
+	LOG_INFO("entry %d-%d waits for its key owned by %d-%d, %ld entries are waiting for the key",
+			id.chunk, id.pos, owner->second.chunk, owner->second.pos, backlog.size());
+
+	return false;
+}
+
+void queue::release_key(consumer_group &g, const entry_id id)
+{
+	g.released.erase(id);
+
+	auto owned = g.owned_keys.find(id);
+	if (owned == g.owned_keys.end()) {
+		return;
+	}
+
+	std::string key = owned->second;
+	g.owned_keys.erase(owned);
+
+	auto backlog = g.key_backlog.find(key);
+	if (backlog == g.key_backlog.end()) {
+		g.key_owners.erase(key);
+		return;
+	}
+
+	// next entry of the key becomes its owner
+	consumer_group::keyed_entry next = backlog->second.front();
+	backlog->second.pop_front();
+	if (backlog->second.empty()) {
+		g.key_backlog.erase(backlog);
+	}
+	g.waiting.erase(next.id);
+
+	g.key_owners[key] = next.id;
+	g.owned_keys[next.id] = key;
+	g.released[next.id] = next;
+}
+
+void queue::serve_released(consumer_group &g, peek_request &req)
+{
+	while (req.num > 0 && !g.released.empty()) {
+		const consumer_group::keyed_entry &entry = g.released.begin()->second;
+
+		if (req.max_bytes && !req.result.empty() &&
+				req.result.data().size() + entry.data.size() > req.max_bytes) {
+			break;
+		}
+
+		// consumer is given full ack timeout for the entry
+		lane *l = lane_of(g, entry.id.chunk);
+		chunk *chunk = l ? l->chunks.find(entry.id.chunk) : NULL;
+		if (chunk) {
+			update_chunk_timeout(g, entry.id.chunk, chunk);
+			chunk->deliver(entry.id.pos);
+		}
+
+		req.result.append(entry.data.data(), entry.data.size(), entry.id, entry.flags);
+		++m_statistics.pop_count;
+		--req.num;
+
+		g.released.erase(g.released.begin());
+	}
+}
+
+int queue::key_backlog_room(const consumer_group &g) const
+{
+	if (m_max_key_backlog <= 0) {
+		return INT_MAX;
+	}
+
+	// Full backlog parks popping: entries come out again once acks release keys
+	// and hand the waiting entries on
+	return std::max(0, m_max_key_backlog - (int)g.waiting.size());
+}
+
+void queue::read_chunk_data(consumer_group &g, int chunk_id, chunk *chunk)
+{
+	// In strict order mode only one read per class is in flight at a time, requests
+	// wait for it in order. In relaxed order mode chunks are read in parallel.
+	if (m_relaxed_order_chunks > 1) {
+		if (g.reading_chunks.count(chunk_id)) {
+			return;
+		}
+	} else {
+		lane *l = lane_of(g, chunk_id);
+		auto reading = g.reading_chunks.lower_bound(l->base());
+		if (reading != g.reading_chunks.end() && *reading < l->end()) {
+			return;
+		}
+	}
+	g.reading_chunks.insert(chunk_id);
+
+	int epoch = m_epoch;
+	consumer_group *group = &g;
+
+	auto stored = m_stored_chunks.find(chunk_id);
+	if (m_pack_block_size && stored != m_stored_chunks.end() && stored->second.packed_size) {
+		read_packed_index(group, epoch, chunk_id, chunk, stored->second);
+		return;
+	}
+
+	connect_data_read(group, epoch, chunk_id, chunk->read_data());
+}
+
+void queue::read_packed_index(consumer_group *g, int epoch, int chunk_id, chunk *chunk, const stored_chunk &stored)
+{
+	auto index = std::make_shared<ioremap::elliptics::data_pointer>();
+	auto total_size = std::make_shared<uint64_t>(0);
+	uint64_t packed_size = stored.packed_size;
+
+	chunk->read_data(0, packed_index_size(stored.size, m_pack_block_size)).connect(
+		[index, total_size] (const ioremap::elliptics::read_result_entry &entry) {
+			if (!entry.error()) {
+				*index = entry.file();
+				*total_size = entry.io_attribute()->total_size;
+			}
+		},
+		[this, g, epoch, chunk_id, index, total_size, packed_size] (const ioremap::elliptics::error_info &error) {
+			packed_index_loaded(g, epoch, chunk_id, *index, *total_size, packed_size, error);
+		}
+	);
+}
+
+void queue::packed_index_loaded(consumer_group *g, int epoch, int chunk_id, const ioremap::elliptics::data_pointer &index,
+		uint64_t total_size, uint64_t packed_size, const ioremap::elliptics::error_info &error)
+{
+	if (error) {
+		chunk_data_loaded(g, epoch, chunk_id, [&error] (chunk *chunk) {
+			chunk->data_loaded(ioremap::elliptics::data_pointer(), error);
+		});
+		return;
+	}
+
+	std::unique_ptr<ioremap::elliptics::async_read_result> read;
+	bool blocks = false;
+	uint64_t offset = 0;
+	{
+		std::lock_guard<std::mutex> guard(m_mutex);
+
+		lane *l = lane_of(*g, chunk_id);
+		chunk *chunk = l ? l->chunks.find(chunk_id) : NULL;
+		auto stored = m_stored_chunks.find(chunk_id);
+		if (epoch == m_epoch && chunk && stored != m_stored_chunks.end()) {
+			// Data of any other size is raw: packed data never made it to storage.
+			// Index of another block size (the option could have been changed) is read whole
+			if (total_size == packed_size) {
+				offset = chunk->next_offset();
+				try {
+					uint64_t block_offset = packed_block_offset(index, stored->second.size, packed_size, &offset);
+					read.reset(new ioremap::elliptics::async_read_result(chunk->read_data(block_offset, 0)));
+					blocks = true;
+				} catch (const ioremap::elliptics::error &e) {
+					LOG_ERROR("chunk %d, reading whole data: %s", chunk_id, e.what());
+				}
+			}
+
+			if (!read) {
+				read.reset(new ioremap::elliptics::async_read_result(chunk->read_data()));
+			}
+		}
+	}
+
+	if (!read) {
+		// chunk is gone, nothing to load
+		chunk_data_loaded(g, epoch, chunk_id, [] (chunk *) {});
+	} else if (blocks) {
+		connect_blocks_read(g, epoch, chunk_id, index, offset, *read);
+	} else {
+		connect_data_read(g, epoch, chunk_id, *read);
+	}
+}
+
+void queue::connect_data_read(consumer_group *g, int epoch, int chunk_id, ioremap::elliptics::async_read_result read)
+{
+	auto data = std::make_shared<ioremap::elliptics::data_pointer>();
+
+	read.connect(
+		[data] (const ioremap::elliptics::read_result_entry &entry) {
+			if (!entry.error()) {
+				*data = entry.file();
+			}
+		},
+		[this, g, epoch, chunk_id, data] (const ioremap::elliptics::error_info &error) {
+			chunk_data_loaded(g, epoch, chunk_id, [this, chunk_id, data, &error] (chunk *chunk) {
+				chunk->data_loaded(*data, error, packed_size(chunk_id));
+			});
+		}
+	);
+}
+
+void queue::connect_blocks_read(consumer_group *g, int epoch, int chunk_id, const ioremap::elliptics::data_pointer &index,
+		uint64_t offset, ioremap::elliptics::async_read_result read)
+{
+	auto data = std::make_shared<ioremap::elliptics::data_pointer>();
+
+	read.connect(
+		[data] (const ioremap::elliptics::read_result_entry &entry) {
+			if (!entry.error()) {
+				*data = entry.file();
+			}
+		},
+		[this, g, epoch, chunk_id, index, offset, data] (const ioremap::elliptics::error_info &error) {
+			chunk_data_loaded(g, epoch, chunk_id, [&index, offset, data, &error] (chunk *chunk) {
+				chunk->blocks_loaded(index, offset, *data, error);
+			});
+		}
+	);
+}
+
+void queue::chunk_data_loaded(consumer_group *g, int epoch, int chunk_id, const std::function<void (chunk *)> &load)
+{
+	std::lock_guard<std::mutex> guard(m_mutex);
+
+	g->reading_chunks.erase(chunk_id);
+
+	// chunk could be gone (or even be a different one after clear())
+	// while its data was being read
+	lane *l = lane_of(*g, chunk_id);
+	chunk *chunk = l ? l->chunks.find(chunk_id) : NULL;
+	if (epoch == m_epoch && chunk) {
+		load(chunk);
+	}
+
+	// This is an io thread: serving could compact chunks or move entries to dead letters,
+	// both read storage synchronously, so parked requests are handed to the timer thread
+	g->reading_done = true;
+	start_timer();
+	m_timer_cond.notify_one();
+}
+
+void queue::ack(const std::vector<entry_id> &ids, const std::string &group_name)
+{
+	std::vector<peek_request> completed;
+
+	{
+		std::lock_guard<std::mutex> guard(m_mutex);
+		consumer_group &g = group(group_name);
+
+		for (auto i = ids.begin(); i != ids.end(); ++i) {
+			const entry_id &id = *i;
+			ack_entry(g, id);
+		}
+
+		// entries released by acks go to whoever waits for entries
+		if (!g.released.empty() && hungry(g)) {
+			process_peeks(g, &completed);
+		}
+	}
+
+	complete_peeks(completed);
+}
+
+void queue::touch(const std::vector<entry_id> &ids, const std::string &group_name)
+{
+	std::lock_guard<std::mutex> guard(m_mutex);
+	consumer_group &g = group(group_name);
+
+	for (auto i = ids.begin(); i != ids.end(); ++i) {
+		const entry_id &id = *i;
+		touch_entry(g, id);
+	}
+}
+
+void queue::reply(const ioremap::elliptics::exec_context &context,
+		const ioremap::elliptics::data_pointer &d, ioremap::elliptics::exec_context::final_state state)
+{
+	m_client.create_session().reply(context, d, state);
+}
+
+void queue::final(const ioremap::elliptics::exec_context &context, const ioremap::elliptics::data_pointer &d)
+{
+	reply(context, d, ioremap::elliptics::exec_context::final);
+}
+
+const std::string &queue::queue_id() const
+{
+	return m_queue_id;
+}
+
+std::vector<std::string> queue::groups()
+{
+	std::vector<std::string> ret;
+	for (auto g = m_groups.begin(); g != m_groups.end(); ++g) {
+		ret.push_back((*g)->name);
+	}
+
+	return ret;
+}
+
+bool queue::has_group(const std::string &group)
+{
+	for (auto g = m_groups.begin(); g != m_groups.end(); ++g) {
+		if ((*g)->name == group) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+queue_state queue::state()
+{
+	std::lock_guard<std::mutex> guard(m_mutex);
+	return m_groups[0]->lanes[0]->state;
+}
+
+std::vector<lane_statistics> queue::lanes(const std::string &group_name)
+{
+	std::lock_guard<std::mutex> guard(m_mutex);
+	consumer_group &g = group(group_name);
+
+	std::vector<lane_statistics> ret;
+	for (auto it = g.lanes.begin(); it != g.lanes.end(); ++it) {
+		lane &l = **it;
+
+		lane_statistics st;
+		st.priority = l.priority;
+		st.weight = l.weight;
+		st.state = l.state;
+		st.depth = l.depth;
+		st.depth_bytes = l.depth_bytes;
+		st.in_flight = l.in_flight;
+		st.age = lane_age(l);
+
+		ret.push_back(st);
+	}
+
+	return ret;
+}
+
+queue_depth queue::depth(const std::string &group_name)
+{
+	std::lock_guard<std::mutex> guard(m_mutex);
+	consumer_group &g = group(group_name);
+
+	queue_depth depth;
+	for (auto it = g.lanes.begin(); it != g.lanes.end(); ++it) {
+		lane &l = **it;
+
+		depth.pending += l.depth;
+		depth.pending_bytes += l.depth_bytes;
+		depth.in_flight += l.in_flight;
+		depth.age = std::max(depth.age, lane_age(l));
+	}
+
+	return depth;
+}
+
+double queue::lane_age(const lane &l) const
+{
+	if (!l.depth && !l.in_flight) {
+		return 0;
+	}
+
+	// chunk-granular: the oldest entry is no older than its chunk
+	auto stored = m_stored_chunks.find(l.state.chunk_id_ack);
+	if (stored == m_stored_chunks.end()) {
+		return 0;
+	}
+
+	return std::max(0.0, unix_time() - stored->second.time);
+}
+
+void queue::count_chunk(lane &l, chunk *chunk, int sign)
+{
+	const chunk_meta &meta = chunk->meta();
+
+	l.depth += sign * (meta.high_mark() - meta.low_mark());
+	l.depth_bytes += sign * (int64_t)(meta.byte_offset(meta.high_mark()) - meta.byte_offset(meta.low_mark()));
+	l.in_flight += sign * (meta.low_mark() - meta.acked());
+}
+
+void queue::recount(lane &l)
+{
+	l.depth = l.depth_bytes = l.in_flight = 0;
+
+	for (int i = l.chunks.low(); i < l.chunks.high(); ++i) {
+		chunk *chunk = l.chunks.find(i);
+		if (chunk) {
+			count_chunk(l, chunk, 1);
+		}
+	}
+}
+
+queue_statistics queue::statistics()
+{
+	std::lock_guard<std::mutex> guard(m_mutex);
+	return m_statistics;
+}
+
+reclaim_stat queue::reclaim_statistics()
+{
+	return m_reclaimer->stat();
+}
+
+void queue::clear_counters()
+{
+	{
+		std::lock_guard<std::mutex> guard(m_mutex);
+		memset(&m_statistics, 0, sizeof(m_statistics));
+	}
+
+	std::lock_guard<std::mutex> guard(m_producer_mutex);
+	for (auto it = m_producers.begin(); it != m_producers.end(); ++it) {
+		it->second.push_count = 0;
+		it->second.limit_count = 0;
+		it->second.duplicate_count = 0;
+	}
 }
 
 }} // namespace ioremap::grape
\ No newline at end of file
@@ -2,6 +2,17 @@
 #define __QUEUE_HPP
 
 #include <map>
+#include <set>
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <functional>
+#include <climits>
+#include <exception>
 
 #include <msgpack.hpp>
 
@@ -12,12 +23,43 @@
 #include <grape/elliptics_client_state.hpp>
 #include <grape/data_array.hpp>
 #include <grape/entry_id.hpp>
+#include <grape/envelope.hpp>
 
 namespace ioremap { namespace grape {
 
+// NOTE: @state and @deliveries share space of what used to be a single int state,
+// so that metadata written before delivery counting existed is still readable.
+// Old state lands in @state only on little-endian hosts, which metadata is written by
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "chunk metadata layout requires little-endian byte order"
+#endif
 struct chunk_entry {
 	int		size;
-	int		state;
+	int16_t		state;
+	int16_t		deliveries;
+};
+static_assert(sizeof(chunk_entry) == 2 * sizeof(int), "chunk_entry must keep layout of the old metadata");
+
+// chunk_entry state flags, acking keeps the other ones,
+// so that acked entries could be delivered anew after seek
+enum {
+	ENTRY_ACKED = 1,
+	// entry data is prefixed with its ordering key, see queue::push()
+	ENTRY_KEYED = 2,
+	// entry data (past the key) is blob_ref to the payload stored on its own
+	ENTRY_BLOB = 4,
+};
+
+// entry on its way into a chunk
+struct pending_entry {
+	elliptics::data_pointer data;
+	int state;
+	// priority class, picks chunk sequence the entry goes to
+	int priority;
+
+	pending_entry() : state(0), priority(0) {}
+	pending_entry(const elliptics::data_pointer &data, int state, int priority = 0)
+		: data(data), state(state), priority(priority) {}
 };
 
 struct chunk_disk {
@@ -34,14 +76,17 @@ class chunk_meta {
 
 		chunk_meta(int max);
 
-		// Increases high mark.
+		// Increases high mark, new entry inherits @deliveries count.
 		// Returns true when given chunk is full
-		bool push(int size);
+		bool push(int size, int deliveries, int state = 0);
 		// Increases low mark
 		void pop();
 		// Marks entry at @pos position with @state state.
 		// Returns true when given chunk is fully acked
 		bool ack(int32_t pos, int state);
+		// Counts delivery attempt of entry at @pos position.
+		// Returns number of times entry was delivered so far
+		int deliver(int32_t pos);
 
 		std::string &data();
 		void assign(char *data, size_t size);
@@ -49,6 +94,8 @@ class chunk_meta {
 		int low_mark() const;
 		int high_mark() const;
 		int acked() const;
+		// number of entries chunk could still take
+		int space() const;
 
 		bool full() const;
 		bool exhausted() const;
@@ -60,6 +107,11 @@ class chunk_meta {
 	private:
 		std::string m_data;
 		struct chunk_disk *m_ptr;
+		// byte offsets of entries up to the high mark inclusive,
+		// so that byte_offset() does not walk entries
+		std::vector<uint64_t> m_offsets;
+
+		void index_offsets();
 };
 
 struct iteration {
@@ -123,7 +175,7 @@ struct replay_iterator : public iterator {
 		state.byte_offset += size;
 	}
 	void skip_acked() {
-		while (meta[state.entry_index].state == 1) {
+		while (meta[state.entry_index].state & ENTRY_ACKED) {
 			step();
 			if (at_end()) {
 				break;
@@ -157,28 +209,176 @@ struct chunk_stat {
 	uint64_t ack;
 };
 
+struct reclaim_stat {
+	uint64_t queued;
+	uint64_t removed;
+	uint64_t retried;
+	uint64_t failed;
+	uint64_t in_flight;
+	uint64_t pending;
+};
+
+// Removes keys of completed chunks in background, so that acking doesn't have to wait for storage.
+// Failed removes are retried by a thread of its own after a growing delay.
+// Completion callbacks are called from elliptics io threads, hence the locking.
+// Destructor waits for removes in flight.
+class reclaimer {
+	public:
+		ELLIPTICS_DISABLE_COPY(reclaimer);
+
+		// @concurrency limits number of removes being in flight at once
+		reclaimer(const elliptics::session &session, int concurrency);
+		~reclaimer();
+
+		void enqueue(const elliptics::key &key);
+		// Waits till every key enqueued so far is either removed or given up on,
+		// keys are reused once they are drained
+		void drain();
+
+		reclaim_stat stat();
+
+	private:
+		struct item {
+			elliptics::key key;
+			int attempts;
+		};
+
+		elliptics::session m_session;
+		const int m_concurrency;
+
+		std::mutex m_mutex;
+		std::deque<item> m_pending;
+		// failed removes by the time of their next attempt
+		std::multimap<std::chrono::steady_clock::time_point, item> m_retries;
+		int m_in_flight;
+		reclaim_stat m_stat;
+		// wakes both the retry thread and drain()
+		std::condition_variable m_cond;
+		std::thread m_retry_thread;
+		bool m_stopping;
+
+		// sends next batch of removes if concurrency limit allows
+		void kick();
+		// takes removes to send under the lock
+		std::vector<item> take_batch();
+		void send(const std::vector<item> &batch);
+		void complete(item it, const elliptics::error_info &error);
+		void run_retries();
+};
+
+// Data of a sealed (filled) chunk could be rewritten packed: raw data is cut into
+// blocks of @block_size bytes and every block is deflated on its own, so that reader
+// inflates only blocks it needs. Packed data is this header followed by compressed
+// size (uint32_t) of every block and by the blocks themselves.
+// Data is never told packed by its content: size of packed data is recorded
+// in the time index before it's written, see chunk_time_disk
+struct packed_header {
+	uint64_t magic;
+	uint64_t raw_size;
+	uint32_t block_size;
+	uint32_t blocks;
+};
+
+elliptics::data_pointer pack_data(const elliptics::data_pointer &raw, uint32_t block_size);
+// Returns raw bytes from the start of the block holding @offset up to the end,
+// @offset is moved to the start of that block. Throws on data which is not
+// well-formed packed data of @raw_size bytes
+std::string unpack_data(const elliptics::data_pointer &d, uint64_t raw_size, uint64_t *offset);
+
+// Packed data could also be read in two ranges: the index (header and block sizes)
+// of packed_index_size() bytes, and blocks from the one holding the wanted offset on.
+// Index written with a block size other than @block_size is longer (or shorter) than that
+uint64_t packed_index_size(uint64_t raw_size, uint32_t block_size);
+// Returns offset in packed data of the block holding @offset and moves @offset to the start
+// of that block. Throws on index which is not one of packed data of @raw_size bytes
+// packed into @packed_size bytes, or which is cut short
+uint64_t packed_block_offset(const elliptics::data_pointer &index, uint64_t raw_size,
+		uint64_t packed_size, uint64_t *offset);
+// Unpacks @blocks, packed data read from the offset given by packed_block_offset() on
+std::string unpack_blocks(const elliptics::data_pointer &index, const elliptics::data_pointer &blocks, uint64_t offset);
+
 class chunk {
 	public:
 		ELLIPTICS_DISABLE_COPY(chunk);
 
-		chunk(elliptics::session &session, const std::string &queue_id, int chunk_id, int max);
+		// Entries pushed through the chunk are kept in memory (up to @tail_limit bytes
+		// of them) and delivered from there, zero @tail_limit turns that off.
+		// Meta is kept under @meta_id prefix instead of @queue_id one if it's given,
+		// so that consumer groups could keep their own meta of the same chunk
+		chunk(elliptics::session &session, const std::string &queue_id, int chunk_id, int max,
+				uint64_t tail_limit = 0, const std::string &meta_id = std::string());
 		~chunk();
 
+		static std::string data_key(const std::string &queue_id, int chunk_id);
+		static std::string meta_key(const std::string &meta_id, int chunk_id);
+		// @index-th blob of the chunk, see queue::store_blobs()
+		static std::string blob_key(const std::string &queue_id, int chunk_id, int index);
+		// Keys of blobs written for delayed entries which ended up in the chunk,
+		// they are removed along with its data, see queue::adopt_blobs()
+		static std::string adopted_key(const std::string &queue_id, int chunk_id);
+
+		// Meta could be read asynchronously with read_meta() and applied later
 		void load_meta();
+		void load_meta(elliptics::async_read_result result);
+		elliptics::async_read_result read_meta();
 		const chunk_meta &meta();
 
+		// Data must be loaded (or reloaded) before pop() if needs_data() says so:
+		// read is issued by read_data() and its result is given to data_loaded()
+		bool needs_data() const;
+		elliptics::async_read_result read_data();
+		// @size bytes of data from @offset, zero @size reads up to the end
+		elliptics::async_read_result read_data(uint64_t offset, uint64_t size);
+		// Data of @packed_size bytes is packed data, see packed_header; the size is
+		// taken from the time index when the read completes. Zero means data is raw
+		void data_loaded(const elliptics::data_pointer &d, const elliptics::error_info &error,
+				uint64_t packed_size = 0);
+		// Packed data read in ranges, see packed_block_offset(): @blocks
+		// from the block starting at raw @offset on
+		void blocks_loaded(const elliptics::data_pointer &index, uint64_t offset,
+				const elliptics::data_pointer &blocks, const elliptics::error_info &error);
+		// byte offset of the next entry to pop, data read for pop() is wanted from there on
+		uint64_t next_offset() const;
+
 		// single entry methods
-		bool push(const elliptics::data_pointer &d); // returns true if chunk is full
-		elliptics::data_pointer pop(int32_t *pos);
-		bool ack(int32_t pos);
+		bool push(const elliptics::data_pointer &d, int deliveries = 0, int state = 0); // returns true if chunk is full
+		// Meta is not written if @write is false, caller writes it with write_meta() afterwards
+		bool ack(int32_t pos, bool write = true);
+		// Counts delivery attempt of the entry, pop() does not count them,
+		// as entries it gives could be held back (waiting for their keys)
+		void deliver(int32_t pos);
+
+		// Push split in two halves: append() only sends entry data to storage
+		// and could be called concurrently with other methods,
+		// commit() accounts appended entries in meta (and data cache) afterwards.
+		elliptics::async_write_result append(const elliptics::data_pointer &d);
+		bool commit(const std::vector<pending_entry> &entries, int deliveries); // returns true if chunk is full
 
 		// multiple entries methods
-		data_array pop(int num);
+		// Total size of popped entries is kept within @max_bytes (zero means no limit),
+		// first entry is given regardless of its size if @oversized_first is set
+		data_array pop(int num, uint64_t max_bytes = 0, bool oversized_first = true);
+
+		// All popped but still unacked entries. Their data must be loaded first
+		// if needs_unacked_data() says so: read is issued by read_data(),
+		// its result is given to unacked_loaded() (which returns false on error)
+		bool needs_unacked_data() const;
+		bool unacked_loaded(const elliptics::data_pointer &d, const elliptics::error_info &error,
+				uint64_t packed_size = 0);
+		data_array unacked();
 
 		void reset_iteration();
 		bool expect_no_more();
 
-		void remove();
+		// Takes entries (their sizes and flags) of @meta, entries before @pos
+		// as delivered and acked and the rest as yet to be delivered.
+		// Must be called on a chunk which has no entries yet
+		void rewind(const chunk_meta &meta, int pos);
+
+		void remove(reclaimer &reclaimer);
+		// removes meta only, data is shared by consumer groups
+		void remove_meta(reclaimer &reclaimer);
+		elliptics::async_write_result write_meta();
 
 		struct chunk_stat stat(void);
 		void add(struct chunk_stat *st);
@@ -193,37 +393,354 @@ class chunk {
 		elliptics::key m_meta_key;
 		elliptics::session m_session_data;
 		elliptics::session m_session_meta;
+		// used by append() only
+		elliptics::session m_session_append;
 
 		struct chunk_stat m_stat;
 
 		iteration iteration_state;
 		std::unique_ptr<iterator> iter;
 
-		// whole chunk data is cached here
-		// cache is being filled when ::pop is invoked and @m_pop_offset is >= than cache size
-		elliptics::data_pointer m_data;
+		// Chunk data is cached here: bytes from @m_data_offset up to @m_data_offset + m_data.size().
+		// Cache is filled by data read, and it's also extended by pushes while it
+		// reaches the end of the chunk (@m_data_size bytes which meta accounts for)
+		std::string m_data;
+		uint64_t m_data_offset;
+		uint64_t m_data_size;
+		const uint64_t m_tail_limit;
+		// data was just (re)loaded and must be popped from before next reload
+		bool m_data_fresh;
 
 		chunk_meta m_meta;
 
 		double m_fire_time;
 
-		void write_meta();
 		void reset_iteration_mode();
-		void prepare_iteration();
+		// Drops delivered entries from the cache when it grows over the limit
+		void trim_data();
+		// Puts @data read from byte @offset into the cache
+		void cache_loaded(std::string &data, uint64_t offset);
 };
 
 typedef std::shared_ptr<chunk> shared_chunk;
 
+// Bounded lock-free ring with many producers and a single consumer.
+// Every enqueued item gets a ticket (its sequence number),
+// consumer takes items out in ticket order.
+template <class T>
+class submission_ring {
+	public:
+		ELLIPTICS_DISABLE_COPY(submission_ring);
+
+		// @capacity must be a power of two
+		submission_ring(size_t capacity)
+			: m_cells(new cell[capacity])
+			, m_mask(capacity - 1)
+			, m_tail(0)
+			, m_head(0)
+		{
+			for (size_t i = 0; i < capacity; ++i) {
+				m_cells[i].seq.store(i, std::memory_order_relaxed);
+			}
+		}
+
+		// Returns false if ring is full
+		bool enqueue(const T &item, uint64_t *ticket) {
+			uint64_t pos = m_tail.load(std::memory_order_relaxed);
+			cell *c;
+
+			while (true) {
+				c = &m_cells[pos & m_mask];
+				int64_t diff = (int64_t)c->seq.load(std::memory_order_acquire) - (int64_t)pos;
+				if (diff == 0) {
+					if (m_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+						break;
+					}
+				} else if (diff < 0) {
+					return false;
+				} else {
+					pos = m_tail.load(std::memory_order_relaxed);
+				}
+			}
+
+			c->item = item;
+			c->seq.store(pos + 1, std::memory_order_release);
+
+			*ticket = pos;
+			return true;
+		}
+
+		// Consumer side. Returns false if ring is empty or if the next
+		// item is still being written by its producer.
+		bool dequeue(T *item) {
+			cell &c = m_cells[m_head & m_mask];
+			if (c.seq.load(std::memory_order_acquire) != m_head + 1) {
+				return false;
+			}
+
+			*item = std::move(c.item);
+			c.item = T();
+			c.seq.store(m_head + m_mask + 1, std::memory_order_release);
+
+			++m_head;
+			return true;
+		}
+
+		// Consumer side. Ticket of the next item to be dequeued
+		uint64_t head() const {
+			return m_head;
+		}
+
+	private:
+		struct cell {
+			std::atomic<uint64_t> seq;
+			T item;
+		};
+
+		std::unique_ptr<cell[]> m_cells;
+		const size_t m_mask;
+		std::atomic<uint64_t> m_tail;
+		uint64_t m_head;
+};
+
+// Active chunks of the queue.
+// Chunk ids are dense and increasing, so chunks are kept in a ring
+// indexed by chunk id, spanning range from the lowest to the highest active chunk.
+// Every slot carries flags telling which lines its chunk belongs to,
+// chunk is dropped when its last flag is cleared.
+class chunk_window {
+	public:
+		ELLIPTICS_DISABLE_COPY(chunk_window);
+
+		enum slot_flag {
+			POPPABLE = 1,		// chunk is in the popping line
+			WAITING_ACK = 2,	// chunk has delivered entries waiting for ack
+		};
+
+		chunk_window();
+
+		// Returns NULL if window holds no chunk with @chunk_id
+		chunk *find(int chunk_id) const;
+		// Takes ownership of the chunk, @flags must not be empty
+		chunk *insert(int chunk_id, std::unique_ptr<chunk> c, int flags);
+
+		bool test(int chunk_id, int flag) const;
+		void set(int chunk_id, int flag);
+		// Chunk left without flags is dropped from the window
+		void clear(int chunk_id, int flag);
+
+		// Lowest id of the chunk with @flag set, -1 if there is none
+		int first(int flag);
+		// Next after @chunk_id id of the chunk with @flag set, -1 if there is none
+		int next(int chunk_id, int flag) const;
+
+		size_t count(int flag) const;
+		bool empty() const;
+		int low() const;
+		int high() const;
+
+		// Drops all chunks
+		void reset();
+
+	private:
+		struct slot {
+			std::unique_ptr<chunk> ptr;
+			int flags;
+
+			slot() : flags(0) {}
+		};
+
+		// capacity is always a power of two
+		std::vector<slot> m_slots;
+		// window covers [m_low, m_high) chunk ids
+		int m_low;
+		int m_high;
+
+		// per flag: there is no chunk with the flag below the cursor
+		int m_first[2];
+		size_t m_count[2];
+
+		static int flag_index(int flag);
+
+		slot &at(int chunk_id);
+		const slot &at(int chunk_id) const;
+
+		void reserve(int chunk_id);
+		void trim();
+};
+
 struct queue_state {
 	int chunk_id_push;
 	int chunk_id_ack;
 };
 
+// Chunk ids of priority class @n start at n * LANE_CHUNK_SPAN, so that entry id
+// tells the class of the entry and class 0 is laid out exactly as a queue without classes
+const int LANE_CHUNK_SPAN = 1 << 24;
+
+// Priority class of the queue: its own chunk sequence with its own state
+struct lane {
+	ELLIPTICS_DISABLE_COPY(lane);
+
+	lane(int priority, int weight, bool last, const std::string &state_id)
+		: priority(priority), weight(weight), last(last), state_id(state_id)
+		, last_relaxed_chunk(-1), quota(0)
+		, depth(0), depth_bytes(0), in_flight(0)
+	{
+		state.chunk_id_push = state.chunk_id_ack = base();
+	}
+
+	int base() const {
+		return priority * LANE_CHUNK_SPAN;
+	}
+
+	// Chunk ids of the class are below this one. The highest class takes all ids
+	// past its base, so that queues which had a single class before are not limited
+	int end() const {
+		return last ? INT_MAX : base() + LANE_CHUNK_SPAN;
+	}
+
+	const int priority;
+	// number of entries class is given in its turn
+	const int weight;
+	// the highest class
+	const bool last;
+	const std::string state_id;
+
+	queue_state state;
+	chunk_window chunks;
+	// chunk served last in relaxed order mode
+	int last_relaxed_chunk;
+	// entries class could still be given in its current turn
+	int quota;
+
+	// Entries of chunks in the window not yet delivered (and their bytes)
+	// and delivered but not yet acked, kept up to date by queue::count_chunk()
+	int64_t depth;
+	int64_t depth_bytes;
+	int64_t in_flight;
+};
+
+// Delayed entries are kept in time buckets: bucket @bucket holds entries due within
+// ((bucket - 1) * width, bucket * width] seconds of unix time, its entries are stored
+// in chunk sequence "<queue_id>.delayed.<bucket>" of @chunks chunks.
+// Index of buckets is stored under "<queue_id>.delayed.state" as array of these.
+struct delay_bucket_disk {
+	int64_t bucket;
+	int chunks;
+	// chunks of the due bucket already pushed into their classes (and removed)
+	int promoted;
+};
+
+// Time index: creation time and size of every chunk which data is still stored,
+// it's kept under "<queue_id>.time-index" as array of these
+struct chunk_time_disk {
+	int chunk_id;
+	// number of blobs written for entries of the chunk
+	int blobs;
+	double time;
+	// bytes of chunk entries, known once chunk is filled
+	uint64_t size;
+	// Bytes of packed data, zero while data is raw. It's recorded before packed data
+	// is written and packed data is always smaller, so data read of this size is
+	// packed and data of @size bytes is raw, whichever write made it to storage
+	uint64_t packed_size;
+	// number of blob keys kept under chunk::adopted_key()
+	int adopted;
+};
+
+struct stored_chunk {
+	double time;
+	uint64_t size;
+	int blobs;
+	uint64_t packed_size;
+	std::vector<std::string> adopted;
+};
+
+struct lane_statistics {
+	int priority;
+	int weight;
+	queue_state state;
+	// entries not yet delivered (and their bytes) and entries delivered but not yet acked
+	uint64_t depth;
+	uint64_t depth_bytes;
+	uint64_t in_flight;
+	// seconds since the lowest chunk of the class was created, zero when it's empty
+	double age;
+};
+
+// Token bucket of a producer: it's refilled at @rate tokens a second up to @burst,
+// every push takes a token. Zero rate means no limit
+struct producer_bucket {
+	double rate;
+	double burst;
+	double tokens;
+	double last_refill;
+
+	uint64_t push_count;
+	// pushes refused for lack of tokens
+	uint64_t limit_count;
+	// pushes dropped as duplicates
+	uint64_t duplicate_count;
+
+	// unix time of the last push, the least recent producer is forgotten first
+	double last_push;
+};
+
+struct producer_statistics {
+	std::string name;
+	uint64_t push_count;
+	uint64_t limit_count;
+	uint64_t duplicate_count;
+};
+
+// Sequence numbers of a producer taken by the queue: the highest one
+// and a window of the ones right below it, bit n of @window is for @high - n.
+// Sequence numbers below the window are stale: whether they were taken is not known
+struct producer_sequence {
+	static const uint64_t WINDOW = 64;
+
+	uint64_t high;
+	uint64_t window;
+	// unix time of the last push, the least recent producer is forgotten first
+	double last_push;
+
+	producer_sequence() : high(0), window(0), last_push(0) {}
+
+	// Returns false if @sequence is taken already or is stale
+	bool mark(uint64_t sequence);
+	bool stale(uint64_t sequence) const;
+	void unmark(uint64_t sequence);
+
+	MSGPACK_DEFINE(high, window, last_push);
+};
+
 struct queue_statistics {
 	uint64_t push_count;
 	uint64_t pop_count;
 	uint64_t ack_count;
+	uint64_t touch_count;
 	uint64_t timeout_count;
+	uint64_t dead_letter_count;
+	uint64_t dead_letter_bytes;
+	uint64_t compact_count;
+	uint64_t relocate_count;
+	uint64_t delay_count;
+	uint64_t promote_count;
+	// chunks dropped by max-age and max-bytes limits, along with
+	// their entries not yet acked (counted for every group) and their bytes
+	uint64_t expire_chunks;
+	uint64_t expire_entries;
+	uint64_t expire_bytes;
+	// pushes asked to back off
+	uint64_t throttle_count;
+	// entries stored out of line and their payload bytes
+	uint64_t blob_count;
+	uint64_t blob_bytes;
+	// chunks packed, their raw and packed bytes
+	uint64_t pack_count;
+	uint64_t pack_raw_bytes;
+	uint64_t pack_bytes;
 
 	uint64_t state_write_count;
 
@@ -231,24 +748,184 @@ struct queue_statistics {
 	chunk_stat chunks_pushed;
 };
 
+typedef std::function<void (const data_array &)> peek_handler;
+// called once subscription is dropped by the queue
+typedef std::function<void ()> expire_handler;
+
+struct peek_request {
+	int num;
+	// limit on total size of entries, zero means no limit
+	uint64_t max_bytes;
+	// request which got nothing is kept waiting for pushes till the deadline,
+	// zero deadline means no waiting
+	std::chrono::steady_clock::time_point deadline;
+	data_array result;
+	// entries moved to the dead-letter line while serving the request
+	std::vector<entry_id> dead;
+	peek_handler handler;
+
+	peek_request() : num(0), max_bytes(0) {}
+};
+
+// Consumer which is given entries as they come, as long as it has credits
+struct subscription {
+	int credit_entries;
+	// bytes are counted only for subscribers which grant them
+	uint64_t credit_bytes;
+	bool count_bytes;
+	// unix time subscription ran out of credit at, zero while it has some,
+	// subscription which gets no credit for the lease time is expired
+	double starved_since;
+	peek_handler handler;
+	expire_handler expired;
+};
+
+// Consumer group: its own delivery and ack state over the chunks of the queue.
+// Chunk data is shared by all groups, every group keeps its own chunk meta and
+// queue state under @id prefix: queue id for the default group (which has empty name),
+// "<queue_id>.group.<name>" for the others.
+struct consumer_group {
+	ELLIPTICS_DISABLE_COPY(consumer_group);
+
+	consumer_group(const std::string &name, const std::string &id)
+		: name(name), id(id), lane_turn(0), last_served_subscription(-1), reading_done(false)
+		, last_timeout_check_time(0)
+	{}
+
+	const std::string name;
+	const std::string id;
+
+	// priority classes in ascending order, served in turns from the highest one,
+	// @lane_turn is the class whose turn it is
+	std::vector<std::unique_ptr<lane>> lanes;
+	size_t lane_turn;
+
+	// peek requests served strictly in order of arrival,
+	// front one could be waiting for chunk data read
+	std::deque<peek_request> peeks;
+	// requests which got nothing and wait for pushes,
+	// they are older than any request in @peeks
+	std::deque<peek_request> waiters;
+	// subscriptions are served after requests, in turns
+	std::map<int, subscription> subscriptions;
+	int last_served_subscription;
+	// chunks which data is being read, at most one per class in strict order mode
+	std::set<int> reading_chunks;
+	// Timed out chunks which data of unacked entries is being read for compaction,
+	// they are left waiting for acks meanwhile. Failed read makes the chunk replayed
+	std::set<int> compact_reads;
+	std::set<int> compact_failed;
+	// Compacted chunks which relocated entries are being written,
+	// chunk is dropped once all of them are stored
+	std::set<int> compact_writes;
+	// some read completed since, parked requests are to be served by the timer thread
+	bool reading_done;
+	double last_timeout_check_time;
+
+	// ids of entries relocated from compacted chunks to their new ids, by compacted chunk
+	// and position, so that late acks of the original ids would not be lost.
+	// @remapped_to lists compacted chunks which entries went to the chunk,
+	// so that remapping could be dropped along with either of the two chunks
+	std::map<int, std::map<int, entry_id>> remap;
+	std::map<int, std::set<int>> remapped_to;
+
+	// Keyed entries: key is owned by its entry in flight till that entry is acked,
+	// entries popped meanwhile wait for the key in the backlog and are released
+	// one by one. Kept only in memory: after restart unacked entries are replayed
+	// in order and claim their keys anew.
+	struct keyed_entry {
+		entry_id id;
+		std::string data;
+		// data_array flags
+		int flags;
+	};
+	std::map<std::string, entry_id> key_owners;
+	std::map<entry_id, std::string> owned_keys;
+	std::map<std::string, std::deque<keyed_entry>> key_backlog;
+	// keys of the entries in the backlog by their ids, its size is the size of the backlog
+	std::map<entry_id, std::string> waiting;
+	// released entries are given away before anything else, in order of their ids
+	std::map<entry_id, keyed_entry> released;
+};
+
+// Queue never blocks on storage reads: peek requests which need chunk data
+// to be read are parked until the read completes, other methods are served meanwhile.
+// Peek handlers are called outside of the queue locks,
+// either right from the peek() or later from the timer thread. Io threads of elliptics
+// only mark chunk data loaded and never wait for storage themselves.
+//
+// All methods could be called from any number of threads.
+// Push path runs under its own lock: pushes are submitted into a lock-free ring
+// and whoever gets the push lock sends all submitted entries to storage in one batch,
+// so pushes coming from many threads at once (see dispatch-threads in README) share writes.
+// Submitter which finds entries before its own still being written into the ring
+// waits on the push condition variable instead of spinning.
+// Delivery and ack paths share chunks' lifetime and run under the queue lock,
+// which push path takes only briefly to account sent entries.
+// Lock order is push lock, then queue lock.
+//
+// Consumer methods take name of the consumer group to act for, empty name stands
+// for the default group. Groups are set up at initialization, see README.
 class queue {
 	public:
 		ELLIPTICS_DISABLE_COPY(queue);
 
 		queue(const std::string &queue_id);
+		~queue();
 
 		void initialize(const std::string &config);
 
 		// single entry methods
-		void push(const elliptics::data_pointer &d);
-		elliptics::data_pointer peek(entry_id *entry_id);
+		// Entries pushed with the same non-empty @key are never in flight to two consumers
+		// at once and are given away in order of push (within a chunk in relaxed order mode),
+		// entries of different keys go out in parallel
+		// Entries of higher priority class are given away first, see lane weights in README
+		// Entry pushed with @not_before (unix time in seconds) in the future is put off
+		// till that moment, it's given away no earlier and up to delay bucket width later
+		// Entry of the @producer with non-zero @sequence is pushed only once,
+		// returns false when it's dropped as a duplicate. Sequence number older than
+		// the window of the producer is refused with -ESTALE
+		bool push(const elliptics::data_pointer &d, const std::string &key = std::string(), int priority = 0,
+				double not_before = 0, const std::string &producer = std::string(), uint64_t sequence = 0);
+		// Seconds producer is asked to wait before pushing again while the queue is
+		// over its high watermarks (see README), zero when pushes are welcome.
+		// push() itself never refuses entries, it's up to the caller to ask
+		double throttle();
+		// Takes a token of the producer, returns seconds till the producer
+		// gets one when it's out of them, zero when push is let through
+		double admit(const std::string &producer);
 		void ack(const entry_id id);
-		elliptics::data_pointer pop();
+		void touch(const entry_id id);
 
 		// multiple entries methods
-		data_array peek(int num);
-		void ack(const std::vector<entry_id> &ids);
-		data_array pop(int num);
+		// Total size of peeked entries is kept within @max_bytes (zero means no limit).
+		// Queue having no entries to give away holds request up to @max_wait seconds,
+		// replying as soon as pushed entries come in
+		void peek(int num, uint64_t max_bytes, double max_wait, peek_handler handler,
+				const std::string &group = std::string());
+		void ack(const std::vector<entry_id> &ids, const std::string &group = std::string());
+		void touch(const std::vector<entry_id> &ids, const std::string &group = std::string());
+		// peek with immediate ack of all peeked entries
+		void pop(int num, uint64_t max_bytes, double max_wait, peek_handler handler,
+				const std::string &group = std::string());
+
+		// Subscriber is given entries through @handler whenever it has credits,
+		// subscription starts with no credits. Subscription left without credit for
+		// the lease time is dropped, @expired is called then (never after unsubscribe).
+		// Returns subscription id, ids are unique across groups
+		int subscribe(peek_handler handler, expire_handler expired, const std::string &group = std::string());
+		// Adds credits to the subscription, @bytes turns on counting of bytes
+		// for the subscription. Returns false if there is no such subscription
+		bool grant(int subscription_id, int entries, uint64_t bytes);
+		bool unsubscribe(int subscription_id);
+
+		// Resets delivery of the group to the entry: entries before it (within its class)
+		// are taken as acked and everything from it on is delivered anew.
+		// Entry must be still stored, see retention in README
+		void seek(const entry_id id, const std::string &group = std::string());
+		// Seeks every class of the group to the first chunk which could hold
+		// entries pushed after @time (unix time in seconds)
+		void seek(double time, const std::string &group = std::string());
 
 		// content manipulation
 		void clear();
@@ -259,30 +936,326 @@ class queue {
 		void final(const ioremap::elliptics::exec_context &context, const ioremap::elliptics::data_pointer &d);
 
 		const std::string &queue_id() const;
-		const queue_state &state();
-		const queue_statistics &statistics();
+		// names of consumer groups, the default one goes first
+		std::vector<std::string> groups();
+		bool has_group(const std::string &group);
+		// state of priority class 0 of the default group
+		queue_state state();
+		std::vector<lane_statistics> lanes(const std::string &group = std::string());
+		// backlog of the group over all classes, it's counted as entries come and go
+		queue_depth depth(const std::string &group = std::string());
+		queue_statistics statistics();
+		std::vector<producer_statistics> producers();
+		// how many producers the queue keeps track of, see max-producers in README
+		size_t max_producers() const;
+		// number of threads the app serves requests of the queue with, see dispatch-threads in README
+		int dispatch_threads() const;
+		reclaim_stat reclaim_statistics();
 		void clear_counters();
 
 	private:
 		int m_chunk_max;
+		double m_ack_timeout;
+		int m_max_deliveries;
+		// group which has this many entries waiting for their keys pops no more of them
+		int m_max_key_backlog;
+		int m_compact_max_unacked;
+		uint64_t m_hot_tail_size;
+		// number of chunks at the head of the popping line served at once,
+		// 0 or 1 means strict order of entries across chunks
+		int m_relaxed_order_chunks;
 
 		std::string m_queue_id;
-		std::string m_queue_state_id;
 
 		elliptics_client_state m_client;
+		std::shared_ptr<reclaimer> m_reclaimer;
+
+		// delivery and ack paths
+		std::mutex m_mutex;
+
+		// the default group goes first, groups never change after initialization
+		std::vector<std::unique_ptr<consumer_group>> m_groups;
+		// per class: all groups are done with chunks below this one,
+		// it follows the lowest chunk_id_ack over all groups
+		std::vector<int> m_data_low;
+		// chunks all groups are done with are kept for @m_retention_time seconds
+		// since the creation of the next chunk, zero means they are removed right away
+		double m_retention_time;
+		// see chunk_time_disk, has every chunk which data is stored
+		std::map<int, stored_chunk> m_stored_chunks;
+		// chunks older than @m_max_age seconds and the oldest chunks past @m_max_bytes
+		// of stored data are dropped whole, undelivered entries included; zero means no limit
+		double m_max_age;
+		uint64_t m_max_bytes;
+		// payloads of entries larger than this are stored as objects of their own,
+		// chunks keep references to them; zero turns that off
+		uint64_t m_blob_threshold;
+		// Filled chunks are packed by their own thread in blocks of this many bytes, see packed_header;
+		// zero turns packing off. Chunk is packed once it's been filled for @m_pack_delay seconds,
+		// when its consumers are likely done with it, or right away once all groups are past it.
+		// Chunk being packed has its data removal held back till packed data is written.
+		// Pack lock is held while a chunk is packed, so that clear() never reuses its id meanwhile;
+		// it goes before all other locks
+		uint32_t m_pack_block_size;
+		double m_pack_delay;
+		std::mutex m_pack_mutex;
+		// sealed chunks yet to be packed and unix time each is due to be packed at
+		std::map<int, double> m_sealed;
+		int m_packing;
+		bool m_packing_removed;
+		std::thread m_pack_thread;
+		std::condition_variable m_pack_cond;
+
+		// push path: entries submitted but not yet sent,
+		// @m_push_done is the ticket of the first not yet sent entry.
+		// Tickets which failed to be sent keep their error here till their submitter
+		// picks it up, guarded by the push lock
+		std::mutex m_push_mutex;
+		// signalled when an entry is in the ring and when a batch is done with
+		std::condition_variable m_push_cond;
+		submission_ring<pending_entry> m_push_ring;
+		uint64_t m_push_done;
+		std::map<uint64_t, std::exception_ptr> m_push_failed;
+		// chunk appends and blob writes sent to storage and not completed yet,
+		// counted by track_write()
+		std::atomic<int> m_push_writes;
+
+		int m_dispatch_threads;
+
+		// Backpressure: producers are throttled once backlog of the slowest group or
+		// number of entry writes in flight reaches the high watermark, till all of them
+		// go down to the low ones. Zero high watermark turns the check off.
+		// Backlog is counted in filled chunks at chunk events, see update_backlog()
+		uint64_t m_high_entries, m_low_entries;
+		uint64_t m_high_bytes, m_low_bytes;
+		int m_high_writes, m_low_writes;
+		double m_throttle_retry;
+		std::atomic<bool> m_backlog_throttled;
+		std::atomic<bool> m_writes_throttled;
+
+		// Producer rate limits by producer name, "*" is for producers not listed.
+		// Buckets are created on the first push of a producer and guarded by their own lock.
+		// Tables below keep at most @m_max_producers producers each, the one
+		// which pushed least recently makes room for a new one
+		std::map<std::string, producer_bucket> m_producer_limits;
+		size_t m_max_producers;
+		std::mutex m_producer_mutex;
+		std::map<std::string, producer_bucket> m_producers;
+		// Sequence numbers of pushes in progress and done, only the latter are kept
+		// in storage under "<queue_id>.sequences". Guarded by the producer lock
+		std::map<std::string, producer_sequence> m_sequences;
+		std::map<std::string, producer_sequence> m_done_sequences;
+		// Unix time done sequence numbers are to be written at, zero if they are written already.
+		// They are written by the timer one write at a time, pushes done meanwhile
+		// are coalesced into the next write. Guarded by the queue lock
+		double m_sequences_due;
+
+		int m_next_subscription_id;
+		double m_subscription_lease;
+		// replies to waiting requests when their time is out, promotes due delayed entries
+		// and also checks timeouts while there are subscriptions
+		std::thread m_timer_thread;
+		std::condition_variable m_timer_cond;
+		bool m_stopping;
+		// changed by clear(), so that reads issued before it would be ignored
+		int m_epoch;
 
-		queue_state m_state;
 		queue_statistics m_statistics;
 
-		std::map<int, shared_chunk> m_chunks;
-		std::map<int, shared_chunk> m_wait_ack;
-		double m_last_timeout_check_time;
-
-		void write_state();
-
-		void update_chunk_timeout(int chunk_id, shared_chunk chunk);
-
-		void check_timeouts();
+		// number of priority classes, every group has them all
+		size_t m_lane_count;
+
+		// entries exceeded delivery limit are moved into a separate
+		// chunk sequence under "<queue_id>.dead-letter" name
+		std::string m_dead_letter_id;
+		queue_state m_dead_letter_state;
+		shared_chunk m_dead_letter;
+
+		// Delayed entries, see delay_bucket_disk. Buckets are guarded by their own lock,
+		// which is taken before the push lock: due bucket is pushed into the classes
+		// chunk by chunk by the timer, every chunk is removed once it's through.
+		// Promotion lock is held by the timer for the whole promotion (and by clear()),
+		// delay lock is taken only to look at the index, so that delayed pushes
+		// do not wait for bucket reads.
+		struct delay_bucket {
+			int chunks;
+			int promoted;
+			// chunk delayed entries are pushed to, reset when it's full
+			shared_chunk tail;
+
+			delay_bucket() : chunks(0), promoted(0) {}
+		};
+		double m_delay_bucket_width;
+		std::mutex m_promote_mutex;
+		std::mutex m_delay_mutex;
+		std::map<int64_t, delay_bucket> m_delayed;
+		// unix time the first bucket is due at, zero if there are no delayed entries,
+		// guarded by the queue lock as it's the timer who looks at it
+		double m_delay_due;
+
+		void write_state(lane &l);
+		void update_chunk_id_ack(lane &l);
+		// Removes data of chunks all groups are done with
+		void reclaim_data(int priority);
+		// Removes chunks which retention time is out
+		void expire_chunks();
+		// Removes data of the chunk along with its meta of every group
+		void remove_retained(int chunk_id);
+		// Removes data of the chunk along with its blobs, before it's erased from the time index
+		void remove_data(int chunk_id);
+		// Drops chunks past max-age and max-bytes limits
+		void truncate_chunks();
+		// Packs data of the sealed chunk, takes the pack and queue locks on its own
+		void pack_chunk(int chunk_id);
+		void start_packer();
+		void run_packer();
+		// There are chunks max-age and max-bytes limits could drop
+		bool truncating() const;
+		// Checks backlog against its watermarks
+		void update_backlog();
+		// Takes entries of the chunk out of counters of its class (@sign = -1) or puts them
+		// back (@sign = 1), every change of chunk meta in the window is wrapped in a pair of these
+		void count_chunk(lane &l, chunk *chunk, int sign);
+		// Counts entries of the class anew, after the window is rebuilt
+		void recount(lane &l);
+		double lane_age(const lane &l) const;
+		// Drops the lowest stored chunk of class @priority, moving every group past it
+		void drop_chunk(size_t priority, int chunk_id);
+		// Forgets keys, backlog and remapping of entries of the chunk
+		void forget_entries(consumer_group &g, int chunk_id);
+		// Forgets remapping of entries relocated from the chunk and to it
+		void forget_remap(consumer_group &g, int chunk_id);
+		// Takes the new id of the relocated entry out of the remapping
+		bool take_remapped(consumer_group &g, const entry_id id, entry_id *new_id);
+		// New id of the relocated entry, remapping is kept
+		bool remapped(const consumer_group &g, const entry_id id, entry_id *new_id) const;
+		// There are chunks all groups are done with, which are still kept
+		bool retaining() const;
+		elliptics::async_write_result write_time_index();
+		// see chunk_time_disk
+		uint64_t packed_size(int chunk_id) const;
+		// Records size of packed data of the chunk being packed and waits for the time index
+		// to be written, returns false if the chunk is removed meanwhile
+		bool record_packed(int chunk_id, uint64_t packed_size);
+		void seek_lane(consumer_group &g, lane &l, const entry_id id, std::vector<peek_request> *completed);
+		// Class chunk id belongs to, see lane::end()
+		size_t class_of(int chunk_id) const;
+		// Returns NULL if there is no class for the chunk
+		lane *lane_of(consumer_group &g, int chunk_id);
+		// Throws if there is no such group
+		consumer_group &group(const std::string &name);
+
+		// @write is false when caller writes meta of the chunk itself
+		void ack_entry(consumer_group &g, const entry_id id, bool write = true);
+		void touch_entry(consumer_group &g, const entry_id id);
+
+		// Serves parked requests of the group in order, moves completed ones to @completed
+		void process_peeks(consumer_group &g, std::vector<peek_request> *completed);
+		// Returns false if request has to wait for chunk data
+		bool serve(consumer_group &g, peek_request &req);
+		// Serve request with up to @limit entries of the class, @taken is increased
+		// by number of entries taken. Return false if request has to wait for chunk data
+		bool serve_lane(consumer_group &g, peek_request &req, lane &l, int limit, int *taken);
+		bool serve_relaxed(consumer_group &g, peek_request &req, lane &l, int limit, int *taken);
+		// Moves entries popped from the chunk into request result
+		void deliver(consumer_group &g, peek_request &req, int chunk_id, chunk *chunk, const data_array &d);
+		// Returns false if entry has to wait for its key
+		bool claim_key(consumer_group &g, const entry_id id, const std::string &key,
+				const char *data, size_t size, int flags);
+		void release_key(consumer_group &g, const entry_id id);
+		void serve_released(consumer_group &g, peek_request &req);
+		// Number of entries the group could pop before its key backlog is full
+		int key_backlog_room(const consumer_group &g) const;
+		void read_chunk_data(consumer_group &g, int chunk_id, chunk *chunk);
+		// Packed chunk data is read in two steps: index of its blocks, then the blocks
+		// from the one holding the next entry on. These are called from io threads,
+		// reads are connected outside of the queue lock
+		void read_packed_index(consumer_group *g, int epoch, int chunk_id, chunk *chunk, const stored_chunk &stored);
+		void packed_index_loaded(consumer_group *g, int epoch, int chunk_id, const elliptics::data_pointer &index,
+				uint64_t total_size, uint64_t packed_size, const elliptics::error_info &error);
+		void connect_data_read(consumer_group *g, int epoch, int chunk_id, elliptics::async_read_result read);
+		void connect_blocks_read(consumer_group *g, int epoch, int chunk_id, const elliptics::data_pointer &index,
+				uint64_t offset, elliptics::async_read_result read);
+		// Applies @load to the chunk unless it's gone meanwhile, hands parked requests to the timer
+		void chunk_data_loaded(consumer_group *g, int epoch, int chunk_id, const std::function<void (chunk *)> &load);
+		static void complete_peeks(std::vector<peek_request> &completed);
+		void serve_subscriptions(consumer_group &g, std::vector<peek_request> *completed);
+		// Drops subscriptions which got no credit for the lease time,
+		// their expire handlers are to be called outside of the queue lock
+		void expire_subscriptions(consumer_group &g, std::vector<expire_handler> *expired);
+		// Something in the group is waiting for pushed entries
+		bool hungry(const consumer_group &g) const;
+		void start_timer();
+		void run_timer();
+
+		// Sends submitted entries to storage, push lock must be held.
+		// Returns false if there was nothing to send
+		bool drain_pushes(std::vector<peek_request> *completed);
+		// @sent is increased by number of entries committed, they go in order,
+		// so entries past it are the ones which failed when this throws
+		void send_entries(int priority, const std::vector<pending_entry> &entries, size_t *sent,
+				std::vector<peek_request> *completed);
+		bool oversized(const pending_entry &entry) const;
+		// Writes payloads of oversized entries as blobs @blob, @blob + 1, ... of the chunk
+		// and replaces them with references, push lock must be held. Returns payload bytes written
+		uint64_t store_blobs(int chunk_id, int blob, std::vector<pending_entry> *entries);
+		// Blobs of promoted delayed entries are written before the entries get a chunk,
+		// they are handed over to the chunk and removed along with its data.
+		// Push lock must be held, takes the queue lock on its own
+		void adopt_blobs(int chunk_id, const std::vector<pending_entry> &entries);
+		// Counts @write in m_push_writes till it completes
+		void track_write(elliptics::async_write_result write);
+		// Both locks must be held, append of the entry is added to @writes
+		entry_id push_entry(consumer_group &g, lane &l, const elliptics::data_pointer &d, int deliveries,
+				std::vector<elliptics::async_write_result> *writes);
+		// Queue lock must be held
+		chunk *push_chunk(consumer_group &g, lane &l);
+		void commit_entries(lane &l, chunk *chunk, const std::vector<pending_entry> &entries, int deliveries);
+		enum compaction {
+			COMPACT_SKIPPED = 0,
+			// chunk waits for data of its unacked entries to be read
+			// or for its relocated entries to be written
+			COMPACT_PENDING,
+		};
+		compaction compact(consumer_group &g, lane &l, int chunk_id, chunk *chunk);
+		void read_unacked_data(consumer_group &g, int chunk_id, chunk *chunk);
+		// Called from io thread once all relocated entries of the chunk are written,
+		// drops the compacted chunk or gives it back to replay if any write failed
+		void relocation_written(consumer_group *g, int epoch, int chunk_id, bool failed);
+		void submit(const elliptics::data_pointer &d, const std::string &key, int priority, double not_before);
+		// Bucket of the producer, created with its limits on first use, producer lock must be held
+		producer_bucket &bucket(const std::string &producer);
+		producer_sequence &sequence(std::map<std::string, producer_sequence> &table, const std::string &producer);
+		// Groups entries by class and sends them, push lock must be held.
+		// Error of every entry which failed to be sent is put at its index in @failed,
+		// a failed class does not hold up the others
+		void send_batch(const std::vector<pending_entry> &batch, std::vector<std::exception_ptr> *failed,
+				std::vector<peek_request> *completed);
+
+		// Delay lock must be held for all of these
+		// Payload larger than blob threshold is written as a blob of the bucket chunk
+		// and the chunk keeps only the reference to it
+		void delay_entry(push_request req);
+		void write_delay_state();
+		void write_sequences();
+		std::string delay_bucket_id(int64_t bucket) const;
+		// Reads entries of bucket chunk @c which are not promoted yet (not acked in its meta),
+		// their positions go to @positions; returns false on storage error.
+		// Takes no locks, promotion lock is held by the caller
+		bool read_delay_chunk(chunk &c, std::vector<pending_entry> *entries, std::vector<int32_t> *positions);
+		// Sends entries of due buckets to their classes, takes all locks by itself
+		void promote_delayed();
+
+		bool undeliverable(chunk *chunk, int32_t pos);
+		void dead_letter(const entry_id id, const elliptics::data_pointer &d);
+		// Acks entries moved to the dead-letter line while serving a request
+		// and writes meta of the chunks involved, once per chunk
+		void flush_dead_letters(consumer_group &g, std::vector<entry_id> &dead);
+
+		void update_chunk_timeout(consumer_group &g, int chunk_id, chunk *chunk);
+
+		void check_timeouts(consumer_group &g);
+		void check_timeouts(consumer_group &g, lane &l, time_t now);
 };
 
 }} // namespace ioremap::grape
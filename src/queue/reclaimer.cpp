@@ -0,0 +1,178 @@
+#include "queue.hpp"
+
+extern std::shared_ptr<cocaine::framework::logger_t> grape_queue_module_get_logger();
+#define LOG_INFO(...) COCAINE_LOG_INFO(grape_queue_module_get_logger(), __VA_ARGS__)
+#define LOG_ERROR(...) COCAINE_LOG_ERROR(grape_queue_module_get_logger(), __VA_ARGS__)
+#define LOG_DEBUG(...) COCAINE_LOG_DEBUG(grape_queue_module_get_logger(), __VA_ARGS__)
+
+namespace {
+	// failed remove is retried this many times before giving up on the key
+	const int MAX_REMOVE_ATTEMPTS = 3;
+	// delay before the first retry, it doubles with every next one
+	const std::chrono::milliseconds RETRY_DELAY(500);
+}
+
+ioremap::grape::reclaimer::reclaimer(const ioremap::elliptics::session &session, int concurrency)
+	: m_session(session.clone())
+	, m_concurrency(concurrency)
+	, m_in_flight(0)
+	, m_stopping(false)
+{
+	m_session.set_exceptions_policy(ioremap::elliptics::session::no_exceptions);
+
+	memset(&m_stat, 0, sizeof(struct reclaim_stat));
+}
+
+ioremap::grape::reclaimer::~reclaimer()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_stopping = true;
+	m_cond.notify_all();
+
+	// completion callbacks refer to this object
+	m_cond.wait(lock, [this] { return m_in_flight == 0; });
+	lock.unlock();
+
+	if (m_retry_thread.joinable()) {
+		m_retry_thread.join();
+	}
+}
+
+void ioremap::grape::reclaimer::enqueue(const ioremap::elliptics::key &key)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_pending.push_back({key, 0});
+		++m_stat.queued;
+	}
+
+	kick();
+}
+
+void ioremap::grape::reclaimer::drain()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_cond.wait(lock, [this] { return m_pending.empty() && m_retries.empty() && m_in_flight == 0; });
+}
+
+void ioremap::grape::reclaimer::kick()
+{
+	std::vector<item> batch;
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		batch = take_batch();
+	}
+
+	send(batch);
+}
+
+std::vector<ioremap::grape::reclaimer::item> ioremap::grape::reclaimer::take_batch()
+{
+	std::vector<item> batch;
+	while (m_in_flight < m_concurrency && !m_pending.empty() && !m_stopping) {
+		batch.push_back(m_pending.front());
+		m_pending.pop_front();
+		++m_in_flight;
+	}
+	return batch;
+}
+
+void ioremap::grape::reclaimer::send(const std::vector<item> &batch)
+{
+	// object is not touched at all when there is nothing to send,
+	// destructor could be already done with it otherwise
+	if (batch.empty()) {
+		return;
+	}
+
+	LOG_DEBUG("reclaimer: sending %ld removes", batch.size());
+
+	ioremap::elliptics::session session = m_session.clone();
+
+	for (auto i = batch.begin(); i != batch.end(); ++i) {
+		const item it = *i;
+		session.remove(it.key).connect(
+			ioremap::elliptics::async_result<ioremap::elliptics::remove_result_entry>::result_function(),
+			[this, it] (const ioremap::elliptics::error_info &error) {
+				complete(it, error);
+			}
+		);
+	}
+}
+
+void ioremap::grape::reclaimer::complete(item it, const ioremap::elliptics::error_info &error)
+{
+	std::vector<item> batch;
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		--m_in_flight;
+
+		// key which is already gone is as good as removed
+		if (error && error.code() != -ENOENT) {
+			if (++it.attempts < MAX_REMOVE_ATTEMPTS && !m_stopping) {
+				auto due = std::chrono::steady_clock::now() + RETRY_DELAY * (1 << (it.attempts - 1));
+				m_retries.insert(std::make_pair(due, it));
+				++m_stat.retried;
+
+				if (!m_retry_thread.joinable()) {
+					m_retry_thread = std::thread(&reclaimer::run_retries, this);
+				}
+			} else {
+				LOG_ERROR("reclaimer: giving up removing %s after %d attempts: %s",
+						it.key.remote().c_str(), it.attempts, error.message().c_str());
+				++m_stat.failed;
+			}
+		} else {
+			++m_stat.removed;
+		}
+
+		batch = take_batch();
+		m_cond.notify_all();
+	}
+
+	send(batch);
+}
+
+void ioremap::grape::reclaimer::run_retries()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+
+	while (!m_stopping) {
+		if (m_retries.empty()) {
+			m_cond.wait(lock);
+			continue;
+		}
+
+		auto now = std::chrono::steady_clock::now();
+		if (m_retries.begin()->first > now) {
+			m_cond.wait_until(lock, m_retries.begin()->first);
+			continue;
+		}
+
+		while (!m_retries.empty() && m_retries.begin()->first <= now) {
+			m_pending.push_back(m_retries.begin()->second);
+			m_retries.erase(m_retries.begin());
+		}
+
+		lock.unlock();
+		kick();
+		lock.lock();
+	}
+
+	// removes which are not retried are given up on
+	m_stat.failed += m_retries.size();
+	m_retries.clear();
+	m_cond.notify_all();
+}
+
+struct ioremap::grape::reclaim_stat ioremap::grape::reclaimer::stat()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	reclaim_stat st = m_stat;
+	st.in_flight = m_in_flight;
+	st.pending = m_pending.size() + m_retries.size();
+	return st;
+}
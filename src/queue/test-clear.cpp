@@ -0,0 +1,125 @@
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <stdexcept>
+#include <thread>
+
+#include <boost/program_options.hpp>
+
+#include <grape/elliptics_client_state.hpp>
+#include <grape/data_array.hpp>
+
+// Push after clear: chunks pushed right after queue@clear reuse chunk ids
+// (and so storage keys) of the cleared ones, removes of the cleared chunks
+// must not take them down. Every entry pushed after clear must come out,
+// none of the ones pushed before it.
+//
+// Runs against a live queue app, all requests go to the same queue worker.
+
+namespace {
+
+ioremap::elliptics::data_pointer call(ioremap::elliptics::session &client, dnet_id &id,
+		const std::string &event, const std::string &data)
+{
+	auto results = client.exec(&id, 0, "queue@" + event, data).get();
+	for (auto it = results.begin(); it != results.end(); ++it) {
+		if (it->error()) {
+			throw std::runtime_error(event + ": " + it->error().message());
+		}
+		if (!it->context().data().empty()) {
+			return it->context().data();
+		}
+	}
+	return ioremap::elliptics::data_pointer();
+}
+
+void push(ioremap::elliptics::session &client, dnet_id &id, const std::string &prefix, int count)
+{
+	for (int i = 0; i < count; ++i) {
+		ioremap::elliptics::data_pointer reply = call(client, id, "push", prefix + std::to_string(i));
+		if (!reply.empty()) {
+			throw std::runtime_error("push refused: " + reply.to_string());
+		}
+	}
+}
+
+}
+
+using namespace boost::program_options;
+
+int main(int argc, char** argv)
+{
+	options_description opts("Options");
+	opts.add_options()
+		("help", "help message")
+		("remote,r", value<std::string>(), "remote elliptics node addr to connect to")
+		("group,g", value<std::vector<int>>()->multitoken(), "group(s) to connect to")
+		("entries,n", value<int>()->default_value(25000), "entries to push before and after clear, "
+			"a few chunks worth of them")
+		("wait,w", value<int>()->default_value(5), "seconds to give late removes to land before popping")
+		;
+
+	variables_map args;
+	store(parse_command_line(argc, argv, opts), args);
+	notify(args);
+
+	if (args.count("help") || !args.count("remote") || !args.count("group")) {
+		std::cout << opts << "\n";
+		return 1;
+	}
+
+	std::vector<std::string> remotes(1, args["remote"].as<std::string>());
+	auto clientlib = elliptics_client_state::create(remotes, args["group"].as<std::vector<int>>(), "/dev/stderr", 0);
+	ioremap::elliptics::session client = clientlib.create_session();
+
+	dnet_id id;
+	memset(&id, 0, sizeof(id));
+	client.transform(std::string("test-clear"), id);
+
+	const int entries = args["entries"].as<int>();
+
+	try {
+		call(client, id, "clear", std::string());
+		push(client, id, "before-", entries);
+		call(client, id, "clear", std::string());
+		push(client, id, "after-", entries);
+
+		std::this_thread::sleep_for(std::chrono::seconds(args["wait"].as<int>()));
+
+		std::vector<bool> seen(entries);
+		int popped = 0;
+		while (true) {
+			ioremap::elliptics::data_pointer reply = call(client, id, "pop-multi", "1000");
+			if (reply.empty()) {
+				break;
+			}
+
+			auto array = ioremap::grape::deserialize<ioremap::grape::data_array>(reply);
+			size_t offset = 0;
+			for (size_t i = 0; i < array.sizes().size(); ++i) {
+				std::string entry(array.data().data() + offset, array.sizes()[i]);
+				offset += array.sizes()[i];
+
+				if (entry.compare(0, 6, "after-") != 0) {
+					std::cerr << "FAILED: entry pushed before clear came out: " << entry << "\n";
+					return 1;
+				}
+				seen[std::stoi(entry.substr(6))] = true;
+				++popped;
+			}
+		}
+
+		int missing = std::count(seen.begin(), seen.end(), false);
+		if (missing) {
+			std::cerr << "FAILED: " << missing << " of " << entries << " entries pushed after clear are lost\n";
+			return 1;
+		}
+
+		std::cout << "ok: " << popped << " entries pushed after clear came out\n";
+	} catch (const std::exception &e) {
+		std::cerr << "FAILED: " << e.what() << "\n";
+		return 1;
+	}
+
+	return 0;
+}